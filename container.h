@@ -1,448 +1,2357 @@
+#pragma once
+
+#include "growable_mapped_file.h"
+#include "record_arena.h"
 #include <boost/interprocess/managed_mapped_file.hpp>
 #include <boost/interprocess/allocators/allocator.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
 #include <boost/functional/hash.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <functional>
 #include <memory>
+#include <optional>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace HardDriveContainers
+{
+
+namespace bipc = boost::interprocess;
+
+// Character sequences: C strings and anything with char data() and size(), e.g.
+// std::string, std::string_view and bipc::basic_string.
+template <class T, class Enable = void>
+struct IsStringLike : std::is_convertible<const T&, const char*>
+{};
+
+template <class T>
+struct IsStringLike<T, std::void_t<decltype(std::declval<const T&>().data()), decltype(std::declval<const T&>().size())>>
+    : std::is_same<std::remove_cv_t<std::remove_pointer_t<decltype(std::declval<const T&>().data())>>, char>
+{};
+
+template <class T>
+std::string_view AsStringView(const T& value)
+{
+    if constexpr (std::is_convertible<const T&, const char*>::value)
+    {
+        return std::string_view(value);
+    }
+    else
+    {
+        return std::string_view(value.data(), value.size());
+    }
+}
+
+// Transparent hash: string-like values hash by their characters, the same way
+// boost::hash hashes strings, so lookups never have to build a stored Key.
+struct Hash
+{
+    using is_transparent = void;
+
+    template <class T>
+    size_t operator ()(const T& value) const
+    {
+        if constexpr (IsStringLike<T>::value)
+        {
+            const std::string_view view = AsStringView(value);
+            return boost::hash_range(view.begin(), view.end());
+        }
+        else
+        {
+            return boost::hash<T>()(value);
+        }
+    }
+};
+
+struct EqualTo
+{
+    using is_transparent = void;
+
+    template <class T, class U>
+    bool operator ()(const T& lhv, const U& rhv) const
+    {
+        if constexpr (IsStringLike<T>::value && IsStringLike<U>::value)
+        {
+            return AsStringView(lhv) == AsStringView(rhv);
+        }
+        else
+        {
+            return lhv == rhv;
+        }
+    }
+};
+
+// How keys and values are stored inside node records: trivially copyable types as
+// their object representation, string-like types as their characters.
+template <class T, class Enable = void>
+struct RecordTraits
+{
+    static_assert(std::is_trivially_copyable<T>::value, "Map stores only string-like or trivially copyable types");
+
+    using view_type = T;
+
+    template <class U>
+    static std::array<char, sizeof(T)> Encode(const U& value)
+    {
+        const T converted(value);
+        std::array<char, sizeof(T)> bytes;
+        std::memcpy(bytes.data(), &converted, sizeof(T));
+        return bytes;
+    }
+
+    static view_type View(const char* data, const size_t)
+    {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        return value;
+    }
+};
+
+template <class T>
+struct RecordTraits<T, std::enable_if_t<IsStringLike<T>::value>>
+{
+    using view_type = std::string_view;
+
+    template <class U>
+    static std::string_view Encode(const U& value)
+    {
+        return AsStringView(value);
+    }
+
+    static view_type View(const char* data, const size_t size)
+    {
+        return view_type(data, size);
+    }
+};
+
+// Operation counts of one Map object since it was opened, not shared through the file.
+// lookups counts every key search, those done by inserts and erases included, and
+// chainSteps the key nodes they compared, or the slot groups they probed in open-addressing
+// maps: their ratio grows when the hash degenerates.
+struct MapCounters
+{
+    uint64_t inserts {0};
+    uint64_t erases {0};
+    uint64_t lookups {0};
+    uint64_t chainSteps {0};
+    uint64_t remaps {0};
+    uint64_t grows {0};
+};
+
+// What Map::Stats found. Histograms cover the sampled buckets only: chainLengths[n]
+// counts buckets with n keys, valuesPerKey[n] keys with 2^n to 2^(n+1) - 1 values.
+struct MapStats
+{
+    size_t keyCount {0};
+    size_t valueCount {0};
+    size_t bucketCount {0};
+    double loadFactor {0.0};
+    size_t sampledBuckets {0};
+    size_t sampledKeys {0};
+    size_t emptyBuckets {0};
+    size_t maxChainLength {0};
+    std::vector<size_t> chainLengths;
+    size_t maxValuesPerKey {0};
+    std::vector<size_t> valuesPerKey;
+    size_t segmentBytes {0};
+    size_t freeBytes {0};
+    size_t recordFreeBytes {0};
+    MapCounters counters;
+    // Open-addressing maps only: probeLengths[n] counts keys found in the n-th group probed.
+    std::vector<size_t> probeLengths;
+};
+
+// A counter bumped with a relaxed fetch_add: exact when threads share one Map, and
+// ordered with nothing else, so it costs a lookup no more than one uncontended atomic add.
+class StatCounter
+{
+public:
+    StatCounter() = default;
+
+    StatCounter(const StatCounter& rhv)
+        : m_Value(rhv.Get())
+    {}
+
+    StatCounter& operator =(const StatCounter& rhv)
+    {
+        m_Value.store(rhv.Get(), std::memory_order_relaxed);
+        return *this;
+    }
+
+    void Add(const uint64_t count = 1)
+    {
+        m_Value.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    uint64_t Get() const
+    {
+        return m_Value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> m_Value {0};
+};
+
+// Whether Map<Key, Value> takes the open-addressing layout of flat_map.h: both types are
+// fixed-size and trivially copyable. Specialize as std::false_type to keep such a pair in
+// key nodes, e.g. for keys with very many values each.
+template <class Key, class Value>
+struct IsFlatStorable : std::bool_constant<!IsStringLike<Key>::value && !IsStringLike<Value>::value &&
+                                           std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value>
+{};
+
+// Marks a write section on a seqlock sequence, for the single writer.
+class WriteSection
+{
+public:
+    explicit WriteSection(std::atomic<uint64_t>& sequence)
+        : m_Sequence(sequence)
+    {
+        m_Sequence.store(m_Sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    WriteSection(const WriteSection&) = delete;
+    WriteSection& operator =(const WriteSection&) = delete;
+
+    ~WriteSection()
+    {
+        m_Sequence.store(m_Sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    std::atomic<uint64_t>& m_Sequence;
+};
+
+// Converts a lookup argument to something Hash and EqualTo accept without allocating:
+// string-like arguments are viewed in place, other types are converted to Result.
+template <typename Result, typename T>
+decltype(auto) LookupParam(const T& value)
+{
+    if constexpr (IsStringLike<T>::value || std::is_same<T, Result>::value)
+    {
+        return (value);
+    }
+    else
+    {
+        return Result(value);
+    }
+}
+
+// The file side shared by both layouts of Map: mapping, growing, remapping and replacing
+// the file, and the operation counters. Derived finds its header again in
+// OnMappingMoved(), checked by CheckFormat against Derived::FORMAT_VERSION, and advises
+// the kernel about its bucket array in AdviseBuckets().
+template <class Derived>
+class MappedMap
+{
+public:
+    bipc::managed_mapped_file::segment_manager* GetSegmentManager() const
+    {
+        return m_MappedFile->get_segment_manager();
+    }
+
+    MapCounters Counters() const
+    {
+        return MapCounters {m_Counters.inserts.Get(), m_Counters.erases.Get(), m_Counters.lookups.Get(),
+                            m_Counters.chainSteps.Get(), m_Counters.remaps.Get(), m_Counters.grows.Get()};
+    }
+
+protected:
+    MappedMap(const char* filename, const size_t fileSize)
+        : m_Filename(filename)
+        , m_MappedFile(new GrowableMappedFile(bipc::open_or_create, filename, fileSize))
+    {
+        m_MappedSize = m_MappedFile->GetMappedSegmentSize();
+    }
+
+    MappedMap(bipc::open_read_only_t, const char* filename, const PrewarmOptions& prewarm)
+        : m_Filename(filename)
+        , m_ReadOnly(true)
+        , m_Prewarm(prewarm)
+        , m_MappedFile(new GrowableMappedFile(bipc::open_read_only, filename, prewarm.populate))
+    {
+        m_MappedSize = m_MappedFile->GetMappedSegmentSize();
+    }
+
+    MappedMap(MappedMap&&) = default;
+    MappedMap& operator =(MappedMap&&) = default;
+    ~MappedMap() = default;
+
+    // Maps the file by its name again, after Compact replaced it.
+    void Reopen() const
+    {
+        if (m_ReadOnly)
+        {
+            m_MappedFile.reset(new GrowableMappedFile(bipc::open_read_only, m_Filename.c_str(), m_Prewarm.populate));
+        }
+        else
+        {
+            m_MappedFile.reset(new GrowableMappedFile(bipc::open_or_create, m_Filename.c_str(), 0));
+        }
+
+        m_MappedSize = m_MappedFile->GetMappedSegmentSize();
+        m_Counters.remaps.Add();
+        Self().OnMappingMoved();
+
+        if (m_ReadOnly)
+        {
+            Prewarm(m_Prewarm);
+        }
+    }
+
+    void Prewarm(const PrewarmOptions& prewarm) const
+    {
+        if (prewarm.randomAccess)
+        {
+            m_MappedFile->AdviseAll(MADV_RANDOM);
+        }
+
+        if (prewarm.hugePages)
+        {
+            m_MappedFile->AdviseAll(MADV_HUGEPAGE);
+        }
+
+        if (prewarm.willNeedBuckets)
+        {
+            Self().AdviseBuckets();
+        }
+    }
+
+    // The writer grows the file in place; readers see the new size in the segment header
+    // and map the new tail of the file behind their mapping.
+    bool RemapIfGrown() const
+    {
+        if (GetSegmentManager()->get_size() <= m_MappedSize)
+        {
+            return false;
+        }
+
+        if (m_MappedFile->Refresh())
+        {
+            Self().OnMappingMoved();
+        }
+        m_MappedSize = m_MappedFile->GetMappedSegmentSize();
+        m_Counters.remaps.Add();
+        return true;
+    }
+
+    template <class HeaderT>
+    static void CheckFormat(const HeaderT* header)
+    {
+        if (!header)
+        {
+            throw bipc::interprocess_exception("No map found in the file");
+        }
+
+        if (header->formatVersion != Derived::FORMAT_VERSION)
+        {
+            throw bipc::interprocess_exception("Unsupported map file format");
+        }
+    }
+
+    // Points header at the one stored under name and checks it.
+    template <class HeaderT>
+    void FindHeader(const char* name, HeaderT*& header) const
+    {
+        header = GetSegmentManager()->template find_no_lock<HeaderT>(name).first;
+        CheckFormat(header);
+    }
+
+    void CheckWritable() const
+    {
+        if (m_ReadOnly)
+        {
+            throw bipc::interprocess_exception("Map is opened read-only");
+        }
+    }
+
+    void ReserveFreeMemory(const size_t bytes)
+    {
+        if (GetSegmentManager()->get_free_memory() < bytes)
+        {
+            GrowFile(bytes);
+        }
+    }
+
+    void GrowFile(const size_t bytes)
+    {
+        if (m_MappedFile->Grow(std::max(GetSegmentManager()->get_size() / 2, bytes * 2)))
+        {
+            Self().OnMappingMoved();
+        }
+        m_MappedSize = m_MappedFile->GetMappedSegmentSize();
+        m_Counters.grows.Add();
+    }
+
+    // Has writeCopy(const char* filename) write the compacted copy of the map, syncs it,
+    // renames it over the map's file and maps it. replaced tells readers of the old file to
+    // reopen it. An exception before the rename leaves the map as it was.
+    template <class WriteCopy>
+    void ReplaceFile(WriteCopy writeCopy, std::atomic<bool>& replaced)
+    {
+        const std::string compactFilename = m_Filename + ".compact";
+
+        std::remove(compactFilename.c_str());
+
+        try
+        {
+            writeCopy(compactFilename.c_str());
+        }
+        catch (...)
+        {
+            std::remove(compactFilename.c_str());
+            throw;
+        }
+
+        bipc::managed_mapped_file::shrink_to_fit(compactFilename.c_str());
+
+        if (!SyncPath(compactFilename) || std::rename(compactFilename.c_str(), m_Filename.c_str()) != 0)
+        {
+            std::remove(compactFilename.c_str());
+            throw bipc::interprocess_exception(("Can't replace " + m_Filename + " with its compacted copy").c_str());
+        }
+
+        replaced.store(true, std::memory_order_release);
+        Reopen();
+
+        if (!SyncPath(DirectoryOf(m_Filename)))
+        {
+            throw bipc::interprocess_exception(("Can't sync the directory of " + m_Filename).c_str());
+        }
+    }
+
+    bool InBounds(const void* data, const size_t bytes) const
+    {
+        const char* begin = reinterpret_cast<const char*>(GetSegmentManager());
+        const char* pointer = static_cast<const char*>(data);
+
+        return pointer >= begin && bytes <= m_MappedSize && size_t(pointer - begin) <= m_MappedSize - bytes;
+    }
+
+    static void AddToHistogram(const size_t index, std::vector<size_t>& histogram)
+    {
+        if (histogram.size() <= index)
+        {
+            histogram.resize(index + 1);
+        }
+        ++histogram[index];
+    }
+
+    static void AddHistogram(const std::vector<size_t>& from, std::vector<size_t>& to)
+    {
+        to.resize(std::max(to.size(), from.size()));
+
+        for (size_t index = 0; index < from.size(); ++index)
+        {
+            to[index] += from[index];
+        }
+    }
+
+    std::string m_Filename;
+    bool m_ReadOnly {false};
+    PrewarmOptions m_Prewarm;
+
+    // Readers remap the file from const lookups once the writer has grown it.
+    mutable size_t m_MappedSize {0};
+    mutable std::unique_ptr<GrowableMappedFile> m_MappedFile;
+
+    struct CountersT
+    {
+        StatCounter inserts;
+        StatCounter erases;
+        StatCounter lookups;
+        StatCounter chainSteps;
+        StatCounter remaps;
+        StatCounter grows;
+    };
+
+    mutable CountersT m_Counters;
+
+private:
+    const Derived& Self() const
+    {
+        return static_cast<const Derived&>(*this);
+    }
+};
+
+// Lookup and iteration results shared by both layouts of Map. Each Map describes its
+// records with a LayoutT member: Node holds a key, its first value, valueChunk and
+// childCount; Chunk holds later values at positions [begin, capacity) and nextChunk.
+// HasFirstValue, FirstValue, ChunkValue and NextPosition read the values, KeyOf the key,
+// and Seek and Next step through the nodes in bucket order from a bucket index on.
+
+// Result of Find: a view of the newest value of a key, or null if there is none.
+template <class ValueView>
+class MapValuePtr
+{
+public:
+    MapValuePtr(std::nullptr_t = nullptr)
+    {}
+
+    explicit MapValuePtr(const ValueView& value)
+        : m_Value(value)
+        , m_Valid(true)
+    {}
+
+    const ValueView& operator *() const
+    {
+        return m_Value;
+    }
+
+    const ValueView* operator ->() const
+    {
+        return &m_Value;
+    }
+
+    explicit operator bool() const
+    {
+        return m_Valid;
+    }
+
+    friend bool operator ==(const MapValuePtr& lhv, std::nullptr_t)
+    {
+        return !lhv.m_Valid;
+    }
+
+    friend bool operator !=(const MapValuePtr& lhv, std::nullptr_t)
+    {
+        return lhv.m_Valid;
+    }
+
+private:
+    ValueView m_Value {};
+    bool m_Valid {false};
+};
+
+// Iterates the values of one key, newest first: the chunks, then the node's first value.
+template <class Layout>
+class MapValueIterator
+{
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = typename Layout::value_view;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type*;
+    using reference = value_type;
+
+    MapValueIterator()
+    {}
+
+    explicit MapValueIterator(const typename Layout::Node* node)
+        : m_Chunk(node->valueChunk.get())
+        , m_Position((m_Chunk) ? m_Chunk->begin : 0)
+        , m_Node(Layout::HasFirstValue(*node) ? node : nullptr)
+    {}
+
+    value_type operator *() const
+    {
+        return (m_Chunk) ? Layout::ChunkValue(*m_Chunk, m_Position) : Layout::FirstValue(*m_Node);
+    }
+
+    // Chunks in the list are never empty, so the next one always has an entry at begin.
+    MapValueIterator& operator ++()
+    {
+        if (m_Chunk)
+        {
+            m_Position = Layout::NextPosition(*m_Chunk, m_Position);
+
+            if (m_Position == m_Chunk->capacity)
+            {
+                m_Chunk = m_Chunk->nextChunk.get();
+                m_Position = (m_Chunk) ? m_Chunk->begin : 0;
+            }
+        }
+        else
+        {
+            m_Node = nullptr;
+        }
+        return *this;
+    }
+
+    MapValueIterator operator ++(int)
+    {
+        MapValueIterator previous = *this;
+        ++(*this);
+        return previous;
+    }
+
+    bool operator ==(const MapValueIterator& rhv) const
+    {
+        return m_Chunk == rhv.m_Chunk && m_Position == rhv.m_Position && m_Node == rhv.m_Node;
+    }
+
+    bool operator !=(const MapValueIterator& rhv) const
+    {
+        return !(*this == rhv);
+    }
+
+private:
+    const typename Layout::Chunk* m_Chunk {nullptr};
+    size_t m_Position {0};
+    const typename Layout::Node* m_Node {nullptr};
+};
+
+// Result of FindAll: all values of a key, newest first.
+template <class Layout>
+class MapValueRange
+{
+public:
+    MapValueRange()
+    {}
+
+    explicit MapValueRange(const typename Layout::Node* node)
+        : m_Node(node)
+    {}
+
+    MapValueIterator<Layout> begin() const
+    {
+        return (m_Node) ? MapValueIterator<Layout>(m_Node) : MapValueIterator<Layout>();
+    }
+
+    MapValueIterator<Layout> end() const
+    {
+        return MapValueIterator<Layout>();
+    }
+
+    size_t size() const
+    {
+        return (m_Node) ? m_Node->childCount : 0;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+private:
+    const typename Layout::Node* m_Node {nullptr};
+};
+
+// Iterates the keys of a Map in bucket order, as ForEach visits them: dereferences to a
+// (key_view, ValueRange) pair viewed in place. Any write to the map invalidates it.
+template <class Layout>
+class MapKeyIterator
+{
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::pair<typename Layout::key_view, MapValueRange<Layout>>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type*;
+    using reference = value_type;
+
+    MapKeyIterator()
+    {}
+
+    MapKeyIterator(const typename Layout::MapT* map, const size_t bucketIndex)
+        : m_Map(map)
+        , m_BucketIndex(bucketIndex)
+        , m_Node(Layout::Seek(*m_Map, m_BucketIndex))
+    {}
+
+    value_type operator *() const
+    {
+        return value_type(Layout::KeyOf(*m_Node), MapValueRange<Layout>(m_Node));
+    }
+
+    MapKeyIterator& operator ++()
+    {
+        m_Node = Layout::Next(*m_Map, m_BucketIndex, *m_Node);
+        return *this;
+    }
+
+    MapKeyIterator operator ++(int)
+    {
+        MapKeyIterator previous = *this;
+        ++(*this);
+        return previous;
+    }
+
+    bool operator ==(const MapKeyIterator& rhv) const
+    {
+        return m_Node == rhv.m_Node;
+    }
+
+    bool operator !=(const MapKeyIterator& rhv) const
+    {
+        return !(*this == rhv);
+    }
+
+private:
+    const typename Layout::MapT* m_Map {nullptr};
+    size_t m_BucketIndex {0};
+    const typename Layout::Node* m_Node {nullptr};
+};
+
+// Layout is only there for the specialization of flat_map.h; the key node layout below
+// takes every other pair of types.
+template <class Key,
+         class Value,
+         class KeyHash = Hash,
+         class KeyEqual = EqualTo,
+         class Layout = void>
+class Map : public MappedMap<Map<Key, Value, KeyHash, KeyEqual, Layout>>
+{
+private:
+    using Base = MappedMap<Map>;
+    friend Base;
+
+    using Base::m_Filename;
+    using Base::m_ReadOnly;
+    using Base::m_Prewarm;
+    using Base::m_MappedSize;
+    using Base::m_MappedFile;
+    using Base::m_Counters;
+    using Base::Reopen;
+    using Base::Prewarm;
+    using Base::RemapIfGrown;
+    using Base::CheckFormat;
+    using Base::FindHeader;
+    using Base::CheckWritable;
+    using Base::ReserveFreeMemory;
+    using Base::ReplaceFile;
+    using Base::InBounds;
+    using Base::AddToHistogram;
+    using Base::AddHistogram;
+
+    using KeyTraits = RecordTraits<Key>;
+    using ValueTraits = RecordTraits<Value>;
+
+    struct ValueChunkT;
+    using ValueChunkPtr = bipc::offset_ptr<ValueChunkT>;
+
+    // Values after a key's first one, packed into chunks: each entry is the value size
+    // followed by the value bytes. A chunk fills from its end towards its start, so its
+    // entries [begin, capacity) run newest first, and the newest chunk heads the list.
+    // Chunks double in size up to MAX_VALUE_CHUNK_SIZE, so many values of one key are
+    // read sequentially instead of node by node.
+    struct ValueChunkT
+    {
+        explicit ValueChunkT(const uint32_t bytes)
+            : capacity(bytes)
+            , begin(bytes)
+        {}
+
+        ValueChunkT(const ValueChunkT&) = delete;
+        ValueChunkT& operator =(const ValueChunkT&) = delete;
+
+        const char* Data() const
+        {
+            return reinterpret_cast<const char*>(this + 1);
+        }
+
+        char* Data()
+        {
+            return reinterpret_cast<char*>(this + 1);
+        }
+
+        // Entries are unaligned, so their sizes are copied in and out.
+        static uint32_t EntryValueSize(const char* entry)
+        {
+            uint32_t size;
+            std::memcpy(&size, entry, sizeof(size));
+            return size;
+        }
+
+        static constexpr size_t ENTRY_HEADER_SIZE {sizeof(uint32_t)};
+
+        ValueChunkPtr nextChunk {nullptr};
+        const uint32_t capacity;
+        uint32_t begin;
+    };
+
+    struct KeyNodeT;
+    using KeyNodePtr = bipc::offset_ptr<KeyNodeT>;
+
+    // One allocation per key: the node header followed by the key bytes and the bytes of
+    // the first value inserted for it. Later values go to a list of ValueChunkT. The first
+    // value's space stays in the record after it is erased, firstValueCapacity keeps its
+    // size for freeing the record.
+    struct KeyNodeT
+    {
+        KeyNodeT(const size_t keyHash, const uint32_t keyBytes, const uint32_t valueBytes)
+            : hash(keyHash)
+            , keySize(keyBytes)
+            , firstValueSize(valueBytes)
+            , firstValueCapacity(valueBytes)
+        {}
+
+        KeyNodeT(const KeyNodeT&) = delete;
+        KeyNodeT& operator =(const KeyNodeT&) = delete;
+
+        const char* Data() const
+        {
+            return reinterpret_cast<const char*>(this + 1);
+        }
+
+        char* Data()
+        {
+            return reinterpret_cast<char*>(this + 1);
+        }
+
+        bool HasFirstValue() const
+        {
+            return firstValueSize != NO_VALUE;
+        }
+
+        static constexpr uint32_t NO_VALUE {std::numeric_limits<uint32_t>::max()};
+
+        KeyNodePtr nextKeyNode {nullptr};
+        ValueChunkPtr valueChunk {nullptr};
+        const size_t hash;
+        size_t childCount {0};
+        const uint32_t keySize;
+        uint32_t firstValueSize;
+        const uint32_t firstValueCapacity;
+    };
+
+    using EncodedKeyT = decltype(KeyTraits::Encode(std::declval<const Key&>()));
+    using EncodedValueT = decltype(ValueTraits::Encode(std::declval<const Value&>()));
+
+    struct BatchEntryT
+    {
+        std::string_view KeyBytes() const
+        {
+            return std::string_view(key.data(), key.size());
+        }
+
+        std::string_view ValueBytes() const
+        {
+            return std::string_view(value.data(), value.size());
+        }
+
+        EncodedKeyT key;
+        EncodedValueT value;
+        size_t hash {0};
+        size_t bucket {0};
+        size_t recordSize {0};
+    };
+
+    using BucketAllocator = bipc::allocator<KeyNodePtr, bipc::managed_mapped_file::segment_manager>;
+    using BucketSegmentPtr = typename BucketAllocator::pointer;
+
+    static constexpr size_t MAX_BUCKET_SEGMENTS {48};
+    static constexpr size_t STRIPE_COUNT {1024};
+    static constexpr uint32_t FORMAT_VERSION {5};
+
+    using SequenceT = std::atomic<uint64_t>;
+
+    // Persistent map state. Buckets grow by linear hashing: bucket segment 0 holds the
+    // initial buckets, segment i > 0 holds initialBucketCount << (i - 1) buckets, so
+    // splitting never moves the buckets allocated earlier.
+    //
+    // The sequences are seqlocks for readers in other processes: the writer makes a
+    // stripe's sequence odd while it changes any chain of the stripe, layoutSequence while
+    // it changes level and splitIndex. A bucket's stripe is taken from its index modulo
+    // initialBucketCount, which a split keeps, so keys never leave their stripe. replaced
+    // tells readers that Compact renamed a new file over this one.
+    struct HeaderT
+    {
+        HeaderT(const size_t bucketCount)
+            : initialBucketCount(bucketCount)
+        {}
+
+        HeaderT(const HeaderT&) = delete;
+        HeaderT& operator =(const HeaderT&) = delete;
+
+        const uint32_t formatVersion {FORMAT_VERSION};
+        const size_t initialBucketCount;
+        size_t level {0};
+        size_t splitIndex {0};
+        size_t keyCount {0};
+        size_t size {0};
+        BucketSegmentPtr bucketSegments[MAX_BUCKET_SEGMENTS];
+        RecordArena records;
+        SequenceT layoutSequence {0};
+        SequenceT stripeSequences[STRIPE_COUNT] {};
+        std::atomic<bool> replaced {false};
+    };
+
+    // How the lookup and iteration results shared with flat_map.h read key nodes.
+    struct LayoutT
+    {
+        using MapT = Map;
+        using Node = KeyNodeT;
+        using Chunk = ValueChunkT;
+        using key_view = typename KeyTraits::view_type;
+        using value_view = typename ValueTraits::view_type;
+
+        static bool HasFirstValue(const KeyNodeT& keyNode)
+        {
+            return keyNode.HasFirstValue();
+        }
+
+        static value_view FirstValue(const KeyNodeT& keyNode)
+        {
+            return ValueTraits::View(keyNode.Data() + keyNode.keySize, keyNode.firstValueSize);
+        }
+
+        // Positions are byte offsets of the entries.
+        static value_view ChunkValue(const ValueChunkT& chunk, const size_t offset)
+        {
+            const char* entry = chunk.Data() + offset;
+            return ValueTraits::View(entry + ValueChunkT::ENTRY_HEADER_SIZE, ValueChunkT::EntryValueSize(entry));
+        }
+
+        static size_t NextPosition(const ValueChunkT& chunk, const size_t offset)
+        {
+            return offset + ValueChunkT::ENTRY_HEADER_SIZE + ValueChunkT::EntryValueSize(chunk.Data() + offset);
+        }
+
+        static key_view KeyOf(const KeyNodeT& keyNode)
+        {
+            return StoredKey(keyNode);
+        }
+
+        // The first key node in bucketIndex or a later bucket, null past the last one.
+        static const KeyNodeT* Seek(const Map& map, size_t& bucketIndex)
+        {
+            for (const size_t bucketCount = map.BucketCount(); bucketIndex < bucketCount; ++bucketIndex)
+            {
+                const KeyNodeT* keyNode = map.Bucket(bucketIndex).get();
+
+                if (keyNode)
+                {
+                    return keyNode;
+                }
+            }
+            return nullptr;
+        }
+
+        static const KeyNodeT* Next(const Map& map, size_t& bucketIndex, const KeyNodeT& keyNode)
+        {
+            const KeyNodeT* next = keyNode.nextKeyNode.get();
+
+            return (next) ? next : Seek(map, ++bucketIndex);
+        }
+    };
+
+public:
+    using Base::GetSegmentManager;
+    using Base::Counters;
+
+    using key_type = Key;
+    using value_type = Value;
+    using key_view = typename KeyTraits::view_type;
+    using value_view = typename ValueTraits::view_type;
+
+    // Result of Find. String values are viewed in place and stay valid until the value is
+    // erased: the file grows without moving its mapping.
+    using ValuePtr = MapValuePtr<value_view>;
+    using ValueIterator = MapValueIterator<LayoutT>;
+    using ValueRange = MapValueRange<LayoutT>;
+    using KeyIterator = MapKeyIterator<LayoutT>;
+    using iterator = KeyIterator;
+    using const_iterator = KeyIterator;
+
+    // bucketCount is the initial number of buckets of a newly created file. An existing
+    // file keeps the bucket layout stored in it, whatever bucketCount is passed.
+    Map(const char* filename, const size_t fileSize = DEFAULT_FILE_SIZE, const size_t bucketCount = DEFAULT_BUCKET_COUNT)
+        : Base(filename, std::max(fileSize, bucketCount * sizeof(KeyNodePtr) + sizeof(HeaderT) + MAX_PAIR_SIZE * 10))
+        , m_BucketAllocator(m_MappedFile->get_segment_manager())
+    {
+        m_Header = GetSegmentManager()->template find_or_construct<HeaderT>("Header")(std::max(bucketCount, 1ul));
+        CheckFormat(m_Header);
+
+        if (!m_Header->bucketSegments[0])
+        {
+            m_Header->bucketSegments[0] = AllocateBucketSegment(m_Header->initialBucketCount);
+        }
+    }
+
+    // Opens an existing file without write access: lookups work, modifications throw.
+    // Nothing is ever written to the mapping, not even allocator locks, so the file only
+    // needs to be readable. prewarm chooses how the page cache is warmed up for lookups.
+    Map(bipc::open_read_only_t, const char* filename, const PrewarmOptions& prewarm = PrewarmOptions())
+        : Base(bipc::open_read_only, filename, prewarm)
+        , m_BucketAllocator(m_MappedFile->get_segment_manager())
+    {
+        FindHeader("Header", m_Header);
+        Prewarm(prewarm);
+    }
+
+    Map(const Map&) = delete;
+    Map& operator =(const Map&) = delete;
+
+    Map(Map&& rhv)
+        : Base(std::move(rhv))
+        , m_Header(rhv.m_Header)
+        , m_BucketAllocator(std::move(rhv.m_BucketAllocator))
+        , m_KeyHasher(std::move(rhv.m_KeyHasher))
+        , m_KeyEqual(std::move(rhv.m_KeyEqual))
+    {}
+
+    Map& operator=(Map&& rhv)
+    {
+        Base::operator =(std::move(rhv));
+        m_Header = rhv.m_Header;
+        m_BucketAllocator = std::move(rhv.m_BucketAllocator);
+        m_KeyHasher = std::move(rhv.m_KeyHasher);
+        m_KeyEqual = std::move(rhv.m_KeyEqual);
+        return *this;
+    }
+
+    template <typename ProvidedKeyT, typename ProvidedValueT>
+    void Insert(const ProvidedKeyT& key, const ProvidedValueT& value)
+    {
+        CheckWritable();
+
+        const auto keyBytes = KeyTraits::Encode(key);
+        const auto valueBytes = ValueTraits::Encode(value);
+
+        ReserveFreeMemory(MAX_PAIR_SIZE + keyBytes.size() + valueBytes.size());
+        InsertImpl(LookupParam<Key>(key), std::string_view(keyBytes.data(), keyBytes.size()),
+                   std::string_view(valueBytes.data(), valueBytes.size()));
+        GrowBuckets(m_Header->keyCount, MIGRATION_STEP_BUCKETS);
+    }
+
+    // Bulk load of (key, value) pairs, e.g. std::pair or std::tuple-like objects with
+    // first and second members. Buckets and file space are reserved once for the whole
+    // batch, and all new key records are carved from a single block, laid out in bucket
+    // order.
+    template <typename Iterator>
+    void InsertBatch(Iterator first, Iterator last)
+    {
+        CheckWritable();
+
+        std::vector<BatchEntryT> batch;
+        size_t batchBytes = MAX_PAIR_SIZE;
+
+        for (; first != last; ++first)
+        {
+            BatchEntryT entry {KeyTraits::Encode(first->first), ValueTraits::Encode(first->second)};
+
+            entry.hash = m_KeyHasher(KeyTraits::View(entry.key.data(), entry.key.size()));
+            batchBytes += sizeof(KeyNodeT) + entry.key.size() + entry.value.size() + ALLOCATION_OVERHEAD;
+            batch.push_back(std::move(entry));
+        }
+
+        if (batch.empty())
+        {
+            return;
+        }
+
+        GrowBuckets(m_Header->keyCount + batch.size(), std::numeric_limits<size_t>::max());
+        ReserveFreeMemory(batchBytes);
+
+        for (BatchEntryT& entry : batch)
+        {
+            entry.bucket = BucketIndex(entry.hash);
+        }
+
+        std::stable_sort(batch.begin(), batch.end(), [](const BatchEntryT& lhv, const BatchEntryT& rhv)
+        {
+            return std::tie(lhv.bucket, lhv.hash) < std::tie(rhv.bucket, rhv.hash);
+        });
+
+        std::vector<size_t> recordSizes;
+        recordSizes.reserve(batch.size());
+
+        for (auto entry = batch.begin(), hashRun = batch.begin(); entry != batch.end(); ++entry)
+        {
+            if (hashRun->hash != entry->hash)
+            {
+                hashRun = entry;
+            }
+
+            const auto key = KeyTraits::View(entry->key.data(), entry->key.size());
+            bool newKey = !FindKeyNode(key, entry->hash).second;
+
+            for (auto previous = hashRun; newKey && previous != entry; ++previous)
+            {
+                newKey = !m_KeyEqual(KeyTraits::View(previous->key.data(), previous->key.size()), key);
+            }
+
+            if (newKey)
+            {
+                entry->recordSize = sizeof(KeyNodeT) + entry->key.size() + entry->value.size();
+                recordSizes.push_back(entry->recordSize);
+            }
+        }
+
+        std::vector<void*> records;
+        m_Header->records.AllocateContiguous(GetSegmentManager(), recordSizes, records);
+
+        auto record = records.begin();
+
+        for (const BatchEntryT& entry : batch)
+        {
+            const auto key = KeyTraits::View(entry.key.data(), entry.key.size());
+            std::pair<KeyNodePtr*, bool> result = FindKeyNode(key, entry.hash);
+
+            AddRecord(result.first, result.second, (result.second) ? nullptr : *record++, entry.hash,
+                      entry.KeyBytes(), entry.ValueBytes());
+        }
+    }
+
+    template <typename Range>
+    void InsertBatch(const Range& pairs)
+    {
+        InsertBatch(std::begin(pairs), std::end(pairs));
+    }
+
+    // Lookups and erases accept any key comparable with Key (for string keys: const char*,
+    // std::string, std::string_view, ...) and never allocate in the mapped segment.
+    //
+    // Find, FindAll and Count read the mapping directly and assume no other process is
+    // writing to the file. Get and GetAll can run while another process writes: they copy
+    // the values out and retry if the writer changed the key's stripe meanwhile, and
+    // remap the file if it grew or reopen it if it was compacted.
+    template <typename ProvidedKeyT>
+    ValuePtr Find(const ProvidedKeyT& key) const
+    {
+        ValueRange values = FindImpl(LookupParam<Key>(key));
+
+        return (values.empty()) ? nullptr : ValuePtr(*values.begin());
+    }
+
+    template <typename ProvidedKeyT>
+    ValueRange FindAll(const ProvidedKeyT& key) const
+    {
+        return FindImpl(LookupParam<Key>(key));
+    }
+
+    template <typename ProvidedKeyT>
+    std::optional<Value> Get(const ProvidedKeyT& key) const
+    {
+        std::optional<Value> value;
+
+        ReadShared(LookupParam<Key>(key), [&value]() { value.reset(); }, [&value](const value_view& stored)
+        {
+            value.emplace(stored);
+            return false;
+        });
+        return value;
+    }
+
+    template <typename ProvidedKeyT>
+    std::vector<Value> GetAll(const ProvidedKeyT& key) const
+    {
+        std::vector<Value> values;
+
+        ReadShared(LookupParam<Key>(key), [&values]() { values.clear(); }, [&values](const value_view& stored)
+        {
+            values.emplace_back(stored);
+            return true;
+        });
+        return values;
+    }
+
+    // Batch lookups: results[i] belongs to the i-th key. Keys are taken PREFETCH_GROUP_SIZE
+    // at a time; all their bucket heads are prefetched before any chain is walked, and
+    // FindMany and CountMany then advance the chains of the group in turns, prefetching
+    // each next node, so the cache misses of different keys overlap instead of adding up.
+    template <typename Range>
+    std::vector<ValueRange> FindMany(const Range& keys) const
+    {
+        std::vector<ValueRange> results;
+        results.reserve(std::distance(std::begin(keys), std::end(keys)));
+
+        FindManyImpl(std::begin(keys), std::end(keys), results);
+        return results;
+    }
+
+    template <typename Range>
+    std::vector<size_t> CountMany(const Range& keys) const
+    {
+        std::vector<size_t> counts;
+
+        for (const ValueRange& values : FindMany(keys))
+        {
+            counts.push_back(values.size());
+        }
+        return counts;
+    }
+
+    // GetAll for a batch, safe against a writer like GetAll. The chains of a group of keys
+    // are walked in turns as in FindMany, each walk checked against its stripe; a key whose
+    // walk overlapped a write is looked up again on its own.
+    template <typename Range>
+    std::vector<std::vector<Value>> GetMany(const Range& keys) const
+    {
+        std::vector<std::vector<Value>> results;
+        results.reserve(std::distance(std::begin(keys), std::end(keys)));
+
+        if (m_Header->replaced.load(std::memory_order_acquire))
+        {
+            Reopen();
+        }
+
+        GetManyImpl(std::begin(keys), std::end(keys), results);
+        return results;
+    }
+
+    // Calls visit(key_view, ValueRange) for every key, in bucket order. Like Find, assumes
+    // no other process writes to the file meanwhile.
+    template <typename Visitor>
+    void ForEach(Visitor visit) const
+    {
+        ForEachInRange(0, BucketCount(), visit);
+    }
+
+    // ForEach over the buckets in [bucketBegin, bucketEnd) only. Threads may walk disjoint
+    // ranges of one map at once, e.g. the threadCount slices of BucketCount() for a report
+    // over the whole index. The head of the bucket PREFETCH_GROUP_SIZE ahead is prefetched
+    // while the current chain is walked, so a cold scan waits on few page faults at a time.
+    template <typename Visitor>
+    void ForEachInRange(const size_t bucketBegin, size_t bucketEnd, Visitor visit) const
+    {
+        bucketEnd = std::min(bucketEnd, BucketCount());
+
+        for (size_t index = bucketBegin; index < bucketEnd; ++index)
+        {
+            if (index + PREFETCH_GROUP_SIZE < bucketEnd)
+            {
+                PrefetchKeyNode(Bucket(index + PREFETCH_GROUP_SIZE).get());
+            }
+
+            for (const KeyNodeT* keyNode = Bucket(index).get(); keyNode; keyNode = keyNode->nextKeyNode.get())
+            {
+                PrefetchKeyNode(keyNode->nextKeyNode.get());
+                visit(StoredKey(*keyNode), ValueRange(keyNode));
+            }
+        }
+    }
+
+    KeyIterator begin() const
+    {
+        return KeyIterator(this, 0);
+    }
+
+    KeyIterator end() const
+    {
+        return KeyIterator();
+    }
+
+    template <typename ProvidedKeyT>
+    size_t Erase(const ProvidedKeyT& key)
+    {
+        CheckWritable();
+        return EraseImpl(LookupParam<Key>(key));
+    }
+
+    template <typename ProvidedKeyT, typename ProvidedValueT>
+    size_t Erase(const ProvidedKeyT& key, const ProvidedValueT& value)
+    {
+        CheckWritable();
+        return EraseImpl(LookupParam<Key>(key), LookupParam<Value>(value));
+    }
+
+    template <typename ProvidedKeyT>
+    size_t Count(const ProvidedKeyT& key) const
+    {
+        return CountImpl(LookupParam<Key>(key));
+    }
+
+    // Makes sure at least bytes more can be stored without growing the file, e.g. ahead
+    // of a bulk build. The file grows geometrically, by at least half its size, inside
+    // address space reserved when it was opened, so growing never remaps it.
+    void Reserve(const size_t bytes)
+    {
+        CheckWritable();
+        ReserveFreeMemory(bytes);
+    }
+
+    // Rewrites the live records into a new file and renames it over this map's file. Keys
+    // are laid out in bucket order, each followed by all its values in as few chunks as
+    // possible, and the file is cut down to the data, so the holes left by erases and the
+    // buckets grown for keys erased since are gone. maxBytesPerSecond, if not zero, limits
+    // the copy rate to leave the disk to lookups meanwhile. Readers in other processes
+    // reopen the file on their next Get or GetAll. An exception leaves the map as it was.
+    void Compact(const size_t maxBytesPerSecond = 0)
+    {
+        CheckWritable();
+
+        std::vector<const KeyNodeT*> keyNodes;
+        size_t liveBytes = 0;
+
+        keyNodes.reserve(m_Header->keyCount);
+
+        for (size_t index = 0, bucketCount = BucketCount(); index < bucketCount; ++index)
+        {
+            for (const KeyNodeT* keyNode = Bucket(index).get(); keyNode; keyNode = keyNode->nextKeyNode.get())
+            {
+                keyNodes.push_back(keyNode);
+                liveBytes += CompactRecordsSize(*keyNode);
+            }
+        }
+
+        ReplaceFile([&](const char* compactFilename)
+        {
+            Map compacted(compactFilename, liveBytes + liveBytes / 8, m_Header->initialBucketCount);
+
+            compacted.GrowBuckets(m_Header->keyCount, std::numeric_limits<size_t>::max());
+            compacted.Reserve(liveBytes + keyNodes.size() * ALLOCATION_OVERHEAD);
+            CopyRecords(keyNodes, compacted, maxBytesPerSecond);
+        }, m_Header->replaced);
+    }
+
+    size_t Size() const
+    {
+        return m_Header->size;
+    }
+
+    bool Empty() const
+    {
+        return m_Header->size == 0;
+    }
+
+    size_t BucketCount() const
+    {
+        return (m_Header->initialBucketCount << m_Header->level) + m_Header->splitIndex;
+    }
+
+    double LoadFactor() const
+    {
+        return double(m_Header->keyCount) / BucketCount();
+    }
+
+    // Walks the chains of every sampleStride-th bucket, all of them by default, split in
+    // ranges over threadCount threads. Assumes no other process writes meanwhile, like
+    // ForEach; free record bytes are counted by walking the allocator's free lists.
+    MapStats Stats(const size_t sampleStride = 1, const size_t threadCount = 1) const
+    {
+        const size_t stride = std::max<size_t>(sampleStride, 1);
+        const size_t bucketCount = BucketCount();
+        const size_t samples = (bucketCount + stride - 1) / stride;
+        const size_t rangeCount = std::max<size_t>(std::min(threadCount, samples), 1);
+        std::vector<MapStats> ranges(rangeCount);
+        std::vector<std::thread> threads;
+
+        for (size_t range = 1; range < rangeCount; ++range)
+        {
+            threads.emplace_back([&, range]() { SampleBuckets(samples * range / rangeCount, samples * (range + 1) / rangeCount, stride, ranges[range]); });
+        }
+
+        SampleBuckets(0, samples / rangeCount, stride, ranges[0]);
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        MapStats stats;
+
+        for (const MapStats& range : ranges)
+        {
+            stats.sampledBuckets += range.sampledBuckets;
+            stats.sampledKeys += range.sampledKeys;
+            stats.emptyBuckets += range.emptyBuckets;
+            stats.maxChainLength = std::max(stats.maxChainLength, range.maxChainLength);
+            stats.maxValuesPerKey = std::max(stats.maxValuesPerKey, range.maxValuesPerKey);
+            AddHistogram(range.chainLengths, stats.chainLengths);
+            AddHistogram(range.valuesPerKey, stats.valuesPerKey);
+        }
+
+        stats.keyCount = m_Header->keyCount;
+        stats.valueCount = m_Header->size;
+        stats.bucketCount = bucketCount;
+        stats.loadFactor = LoadFactor();
+        stats.segmentBytes = GetSegmentManager()->get_size();
+        stats.freeBytes = GetSegmentManager()->get_free_memory();
+        stats.recordFreeBytes = m_Header->records.FreeBytes();
+        stats.counters = Counters();
+        return stats;
+    }
+
+private:
+    // Adds the samples in [first, last) to stats, the sample-th being bucket sample * stride.
+    void SampleBuckets(const size_t first, const size_t last, const size_t stride, MapStats& stats) const
+    {
+        for (size_t sample = first; sample < last; ++sample)
+        {
+            size_t chainLength = 0;
+
+            for (const KeyNodeT* keyNode = Bucket(sample * stride).get(); keyNode; keyNode = keyNode->nextKeyNode.get())
+            {
+                const size_t values = keyNode->childCount;
+                size_t magnitude = 0;
+
+                while ((values >> (magnitude + 1)) != 0)
+                {
+                    ++magnitude;
+                }
+
+                AddToHistogram(magnitude, stats.valuesPerKey);
+                stats.maxValuesPerKey = std::max(stats.maxValuesPerKey, values);
+                ++chainLength;
+            }
+
+            AddToHistogram(chainLength, stats.chainLengths);
+            stats.maxChainLength = std::max(stats.maxChainLength, chainLength);
+            stats.emptyBuckets += chainLength == 0;
+            stats.sampledKeys += chainLength;
+            ++stats.sampledBuckets;
+        }
+    }
+
+    template <typename LookupKeyT>
+    void InsertImpl(const LookupKeyT& lookupKey, const std::string_view key, const std::string_view value)
+    {
+        const size_t keyHash = m_KeyHasher(lookupKey);
+        std::pair<KeyNodePtr*, bool> result = FindKeyNode(lookupKey, keyHash);
+        bool foundKey = result.second;
+        KeyNodePtr* keyNode = result.first;
+
+        void* record = (!foundKey) ? AllocateRecord(sizeof(KeyNodeT) + key.size() + value.size()) : nullptr;
+
+        AddRecord(keyNode, foundKey, record, keyHash, key, value);
+    }
+
+    // Stores one (key, value) pair: a new key node built in the already allocated record
+    // and appended at keyNode if the key was not found, a value chunk entry otherwise.
+    void AddRecord(KeyNodePtr* keyNode, const bool foundKey, void* record, const size_t keyHash,
+                   const std::string_view key, const std::string_view value)
+    {
+        WriteSection section(Stripe(keyHash));
+        m_Counters.inserts.Add();
+
+        if (!foundKey)
+        {
+            KeyNodePtr newKeyNode = new (record) KeyNodeT(keyHash, RecordSize(key), RecordSize(value));
+            std::memcpy(newKeyNode->Data(), key.data(), key.size());
+            std::memcpy(newKeyNode->Data() + key.size(), value.data(), value.size());
+            *keyNode = newKeyNode;
+            ++m_Header->keyCount;
+        }
+        else
+        {
+            AppendValue(**keyNode, value);
+        }
+
+        ++(*keyNode)->childCount;
+        ++m_Header->size;
+    }
+
+    void AppendValue(KeyNodeT& keyNode, const std::string_view value)
+    {
+        const uint32_t valueSize = RecordSize(value);
+        const size_t entrySize = ValueChunkT::ENTRY_HEADER_SIZE + value.size();
+        ValueChunkT* chunk = keyNode.valueChunk.get();
+
+        if (!chunk || chunk->begin < entrySize)
+        {
+            chunk = AllocateValueChunk(keyNode.valueChunk, entrySize);
+        }
+
+        chunk->begin -= entrySize;
+
+        char* entry = chunk->Data() + chunk->begin;
+        std::memcpy(entry, &valueSize, sizeof(valueSize));
+        std::memcpy(entry + ValueChunkT::ENTRY_HEADER_SIZE, value.data(), value.size());
+    }
+
+    // A key's first chunk fits its second value exactly, as most keys never get a third
+    // one; every later chunk doubles the previous one. Without room for that, e.g. inside
+    // a batch that reserved space for the values alone, the chunk only fits the entry.
+    // Either way the chunk takes up the slack of its size class.
+    ValueChunkT* AllocateValueChunk(ValueChunkPtr& head, const size_t entrySize)
+    {
+        size_t capacity = (head) ? std::max(entrySize, std::min<size_t>(head->capacity * 2, MAX_VALUE_CHUNK_SIZE)) : entrySize;
+
+        if (GetSegmentManager()->get_free_memory() < sizeof(ValueChunkT) + capacity + ALLOCATION_OVERHEAD)
+        {
+            capacity = entrySize;
+        }
+
+        const size_t recordSize = RecordArena::RoundUp(sizeof(ValueChunkT) + capacity);
+        ValueChunkT* chunk = new (AllocateRecord(recordSize)) ValueChunkT(static_cast<uint32_t>(recordSize - sizeof(ValueChunkT)));
+        chunk->nextChunk = head;
+        head = chunk;
+        return chunk;
+    }
+
+    template <typename LookupKeyT>
+    ValueRange FindImpl(const LookupKeyT& key) const
+    {
+        std::pair<KeyNodePtr*, bool> result = FindKeyNode(key, m_KeyHasher(key));
+        bool foundKey = result.second;
+        KeyNodePtr* keyNode = result.first;
+
+        return (foundKey) ? ValueRange(keyNode->get()) : ValueRange();
+    }
+
+    template <typename LookupKeyT>
+    size_t EraseImpl(const LookupKeyT& key)
+    {
+        const size_t keyHash = m_KeyHasher(key);
+        std::pair<KeyNodePtr*, bool> result = FindKeyNode(key, keyHash);
+        bool foundKey = result.second;
+        KeyNodePtr* keyNode = result.first;
+
+        if (!foundKey)
+        {
+            return 0ul;
+        }
+
+        WriteSection section(Stripe(keyHash));
+
+        for (ValueChunkPtr chunk = (*keyNode)->valueChunk; chunk;)
+        {
+            ValueChunkPtr toBeDestroyed = chunk;
+
+            chunk = chunk->nextChunk;
+
+            DeallocateRecord(toBeDestroyed.get(), ChunkRecordSize(*toBeDestroyed));
+        }
+
+        const size_t erasedValues = (*keyNode)->childCount;
+
+        UnlinkKeyNode(keyNode);
+        m_Header->size -= erasedValues;
+        m_Counters.erases.Add(erasedValues);
+        return erasedValues;
+    }
+
+    template <typename LookupKeyT, typename LookupValueT>
+    size_t EraseImpl(const LookupKeyT& key, const LookupValueT& value)
+    {
+        const size_t keyHash = m_KeyHasher(key);
+        std::pair<KeyNodePtr*, bool> result = FindKeyNode(key, keyHash);
+        bool foundKey = result.second;
+        KeyNodePtr* keyNode = result.first;
+        size_t erasedValues = 0ul;
+
+        if (!foundKey)
+        {
+            return 0ul;
+        }
+
+        WriteSection section(Stripe(keyHash));
+
+        for (ValueChunkPtr* chunk = &(*keyNode)->valueChunk; *chunk;)
+        {
+            erasedValues += EraseFromChunk(**chunk, value);
+
+            // Emptied chunks are unlinked, iteration relies on every chunk having entries.
+            if ((*chunk)->begin == (*chunk)->capacity)
+            {
+                ValueChunkPtr toBeDestroyed = *chunk;
+
+                *chunk = toBeDestroyed->nextChunk;
+                DeallocateRecord(toBeDestroyed.get(), ChunkRecordSize(*toBeDestroyed));
+            }
+            else
+            {
+                chunk = &(*chunk)->nextChunk;
+            }
+        }
+
+        // The first value lives inside the key node, so it is only marked as erased.
+        if ((*keyNode)->HasFirstValue() &&
+            EqualTo()(ValueTraits::View((*keyNode)->Data() + (*keyNode)->keySize, (*keyNode)->firstValueSize), value))
+        {
+            (*keyNode)->firstValueSize = KeyNodeT::NO_VALUE;
+            ++erasedValues;
+        }
+
+        if (erasedValues == (*keyNode)->childCount)
+        {
+            UnlinkKeyNode(keyNode);
+        }
+        else
+        {
+            (*keyNode)->childCount -= erasedValues;
+        }
+
+        m_Header->size -= erasedValues;
+        m_Counters.erases.Add(erasedValues);
+        return erasedValues;
+    }
+
+    // Removes the chunk's entries equal to value and moves the remaining ones, in order,
+    // back against the end of the chunk. Returns the number of entries removed.
+    template <typename LookupValueT>
+    size_t EraseFromChunk(ValueChunkT& chunk, const LookupValueT& value)
+    {
+        std::vector<std::pair<uint32_t, uint32_t>> keptEntries;
+        size_t erasedValues = 0;
+
+        for (uint32_t offset = chunk.begin; offset < chunk.capacity;)
+        {
+            const char* entry = chunk.Data() + offset;
+            const uint32_t valueSize = ValueChunkT::EntryValueSize(entry);
+            const uint32_t entrySize = ValueChunkT::ENTRY_HEADER_SIZE + valueSize;
+
+            if (EqualTo()(ValueTraits::View(entry + ValueChunkT::ENTRY_HEADER_SIZE, valueSize), value))
+            {
+                ++erasedValues;
+            }
+            else
+            {
+                keptEntries.emplace_back(offset, entrySize);
+            }
+            offset += entrySize;
+        }
+
+        if (erasedValues != 0)
+        {
+            uint32_t end = chunk.capacity;
+
+            for (auto kept = keptEntries.rbegin(); kept != keptEntries.rend(); ++kept)
+            {
+                end -= kept->second;
+                std::memmove(chunk.Data() + end, chunk.Data() + kept->first, kept->second);
+            }
+            chunk.begin = end;
+        }
+        return erasedValues;
+    }
+
+    // keyNode is the link pointing to the node: a bucket head or the previous node's nextKeyNode.
+    void UnlinkKeyNode(KeyNodePtr* keyNode)
+    {
+        KeyNodePtr toBeDestroyed = *keyNode;
+
+        *keyNode = toBeDestroyed->nextKeyNode;
+
+        DeallocateRecord(toBeDestroyed.get(), KeyRecordSize(*toBeDestroyed));
+        --m_Header->keyCount;
+    }
+
+    template <typename KeyIterator>
+    void FindManyImpl(KeyIterator key, const KeyIterator last, std::vector<ValueRange>& results) const
+    {
+        struct ProbeT
+        {
+            KeyIterator key;
+            size_t result;
+            size_t hash;
+            const KeyNodeT* keyNode;
+        };
+
+        ProbeT probes[PREFETCH_GROUP_SIZE];
+        const KeyNodePtr* buckets[PREFETCH_GROUP_SIZE];
+
+        while (key != last)
+        {
+            const size_t first = results.size();
+            size_t count = 0;
+
+            for (; key != last && count < PREFETCH_GROUP_SIZE; ++key, ++count)
+            {
+                probes[count].key = key;
+                probes[count].result = first + count;
+                probes[count].hash = m_KeyHasher(LookupParam<Key>(*key));
+                buckets[count] = &Bucket(BucketIndex(probes[count].hash));
+                __builtin_prefetch(buckets[count]);
+            }
+
+            for (size_t index = 0; index < count; ++index)
+            {
+                probes[index].keyNode = buckets[index]->get();
+                PrefetchKeyNode(probes[index].keyNode);
+            }
+
+            results.resize(first + count);
+            m_Counters.lookups.Add(count);
+
+            // Unfinished probes are kept in front: every turn moves each of them one node on.
+            for (size_t active = count; active != 0;)
+            {
+                for (size_t index = 0; index < active;)
+                {
+                    ProbeT& probe = probes[index];
+                    const KeyNodeT* keyNode = probe.keyNode;
+
+                    m_Counters.chainSteps.Add(keyNode != nullptr);
+
+                    if (keyNode && (keyNode->hash != probe.hash || !m_KeyEqual(StoredKey(*keyNode), LookupParam<Key>(*probe.key))))
+                    {
+                        probe.keyNode = keyNode->nextKeyNode.get();
+                        PrefetchKeyNode(probe.keyNode);
+                        ++index;
+                        continue;
+                    }
+
+                    results[probe.result] = (keyNode) ? ValueRange(keyNode) : ValueRange();
+                    std::swap(probe, probes[--active]);
+                }
+            }
+        }
+    }
+
+    // The node header and the start of its key, which the comparison reads next.
+    static void PrefetchKeyNode(const KeyNodeT* keyNode)
+    {
+        if (keyNode)
+        {
+            __builtin_prefetch(keyNode);
+            __builtin_prefetch(keyNode->Data());
+        }
+    }
+
+    template <typename LookupKeyT>
+    size_t CountImpl(const LookupKeyT& key) const
+    {
+        std::pair<KeyNodePtr*, bool> result = FindKeyNode(key, m_KeyHasher(key));
+        bool foundKey = result.second;
+        KeyNodePtr* keyNode = result.first;
+
+        return (foundKey) ? (*keyNode)->childCount : 0;
+    }
 
-namespace HardDriveContainers
-{
+    // A key's records as Compact lays them out: the key node, with the first value only if
+    // it was not erased, then its other values in chunks of up to MAX_VALUE_CHUNK_SIZE
+    // made of whole old chunks.
+    static size_t CompactRecordsSize(const KeyNodeT& keyNode)
+    {
+        size_t bytes = RecordArena::RoundUp(sizeof(KeyNodeT) + keyNode.keySize + (keyNode.HasFirstValue() ? keyNode.firstValueSize : 0));
 
-namespace bipc = boost::interprocess;
+        ForEachCompactChunk(keyNode, [&bytes](const ValueChunkT*, const ValueChunkT*, const size_t chunkBytes)
+        {
+            bytes += RecordArena::RoundUp(sizeof(ValueChunkT) + chunkBytes);
+        });
+        return bytes;
+    }
 
-template <class Key,
-         class Value,
-         class KeyAllocator = bipc::allocator<Key, bipc::managed_mapped_file::segment_manager>,
-         class ValueAllocator = bipc::allocator<Value, bipc::managed_mapped_file::segment_manager>,
-         class KeyHash = boost::hash<Key>>
-class Map
-{
-private:
-    using ValuePtr = typename ValueAllocator::pointer;
-    using KeyPtr = typename KeyAllocator::pointer;
+    // Calls visit(first, last, bytes) for each run [first, last) of old chunks that make up
+    // one new chunk of bytes.
+    template <typename Visitor>
+    static void ForEachCompactChunk(const KeyNodeT& keyNode, Visitor visit)
+    {
+        const ValueChunkT* first = keyNode.valueChunk.get();
+        size_t bytes = 0;
+
+        for (const ValueChunkT* chunk = first; chunk; chunk = chunk->nextChunk.get())
+        {
+            const size_t chunkBytes = chunk->capacity - chunk->begin;
+
+            if (bytes != 0 && bytes + chunkBytes > MAX_VALUE_CHUNK_SIZE)
+            {
+                visit(first, chunk, bytes);
+                first = chunk;
+                bytes = 0;
+            }
+            bytes += chunkBytes;
+        }
 
-    struct ValueNodeT;
-    using ValueNodeAllocator = bipc::allocator<ValueNodeT, bipc::managed_mapped_file::segment_manager>;
-    using ValueNodePtr = typename ValueNodeAllocator::pointer;
+        if (bytes != 0)
+        {
+            visit(first, static_cast<const ValueChunkT*>(nullptr), bytes);
+        }
+    }
 
-    struct ValueNodeT
+    // Builds the records of the given key nodes in an empty map with its buckets grown,
+    // COMPACT_GROUP_KEYS keys per block, appending each key to the end of its chain so
+    // that chains keep their order.
+    void CopyRecords(const std::vector<const KeyNodeT*>& keyNodes, Map& target, const size_t maxBytesPerSecond) const
     {
-        ValueNodeT()
-        {}
+        std::vector<std::pair<size_t, const KeyNodeT*>> ordered;
+        ordered.reserve(keyNodes.size());
 
-        ValueNodeT(const ValueNodeT&) = delete;
-        ValueNodeT& operator =(const ValueNodeT&) = delete;
+        for (const KeyNodeT* keyNode : keyNodes)
+        {
+            ordered.emplace_back(target.BucketIndex(keyNode->hash), keyNode);
+        }
 
-        ValueNodeT(const ValueNodeT&& rhv)
-            : storedValue(rhv.storedValue)
-            , nextValueNode(rhv.nextValueNode)
-        {}
+        std::stable_sort(ordered.begin(), ordered.end(), [](const auto& lhv, const auto& rhv) { return lhv.first < rhv.first; });
 
-        ValuePtr storedValue;
-        ValueNodePtr nextValueNode {nullptr}; 
+        const auto started = std::chrono::steady_clock::now();
+        std::vector<size_t> recordSizes;
+        std::vector<void*> records;
+        KeyNodePtr* chainEnd = nullptr;
+        size_t chainBucket = std::numeric_limits<size_t>::max();
+        size_t copiedBytes = 0;
 
-        ~ValueNodeT()
-        {}
-    };
+        for (size_t groupBegin = 0; groupBegin < ordered.size(); groupBegin += COMPACT_GROUP_KEYS)
+        {
+            const size_t groupEnd = std::min(groupBegin + COMPACT_GROUP_KEYS, ordered.size());
 
-    struct KeyNodeT;
-    using KeyNodeAllocator = bipc::allocator<KeyNodeT, bipc::managed_mapped_file::segment_manager>;
-    using KeyNodePtr = typename KeyNodeAllocator::pointer;
+            recordSizes.clear();
 
-    struct KeyNodeT
-    {
-        KeyNodeT()
-        {}
+            for (size_t index = groupBegin; index < groupEnd; ++index)
+            {
+                const KeyNodeT& keyNode = *ordered[index].second;
 
-        KeyNodeT(const KeyNodeT&) = delete;
-        KeyNodeT& operator =(const KeyNodeT&) = delete;
+                recordSizes.push_back(sizeof(KeyNodeT) + keyNode.keySize + (keyNode.HasFirstValue() ? keyNode.firstValueSize : 0));
+                ForEachCompactChunk(keyNode, [&recordSizes](const ValueChunkT*, const ValueChunkT*, const size_t chunkBytes)
+                {
+                    recordSizes.push_back(RecordArena::RoundUp(sizeof(ValueChunkT) + chunkBytes));
+                });
+            }
 
-        KeyNodeT(const KeyNodeT&& rhv)
-            : valueNode(rhv.valueNode)
-            , nextKeyNode(rhv.nextKeyNode)
-        {}
+            target.m_Header->records.AllocateContiguous(target.GetSegmentManager(), recordSizes, records);
+            auto record = records.begin();
 
-        KeyPtr storedKey;
-        ValueNodePtr valueNode {nullptr};
-        KeyNodePtr nextKeyNode {nullptr}; 
-        size_t childCount {0};
+            for (size_t index = groupBegin; index < groupEnd; ++index)
+            {
+                const KeyNodeT& keyNode = *ordered[index].second;
+                const uint32_t firstValueSize = (keyNode.HasFirstValue()) ? keyNode.firstValueSize : 0;
+                KeyNodeT* newKeyNode = new (*record++) KeyNodeT(keyNode.hash, keyNode.keySize, firstValueSize);
 
-        ~KeyNodeT()
-        {}
-    };
+                std::memcpy(newKeyNode->Data(), keyNode.Data(), keyNode.keySize + size_t(firstValueSize));
+                newKeyNode->firstValueSize = keyNode.firstValueSize;
+                newKeyNode->childCount = keyNode.childCount;
 
-public:
-    using key_type = Key;
-    using value_type = Value;
+                ValueChunkPtr* chunkLink = &newKeyNode->valueChunk;
 
-    Map(const char* filename, const size_t fileSize = DEFAULT_FILE_SIZE, const size_t bucketCount = DEFAULT_BUCKET_COUNT)
-        : m_BucketCount(bucketCount)
-        , m_Filename(filename)
-        , m_MappedFile(new bipc::managed_mapped_file(boost::interprocess::open_or_create, filename, fileSize))
-        , m_KeyAllocator(m_MappedFile->get_segment_manager())
-        , m_ValueAllocator(m_MappedFile->get_segment_manager())
-        , m_KeyNodeAllocator(m_MappedFile->get_segment_manager())
-        , m_ValueNodeAllocator(m_MappedFile->get_segment_manager())
-    {
-        const size_t minFileSize = m_BucketCount * sizeof(KeyNodePtr) + sizeof(size_t) + MAX_PAIR_SIZE * 10;
-        if (fileSize < minFileSize)
-        {
-            m_MappedFile->grow(filename, minFileSize - fileSize);
-            RemapFile();
-        }
+                ForEachCompactChunk(keyNode, [&](const ValueChunkT* first, const ValueChunkT* last, const size_t chunkBytes)
+                {
+                    const size_t capacity = RecordArena::RoundUp(sizeof(ValueChunkT) + chunkBytes) - sizeof(ValueChunkT);
+                    ValueChunkT* chunk = new (*record++) ValueChunkT(static_cast<uint32_t>(capacity));
 
-        m_KeyNodePtrArray = m_MappedFile->find_or_construct<KeyNodePtr>("KeyNodePtrArray")[m_BucketCount](nullptr);
-        m_Size = m_MappedFile->find_or_construct<size_t>("Size")(0);
-    }
+                    chunk->begin = static_cast<uint32_t>(capacity - chunkBytes);
 
-    Map(const Map&) = delete;
-    Map& operator =(const Map&) = delete;
+                    for (char* data = chunk->Data() + chunk->begin; first != last; first = first->nextChunk.get())
+                    {
+                        std::memcpy(data, first->Data() + first->begin, first->capacity - first->begin);
+                        data += first->capacity - first->begin;
+                    }
 
-    Map(Map&& rhv)
-        : m_BucketCount(rhv.m_BucketCount)
-        , m_Filename(std::move(rhv.m_Filename))
-        , m_Size(rhv.m_Size)
-        , m_MappedFile(std::move(rhv.m_MappedFile))
-        , m_KeyAllocator(std::move(rhv.m_KeyAllocator))
-        , m_ValueAllocator(std::move(rhv.m_ValueAllocator))
-        , m_KeyNodeAllocator(std::move(rhv.m_KeyNodeAllocator))
-        , m_ValueNodeAllocator(std::move(rhv.m_ValueNodeAllocator))
-        , m_KeyHasher(std::move(rhv.m_KeyHasher))
-        , m_KeyNodePtrArray(rhv.m_KeyNodePtrArray)
-    {}
+                    *chunkLink = chunk;
+                    chunkLink = &chunk->nextChunk;
+                });
 
-    Map& operator=(Map&& rhv)
+                if (ordered[index].first != chainBucket)
+                {
+                    chainBucket = ordered[index].first;
+                    chainEnd = &target.Bucket(chainBucket);
+                }
+
+                *chainEnd = newKeyNode;
+                chainEnd = &newKeyNode->nextKeyNode;
+            }
+
+            for (const size_t bytes : recordSizes)
+            {
+                copiedBytes += bytes;
+            }
+
+            if (maxBytesPerSecond != 0)
+            {
+                std::this_thread::sleep_until(started + std::chrono::microseconds(copiedBytes * 1000000 / maxBytesPerSecond));
+            }
+        }
+
+        target.m_Header->keyCount = m_Header->keyCount;
+        target.m_Header->size = m_Header->size;
+    }
+
+    // Called after the mapping had to move: everything derived from its address is stale.
+    void OnMappingMoved() const
     {
-        m_BucketCount = rhv.m_BucketCount;
-        m_Filename = std::move(rhv.m_Filename);
-        m_Size = rhv.m_Size;
-        m_MappedFile = std::move(rhv.m_MappedFile);
-        m_KeyAllocator = std::move(rhv.m_KeyAllocator);
-        m_ValueAllocator = std::move(rhv.m_ValueAllocator);
-        m_KeyNodeAllocator = std::move(rhv.m_KeyNodeAllocator);
-        m_ValueNodeAllocator = std::move(rhv.m_ValueNodeAllocator);
-        m_KeyHasher = std::move(rhv.m_KeyHasher);
-        m_KeyNodePtrArray = rhv.m_KeyNodePtrArray;
+        BucketAllocator newBucketAlloc(m_MappedFile->get_segment_manager());
+
+        swap(newBucketAlloc, m_BucketAllocator);
+        FindHeader("Header", m_Header);
     }
 
-    template <typename ProvidedKeyT, typename ProvidedValueT>
-    void Insert(const ProvidedKeyT& key, const ProvidedValueT& value)
+    // For PrewarmOptions::willNeedBuckets.
+    void AdviseBuckets() const
     {
-        if (GetSegmentManager()->get_free_memory() < MAX_PAIR_SIZE)
+        for (size_t segment = 0; segment <= m_Header->level + 1 && segment < MAX_BUCKET_SEGMENTS; ++segment)
         {
-            bipc::managed_mapped_file::grow(m_Filename.c_str(), GetSegmentManager()->get_size() / 2);
-            RemapFile();
+            if (m_Header->bucketSegments[segment])
+            {
+                const size_t bucketCount = (segment == 0) ? m_Header->initialBucketCount
+                                                          : m_Header->initialBucketCount << (segment - 1);
+                m_MappedFile->Advise(m_Header->bucketSegments[segment].get(), bucketCount * sizeof(KeyNodePtr), MADV_WILLNEED);
+            }
         }
-        InsertImpl(ConstructParam<Key, ProvidedKeyT>(key), ConstructParam<Value, ProvidedValueT>(value));
     }
 
-    template <typename ProvidedKeyT>
-    ValuePtr Find(const ProvidedKeyT& key)
+    void* AllocateRecord(const size_t bytes)
     {
-        ValueNodePtr valueNode = FindImpl(ConstructParam<Key, ProvidedKeyT>(key));
+        return m_Header->records.Allocate(GetSegmentManager(), bytes);
+    }
 
-        return (valueNode) ? valueNode->storedValue : nullptr;
+    // Records carry no allocation header, so their size is passed back.
+    void DeallocateRecord(void* record, const size_t bytes)
+    {
+        m_Header->records.Deallocate(GetSegmentManager(), record, bytes);
     }
 
-    template <typename ProvidedKeyT>
-    ValueNodePtr FindAll(const ProvidedKeyT& key)
+    static size_t KeyRecordSize(const KeyNodeT& keyNode)
     {
-        return FindImpl(ConstructParam<Key, ProvidedKeyT>(key));
+        return sizeof(KeyNodeT) + keyNode.keySize + keyNode.firstValueCapacity;
     }
 
-    template <typename ProvidedKeyT>
-    size_t Erase(const ProvidedKeyT& key)
+    static size_t ChunkRecordSize(const ValueChunkT& chunk)
     {
-        return EraseImpl(ConstructParam<Key, ProvidedKeyT>(key));
+        return sizeof(ValueChunkT) + chunk.capacity;
     }
 
-    template <typename ProvidedKeyT, typename ProvidedValueT>
-    size_t Erase(const ProvidedKeyT& key, const ProvidedValueT& value)
+    static uint32_t RecordSize(const std::string_view bytes)
     {
-        return EraseImpl(ConstructParam<Key, ProvidedKeyT>(key), ConstructParam<Value, ProvidedValueT>(value));
+        if (bytes.size() >= KeyNodeT::NO_VALUE)
+        {
+            throw std::length_error("Key or value is too long to be stored in a Map");
+        }
+        return static_cast<uint32_t>(bytes.size());
     }
 
-    template <typename ProvidedKeyT>
-    size_t Count(const ProvidedKeyT& key)
+    static typename KeyTraits::view_type StoredKey(const KeyNodeT& keyNode)
     {
-        return CountImpl(ConstructParam<Key, ProvidedKeyT>(key));
+        return KeyTraits::View(keyNode.Data(), keyNode.keySize);
     }
 
-    size_t Size() const
+    BucketSegmentPtr AllocateBucketSegment(const size_t bucketCount)
     {
-        return *m_Size;
+        BucketSegmentPtr segment = m_BucketAllocator.allocate(bucketCount);
+        std::uninitialized_fill_n(segment.get(), bucketCount, KeyNodePtr(nullptr));
+        return segment;
     }
 
-    bool Empty() const
+    // Linear hashing address: buckets before the split index have already been split
+    // and are addressed with the next level's modulus.
+    size_t BucketIndex(const size_t hash) const
     {
-        return *m_Size == 0;
+        return BucketIndex(hash, m_Header->level, m_Header->splitIndex);
     }
 
-    bipc::managed_mapped_file::segment_manager* GetSegmentManager() const
+    size_t BucketIndex(const size_t hash, const size_t level, const size_t splitIndex) const
     {
-        return m_MappedFile->get_segment_manager();
+        const size_t levelBucketCount = m_Header->initialBucketCount << level;
+        const size_t index = hash % levelBucketCount;
+
+        return (index < splitIndex) ? hash % (levelBucketCount * 2) : index;
     }
 
-    ~Map()
+    // Accepts a key hash or a bucket index alike, both give the same stripe.
+    SequenceT& Stripe(const size_t hashOrBucket) const
     {
+        return m_Header->stripeSequences[hashOrBucket % m_Header->initialBucketCount % STRIPE_COUNT];
     }
- 
-private:
-    void InsertImpl(Key&& key, Value&& value)
+
+    KeyNodePtr& Bucket(const size_t index) const
     {
-        std::pair<KeyNodePtr*, bool> result = FindKeyNode(key);
-        bool foundKey = result.second;
-        KeyNodePtr* keyNode = result.first;
-        
-        if (!foundKey)
+        const size_t initialBucketCount = m_Header->initialBucketCount;
+
+        if (index < initialBucketCount)
         {
-            KeyNodePtr newKeyNode = m_KeyNodeAllocator.allocate_one();
-            m_KeyNodeAllocator.construct(newKeyNode, std::move(KeyNodeT()));
-            newKeyNode->storedKey = m_KeyAllocator.allocate_one();
-            m_KeyAllocator.construct(newKeyNode->storedKey, std::move(key));
-            *keyNode = newKeyNode;
+            return m_Header->bucketSegments[0][index];
         }
 
-        ValuePtr newValue = m_ValueAllocator.allocate_one();
-        m_ValueAllocator.construct(newValue, std::move(value));
+        size_t segment = 1;
+        for (; (initialBucketCount << segment) <= index; ++segment)
+        {}
 
-        ValueNodePtr newValueNode = m_ValueNodeAllocator.allocate_one();
-        m_ValueNodeAllocator.construct(newValueNode, std::move(ValueNodeT()));
-        newValueNode->storedValue = newValue;
-        
-        newValueNode->nextValueNode = (*keyNode)->valueNode;
-        (*keyNode)->valueNode = newValueNode;
-        
-        ++(*keyNode)->childCount;
-        ++(*m_Size);
+        return m_Header->bucketSegments[segment][index - (initialBucketCount << (segment - 1))];
     }
 
-    ValueNodePtr FindImpl(Key&& key)
+    // Splits up to maxSteps buckets while keyCount keys would exceed the load factor. Single
+    // inserts split MIGRATION_STEP_BUCKETS at a time, so the cost of growing is spread over
+    // them instead of a full rebuild; batches split ahead for all the keys they may add.
+    void GrowBuckets(const size_t keyCount, const size_t maxSteps)
     {
-        std::pair<KeyNodePtr*, bool> result = FindKeyNode(key);
-        bool foundKey = result.second;
-        KeyNodePtr* keyNode = result.first;
+        for (size_t step = 0; step < maxSteps && double(keyCount) / BucketCount() > MAX_LOAD_FACTOR; ++step)
+        {
+            const size_t nextSegment = m_Header->level + 1;
+
+            if (nextSegment >= MAX_BUCKET_SEGMENTS)
+            {
+                return;
+            }
+
+            if (!m_Header->bucketSegments[nextSegment])
+            {
+                const size_t segmentSize = m_Header->initialBucketCount << m_Header->level;
 
-        return (foundKey) ? (*keyNode)->valueNode : nullptr;
+                ReserveFreeMemory(segmentSize * sizeof(KeyNodePtr) + MAX_PAIR_SIZE);
+                m_Header->bucketSegments[nextSegment] = AllocateBucketSegment(segmentSize);
+            }
+
+            SplitBucket();
+        }
     }
 
-    size_t EraseImpl(Key&& key)
+    // Key nodes carry their hash, so splitting never reads the key bytes.
+    void SplitBucket()
     {
-        const size_t keyHash = m_KeyHasher(key) % m_BucketCount;
-        
-        KeyNodePtr keyNode = m_KeyNodePtrArray[keyHash];
-        size_t erasedValues = 0ul;
+        WriteSection section(Stripe(m_Header->splitIndex));
+        KeyNodePtr& splitBucket = Bucket(m_Header->splitIndex);
+        KeyNodePtr keyNode = splitBucket;
+        splitBucket = nullptr;
+
+        {
+            WriteSection layoutSection(m_Header->layoutSequence);
+
+            if (++m_Header->splitIndex == m_Header->initialBucketCount << m_Header->level)
+            {
+                ++m_Header->level;
+                m_Header->splitIndex = 0;
+            }
+        }
 
-        if (keyNode != nullptr)
+        while (keyNode)
         {
-            KeyNodePtr previous = nullptr;
+            KeyNodePtr nextKeyNode = keyNode->nextKeyNode;
+            KeyNodePtr& bucket = Bucket(BucketIndex(keyNode->hash));
+
+            keyNode->nextKeyNode = bucket;
+            bucket = keyNode;
+            keyNode = nextKeyNode;
+        }
+    }
+
+    // Returns the link pointing to the key's node, or the empty link ending its chain.
+    // The stored full hash is checked first, so key bytes are only read for real candidates.
+    template <typename LookupKeyT>
+    std::pair<KeyNodePtr*, bool> FindKeyNode(const LookupKeyT& key, const size_t keyHash) const
+    {
+        KeyNodePtr* keyNode = &Bucket(BucketIndex(keyHash));
+        bool foundKey = false;
+        size_t chainSteps = 0;
 
-            for (; keyNode; previous = keyNode, keyNode = keyNode->nextKeyNode)
+        if (*keyNode != nullptr)
+        {
+            for(; *keyNode; keyNode = &((*keyNode)->nextKeyNode))
             {
-                if (*keyNode->storedKey == key)
+                ++chainSteps;
+
+                if ((*keyNode)->hash == keyHash && m_KeyEqual(StoredKey(**keyNode), key))
                 {
-                    ValueNodePtr valueNode = keyNode->valueNode;
+                    foundKey = true;
+                    break;
+                }
+            }
+        }
 
-                    for (; valueNode;)
-                    {
-                        ValueNodePtr toBeDestroyed = valueNode;
+        m_Counters.lookups.Add();
+        m_Counters.chainSteps.Add(chainSteps);
+        return std::make_pair(keyNode, foundKey);
+    }
 
-                        valueNode = valueNode->nextValueNode;
+    // Walks the key's values, newest first, until a walk ran on a state of the stripe that
+    // no write overlapped. Every walk starts with restart() and calls visit(value_view),
+    // which returns false to stop early. A walk that gets retried may have visited
+    // garbage, though never memory outside the mapping, so visit must only copy data out.
+    template <typename LookupKeyT, typename Restart, typename Visitor>
+    void ReadShared(const LookupKeyT& key, Restart restart, Visitor visit) const
+    {
+        const size_t keyHash = m_KeyHasher(key);
 
-                        m_ValueAllocator.destroy(toBeDestroyed->storedValue);
-                        m_ValueAllocator.deallocate_one(toBeDestroyed->storedValue);
+        if (m_Header->replaced.load(std::memory_order_acquire))
+        {
+            Reopen();
+        }
 
-                        m_ValueNodeAllocator.destroy(toBeDestroyed);
-                        m_ValueNodeAllocator.deallocate_one(toBeDestroyed);
-                    }
+        m_Counters.lookups.Add();
 
-                    KeyNodePtr toBeDestroyed = keyNode;
+        for (;;)
+        {
+            SequenceT& sequence = Stripe(keyHash);
+            const uint64_t before = sequence.load(std::memory_order_acquire);
+
+            if (before % 2 == 0)
+            {
+                restart();
+                const bool inBounds = WalkShared(key, keyHash, sequence, before, visit);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
 
-                    if (!previous)
+                if (sequence.load(std::memory_order_relaxed) == before)
+                {
+                    if (inBounds)
                     {
-                        m_KeyNodePtrArray[keyHash] = keyNode->nextKeyNode;
+                        return;
                     }
-                    else
+
+                    if (!RemapIfGrown())
                     {
-                        previous->nextKeyNode = keyNode->nextKeyNode;
+                        throw bipc::interprocess_exception("Map file is corrupted");
                     }
-                    
-                    erasedValues = toBeDestroyed->childCount;
-
-                    m_KeyAllocator.destroy(toBeDestroyed->storedKey);
-                    m_KeyAllocator.deallocate_one(toBeDestroyed->storedKey);
-
-                    m_KeyNodeAllocator.destroy(toBeDestroyed);
-                    m_KeyNodeAllocator.deallocate_one(toBeDestroyed);
+                    continue;
                 }
             }
 
-            (*m_Size) -= erasedValues;
-            return erasedValues;
-        }
-        else
-        {
-            return 0;
+            std::this_thread::yield();
+            RemapIfGrown();
         }
     }
 
-    size_t EraseImpl(Key&& key, Value&& value)
+    // GetAll for the keys from key to last, PREFETCH_GROUP_SIZE at a time: the chains of a
+    // group are advanced in turns as in FindManyImpl, and every walk is checked against its
+    // stripe as in ReadShared. Keys whose walk overlapped a write, or left the mapping, are
+    // looked up again with GetAll.
+    template <typename KeyIterator>
+    void GetManyImpl(KeyIterator key, const KeyIterator last, std::vector<std::vector<Value>>& results) const
     {
-        const size_t keyHash = m_KeyHasher(key) % m_BucketCount;
-        
-        KeyNodePtr keyNode = m_KeyNodePtrArray[keyHash];
-        size_t erasedValues = 0ul;
-
-        if (keyNode != nullptr)
+        struct ProbeT
         {
-            KeyNodePtr previousKeyNode = nullptr;
+            KeyIterator key;
+            size_t result;
+            size_t hash;
+            const SequenceT* sequence;
+            uint64_t before;
+            const KeyNodeT* keyNode;
+        };
+
+        ProbeT probes[PREFETCH_GROUP_SIZE];
+        const KeyNodePtr* buckets[PREFETCH_GROUP_SIZE];
+        std::vector<ProbeT> retries;
+
+        while (key != last)
+        {
+            size_t count = 0;
 
-            for (; keyNode; previousKeyNode = keyNode, keyNode = keyNode->nextKeyNode)
+            for (; key != last && count < PREFETCH_GROUP_SIZE; ++key)
             {
-                if (*keyNode->storedKey == key)
-                {
-                    ValueNodePtr valueNode = keyNode->valueNode, previousValueNode = nullptr;
-                    for (; valueNode;)
-                    {
-                        if (*valueNode->storedValue == value)
-                        {
-                            ValueNodePtr toBeDestroyed = valueNode;
+                ProbeT& probe = probes[count];
 
-                            if (!previousValueNode)
-                            {
-                                keyNode->valueNode = valueNode->nextValueNode;
-                                valueNode = keyNode->valueNode;
-                            }
-                            else
-                            {
-                                previousValueNode->nextValueNode = valueNode->nextValueNode;
-                                valueNode = previousValueNode->nextValueNode;
-                            }
+                probe.key = key;
+                probe.result = results.size();
+                probe.hash = m_KeyHasher(LookupParam<Key>(*key));
+                probe.sequence = &Stripe(probe.hash);
+                probe.before = probe.sequence->load(std::memory_order_acquire);
+                results.emplace_back();
 
-                            m_ValueAllocator.destroy(toBeDestroyed->storedValue);
-                            m_ValueAllocator.deallocate_one(toBeDestroyed->storedValue);
+                buckets[count] = (probe.before % 2 == 0) ? BucketShared(probe.hash) : nullptr;
 
-                            m_ValueNodeAllocator.destroy(toBeDestroyed);
-                            m_ValueNodeAllocator.deallocate_one(toBeDestroyed);
-                            ++erasedValues;
-                        }
-                        else
-                        {
-                            previousValueNode = valueNode;
-                            valueNode = valueNode->nextValueNode;
-                        }
-                    }
+                if (buckets[count])
+                {
+                    __builtin_prefetch(buckets[count]);
+                    ++count;
+                }
+                else
+                {
+                    retries.push_back(probe);
+                }
+            }
+
+            for (size_t index = 0; index < count; ++index)
+            {
+                probes[index].keyNode = buckets[index]->get();
+                PrefetchKeyNode(probes[index].keyNode);
+            }
 
-                    if (erasedValues == keyNode->childCount)
+            // Unfinished probes are kept in front: every turn moves each of them one node on.
+            for (size_t active = count; active != 0;)
+            {
+                for (size_t index = 0; index < active;)
+                {
+                    ProbeT& probe = probes[index];
+                    const KeyNodeT* keyNode = probe.keyNode;
+                    bool inBounds = true;
+
+                    if (keyNode && probe.sequence->load(std::memory_order_relaxed) == probe.before)
                     {
-                        KeyNodePtr toBeDestroyed = keyNode;
+                        uint32_t keySize, firstValueSize;
+
+                        m_Counters.chainSteps.Add();
+                        inBounds = ReadKeyNodeShared(keyNode, keySize, firstValueSize);
 
-                        if (!previousKeyNode)
+                        if (inBounds && (keyNode->hash != probe.hash || !m_KeyEqual(KeyTraits::View(keyNode->Data(), keySize), LookupParam<Key>(*probe.key))))
                         {
-                            m_KeyNodePtrArray[keyHash] = keyNode->nextKeyNode;
+                            probe.keyNode = keyNode->nextKeyNode.get();
+                            PrefetchKeyNode(probe.keyNode);
+                            ++index;
+                            continue;
                         }
-                        else
+
+                        if (inBounds)
                         {
-                            previousKeyNode->nextKeyNode = keyNode->nextKeyNode;
+                            std::vector<Value>& values = results[probe.result];
+                            auto visit = [&values](const value_view& stored)
+                            {
+                                values.emplace_back(stored);
+                                return true;
+                            };
+
+                            inBounds = VisitValuesShared(keyNode, keySize, firstValueSize, *probe.sequence, probe.before, visit);
                         }
-                        
-                        m_KeyAllocator.destroy(toBeDestroyed->storedKey);
-                        m_KeyAllocator.deallocate_one(toBeDestroyed->storedKey);
+                    }
 
-                        m_KeyNodeAllocator.destroy(toBeDestroyed);
-                        m_KeyNodeAllocator.deallocate_one(toBeDestroyed);
+                    std::atomic_thread_fence(std::memory_order_acquire);
+
+                    if (inBounds && probe.sequence->load(std::memory_order_relaxed) == probe.before)
+                    {
+                        m_Counters.lookups.Add();
                     }
                     else
                     {
-                        keyNode->childCount -= erasedValues;
+                        retries.push_back(probe);
                     }
+                    std::swap(probe, probes[--active]);
                 }
             }
-
-            (*m_Size) -= erasedValues;
-            return erasedValues;
         }
-        else
+
+        for (const ProbeT& probe : retries)
         {
-            return 0ul;
+            results[probe.result] = GetAll(*probe.key);
         }
     }
 
-    size_t CountImpl(Key&& key)
+    // FindKeyNode and ValueIterator for readers racing with a writer. Every node is bounds
+    // checked with the sizes read from it once, and the walk stops as soon as the stripe
+    // changes, so a chain relinked under it cannot loop forever. Returns false if a pointer
+    // led outside the mapping.
+    template <typename LookupKeyT, typename Visitor>
+    bool WalkShared(const LookupKeyT& key, const size_t keyHash, const SequenceT& sequence, const uint64_t before,
+                    Visitor& visit) const
     {
-        std::pair<KeyNodePtr*, bool> result = FindKeyNode(key);
-        bool foundKey = result.second;
-        KeyNodePtr* keyNode = result.first;
+        const KeyNodePtr* bucket = BucketShared(keyHash);
 
-        return (foundKey) ? (*keyNode)->childCount : 0;
-    }
+        if (!bucket)
+        {
+            return false;
+        }
 
-    void RemapFile()
-    {
-        m_MappedFile.reset(new bipc::managed_mapped_file(bipc::open_only, m_Filename.c_str()));
-        KeyAllocator newKeyAlloc(m_MappedFile->get_segment_manager());
-        ValueAllocator newValueAlloc(m_MappedFile->get_segment_manager());
-        KeyNodeAllocator newKeyNodeAlloc(m_MappedFile->get_segment_manager());
-        ValueNodeAllocator newValueNodeAlloc(m_MappedFile->get_segment_manager());
+        for (const KeyNodeT* keyNode = bucket->get(); keyNode; keyNode = keyNode->nextKeyNode.get())
+        {
+            if (sequence.load(std::memory_order_relaxed) != before)
+            {
+                return true;
+            }
 
-        swap(newKeyAlloc, m_KeyAllocator);
-        swap(newValueAlloc, m_ValueAllocator);
-        swap(newKeyNodeAlloc, m_KeyNodeAllocator);
-        swap(newValueNodeAlloc, m_ValueNodeAllocator);
+            uint32_t keySize, firstValueSize;
 
-        m_KeyNodePtrArray = m_MappedFile->find<KeyNodePtr>("KeyNodePtrArray").first;
-        m_Size = m_MappedFile->find<size_t>("Size").first;
+            m_Counters.chainSteps.Add();
+
+            if (!ReadKeyNodeShared(keyNode, keySize, firstValueSize))
+            {
+                return false;
+            }
+
+            if (keyNode->hash == keyHash && m_KeyEqual(KeyTraits::View(keyNode->Data(), keySize), key))
+            {
+                return VisitValuesShared(keyNode, keySize, firstValueSize, sequence, before, visit);
+            }
+        }
+        return true;
     }
 
-    std::pair<KeyNodePtr*, bool> FindKeyNode(const Key& key)
+    // The key's bucket for a reader racing with a writer, found with a consistent read of
+    // the layout. Null if it lies outside the mapping.
+    const KeyNodePtr* BucketShared(const size_t keyHash) const
     {
-        const size_t keyHash = m_KeyHasher(key) % m_BucketCount;
-        
-        KeyNodePtr* keyNode = m_KeyNodePtrArray + keyHash;
-        bool foundKey = false;
+        size_t level, splitIndex;
+        uint64_t layout;
 
-        if (*keyNode != nullptr)
+        do
         {
-            for(; *keyNode; keyNode = &((*keyNode)->nextKeyNode))
+            while ((layout = m_Header->layoutSequence.load(std::memory_order_acquire)) % 2 != 0)
             {
-                if (*((*keyNode)->storedKey) == key)
-                {
-                    foundKey = true;
-                    break;
-                }
+                std::this_thread::yield();
             }
+
+            level = m_Header->level;
+            splitIndex = m_Header->splitIndex;
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while (m_Header->layoutSequence.load(std::memory_order_relaxed) != layout);
+
+        const size_t index = BucketIndex(keyHash, level, splitIndex);
+        const size_t initialBucketCount = m_Header->initialBucketCount;
+        size_t segment = 0, offset = index;
+
+        if (index >= initialBucketCount)
+        {
+            for (segment = 1; (initialBucketCount << segment) <= index; ++segment)
+            {}
+            offset = index - (initialBucketCount << (segment - 1));
         }
-        return std::make_pair(keyNode, foundKey);
+
+        if (segment >= MAX_BUCKET_SEGMENTS)
+        {
+            return nullptr;
+        }
+
+        const KeyNodePtr* bucket = m_Header->bucketSegments[segment].get() + offset;
+
+        return (InBounds(bucket, sizeof(KeyNodePtr))) ? bucket : nullptr;
     }
 
-    template <typename Result, typename T>
-    Result ConstructParam(const T& value, typename std::enable_if<!std::is_class<T>::value && !std::is_pointer<T>::value && !std::is_array<T>::value>::type* = 0)
+    // Reads the sizes of a key node once; false unless the node, its key and its first
+    // value lie inside the mapping.
+    bool ReadKeyNodeShared(const KeyNodeT* keyNode, uint32_t& keySize, uint32_t& firstValueSize) const
     {
-        return Result(value);
+        if (!InBounds(keyNode, sizeof(KeyNodeT)))
+        {
+            return false;
+        }
+
+        keySize = keyNode->keySize;
+        firstValueSize = keyNode->firstValueSize;
+
+        const bool hasFirstValue = firstValueSize != KeyNodeT::NO_VALUE;
+
+        return InBounds(keyNode, sizeof(KeyNodeT) + size_t(keySize) + (hasFirstValue ? firstValueSize : 0));
     }
 
-    template <typename Result, typename T>
-    Result ConstructParam(const T& value, typename std::enable_if<std::is_class<T>::value || std::is_pointer<T>::value || std::is_array<T>::value>::type* = 0)
+    // The values of a key node checked by ReadKeyNodeShared, for visit as in WalkShared.
+    template <typename Visitor>
+    bool VisitValuesShared(const KeyNodeT* keyNode, const uint32_t keySize, const uint32_t firstValueSize,
+                           const SequenceT& sequence, const uint64_t before, Visitor& visit) const
     {
-        return Result(value, GetSegmentManager());
+        for (const ValueChunkT* chunk = keyNode->valueChunk.get(); chunk; chunk = chunk->nextChunk.get())
+        {
+            if (sequence.load(std::memory_order_relaxed) != before)
+            {
+                return true;
+            }
+
+            if (!InBounds(chunk, sizeof(ValueChunkT)))
+            {
+                return false;
+            }
+
+            const size_t capacity = chunk->capacity;
+
+            if (!InBounds(chunk, sizeof(ValueChunkT) + capacity))
+            {
+                return false;
+            }
+
+            // Entries are only bounded by the chunk: a torn size must not lead past it.
+            for (size_t offset = chunk->begin; offset + ValueChunkT::ENTRY_HEADER_SIZE <= capacity;)
+            {
+                const char* entry = chunk->Data() + offset;
+                const size_t valueSize = ValueChunkT::EntryValueSize(entry);
+
+                offset += ValueChunkT::ENTRY_HEADER_SIZE + valueSize;
+
+                if (offset > capacity)
+                {
+                    break;
+                }
+
+                if (!visit(ValueTraits::View(entry + ValueChunkT::ENTRY_HEADER_SIZE, valueSize)))
+                {
+                    return true;
+                }
+            }
+        }
+
+        if (firstValueSize != KeyNodeT::NO_VALUE)
+        {
+            visit(ValueTraits::View(keyNode->Data() + keySize, firstValueSize));
+        }
+        return true;
     }
 
 public:
     static constexpr size_t DEFAULT_FILE_SIZE {128 * 1024 * 1024ul};
     static constexpr size_t DEFAULT_BUCKET_COUNT {2 * size_t(1e6)};
-    static constexpr size_t MAX_PAIR_SIZE {2 * 256 * 1024 + sizeof(KeyNodeT) + sizeof(ValueNodeT)};
+    static constexpr size_t MAX_VALUE_CHUNK_SIZE {64 * 1024};
+    static constexpr size_t MAX_PAIR_SIZE {2 * 256 * 1024 + sizeof(KeyNodeT) + sizeof(ValueChunkT) + MAX_VALUE_CHUNK_SIZE};
+    static constexpr double MAX_LOAD_FACTOR {1.0};
+    static constexpr size_t MIGRATION_STEP_BUCKETS {2};
+    static constexpr size_t ALLOCATION_OVERHEAD {32};
+    static constexpr size_t PREFETCH_GROUP_SIZE {16};
+    static constexpr size_t COMPACT_GROUP_KEYS {4096};
 
 private:
-    const size_t m_BucketCount;
-    const std::string m_Filename;
-
-    size_t* m_Size;
-    std::unique_ptr<bipc::managed_mapped_file> m_MappedFile;
-    KeyAllocator m_KeyAllocator;
-    ValueAllocator m_ValueAllocator;
-    KeyNodeAllocator m_KeyNodeAllocator;
-    ValueNodeAllocator m_ValueNodeAllocator;
+    // Readers remap the file from const lookups once the writer has grown it.
+    mutable HeaderT* m_Header;
+    mutable BucketAllocator m_BucketAllocator;
     KeyHash m_KeyHasher;
-    KeyNodePtr* m_KeyNodePtrArray;
+    KeyEqual m_KeyEqual;
 };
 } //HardDriveContainers
+
+#include "flat_map.h"
@@ -0,0 +1,560 @@
+// Throughput and latency benchmarks for Map and the fs_dump scan, printed as one JSON
+// object per line. Keys, values and lookup orders come from fixed seeds, so runs with the
+// same arguments do the same work. Latencies are timed operation by operation, clock
+// reads included; "cold" runs drop the file from the page cache first, which the kernel
+// may only partly honour: major_faults tell how cold they really were.
+#include "container.h"
+#include "directory_index.h"
+#include "directory_scanner.h"
+#include "directory_table.h"
+#include "sharded_map.h"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace
+{
+namespace bipc = boost::interprocess;
+namespace fs = boost::filesystem;
+
+using StringMap = HardDriveContainers::Map<std::string, std::string>;
+using FileStorage = HardDriveContainers::Map<std::string, uint64_t>;
+using IntegerMap = HardDriveContainers::Map<uint64_t, uint64_t>;
+using ShardedFileStorage = HardDriveContainers::ShardedMap<std::string, uint64_t>;
+
+constexpr uint64_t seed = 42;
+constexpr size_t valueSize = 16;
+constexpr size_t multiValueCount = 8;
+constexpr size_t initialFileSize = 4 * 1024 * 1024ul;
+
+struct Options
+{
+    size_t entries {200000};
+    size_t treeDirectories {2000};
+    size_t filesPerDirectory {50};
+};
+
+struct Parameters
+{
+    size_t keySize {0};
+    size_t bucketCount {0};
+    std::string cache {"warm"};
+    size_t shards {1};
+};
+
+// The size of a map's file and the part of its segment in use, per entry.
+struct Footprint
+{
+    size_t entries {0};
+    size_t fileBytes {0};
+    size_t usedBytes {0};
+};
+
+template <class MapT>
+Footprint footprint(const MapT& map, const std::string& filename, const size_t entries)
+{
+    const auto* segmentManager = map.GetSegmentManager();
+    return Footprint {entries, size_t(fs::file_size(filename)), segmentManager->get_size() - segmentManager->get_free_memory()};
+}
+
+template <class Key, class Value>
+Footprint footprint(const HardDriveContainers::ShardedMap<Key, Value>& map, const std::string& filename, const size_t entries)
+{
+    Footprint total {entries};
+
+    for (size_t index = 0; index < map.ShardCount(); ++index)
+    {
+        const Footprint shard = footprint(map.GetShard(index), map.FilenameFor(filename, index), entries);
+
+        total.fileBytes += shard.fileBytes;
+        total.usedBytes += shard.usedBytes;
+    }
+    return total;
+}
+
+// Times operations one by one and reports them with the page faults taken meanwhile.
+class Measurement
+{
+public:
+    Measurement()
+    {
+        ::getrusage(RUSAGE_SELF, &m_Usage);
+        m_Start = std::chrono::steady_clock::now();
+    }
+
+    template <class Operation>
+    void Time(Operation operation)
+    {
+        const auto begin = std::chrono::steady_clock::now();
+        operation();
+        m_Latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count());
+    }
+
+    // operations is the number of latencies taken, if any were.
+    void Report(const std::string& benchmark, const Parameters& parameters, size_t operations, const Footprint& footprint)
+    {
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_Start).count();
+        rusage usage;
+        ::getrusage(RUSAGE_SELF, &usage);
+
+        operations = m_Latencies.empty() ? operations : m_Latencies.size();
+
+        std::cout << "{\"benchmark\":\"" << benchmark << "\",\"key_size\":" << parameters.keySize
+                  << ",\"bucket_count\":" << parameters.bucketCount << ",\"shards\":" << parameters.shards << ",\"cache\":\"" << parameters.cache
+                  << "\",\"operations\":" << operations << ",\"ops_per_sec\":" << uint64_t(operations / seconds)
+                  << ",\"p50_ns\":" << Percentile(0.5) << ",\"p99_ns\":" << Percentile(0.99) << ",\"p999_ns\":" << Percentile(0.999)
+                  << ",\"file_bytes_per_entry\":" << PerEntry(footprint.fileBytes, footprint.entries)
+                  << ",\"used_bytes_per_entry\":" << PerEntry(footprint.usedBytes, footprint.entries)
+                  << ",\"minor_faults\":" << usage.ru_minflt - m_Usage.ru_minflt
+                  << ",\"major_faults\":" << usage.ru_majflt - m_Usage.ru_majflt << "}" << std::endl;
+    }
+
+private:
+    static double PerEntry(const size_t bytes, const size_t entries)
+    {
+        return entries ? double(bytes) / entries : 0.0;
+    }
+
+    // null without per-operation latencies.
+    std::string Percentile(const double fraction)
+    {
+        if (m_Latencies.empty())
+        {
+            return "null";
+        }
+
+        const auto position = m_Latencies.begin() + std::min<size_t>(m_Latencies.size() * fraction, m_Latencies.size() - 1);
+        std::nth_element(m_Latencies.begin(), position, m_Latencies.end());
+        return std::to_string(*position);
+    }
+
+    rusage m_Usage;
+    std::chrono::steady_clock::time_point m_Start;
+    std::vector<uint64_t> m_Latencies;
+};
+
+// Fixed size keys: a prefix, the index, and padding. Misses use another prefix.
+std::string makeKey(const char prefix, const size_t index, const size_t keySize)
+{
+    std::string key = prefix + std::to_string(index);
+    key.resize(std::max(keySize, key.size()), '.');
+    return key;
+}
+
+std::vector<size_t> shuffledIndexes(const size_t count)
+{
+    std::vector<size_t> indexes(count);
+
+    for (size_t index = 0; index < count; ++index)
+    {
+        indexes[index] = index;
+    }
+
+    std::shuffle(indexes.begin(), indexes.end(), std::mt19937_64(seed));
+    return indexes;
+}
+
+// Writes back the dirty pages of the file, then asks the kernel to drop all of them.
+void dropFromPageCache(const std::string& filename)
+{
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+
+    if (fd >= 0)
+    {
+        ::fdatasync(fd);
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+    }
+}
+
+// Insert, warm and cold hits, misses and erase, all on one map of single values.
+void benchmarkSingleValues(const Options& options, const size_t keySize, const size_t bucketCount)
+{
+    const std::string filename = "bench_map.tmp";
+    const std::vector<size_t> order = shuffledIndexes(options.entries);
+    const std::string value(valueSize, 'v');
+    Parameters parameters {keySize, bucketCount};
+    std::vector<std::string> keys, misses;
+
+    for (size_t index = 0; index < options.entries; ++index)
+    {
+        keys.push_back(makeKey('k', index, keySize));
+        misses.push_back(makeKey('m', index, keySize));
+    }
+
+    std::remove(filename.c_str());
+
+    {
+        StringMap map(filename.c_str(), initialFileSize, bucketCount);
+        Measurement insert;
+
+        for (const std::string& key : keys)
+        {
+            insert.Time([&]() { map.Insert(key, value); });
+        }
+        insert.Report("insert", parameters, 0, footprint(map, filename, map.Size()));
+
+        Measurement findHit;
+        size_t found = 0;
+
+        for (const size_t index : order)
+        {
+            findHit.Time([&]() { found += map.Find(keys[index]) != nullptr; });
+        }
+        findHit.Report("find_hit", parameters, 0, footprint(map, filename, map.Size()));
+
+        Measurement findMiss;
+
+        for (const size_t index : order)
+        {
+            findMiss.Time([&]() { found += map.Find(misses[index]) != nullptr; });
+        }
+        findMiss.Report("find_miss", parameters, 0, footprint(map, filename, map.Size()));
+
+        if (found != options.entries)
+        {
+            std::cerr << "find_hit found " << found << " of " << options.entries << " keys" << std::endl;
+        }
+    }
+
+    dropFromPageCache(filename);
+
+    {
+        const StringMap map(bipc::open_read_only, filename.c_str());
+        Measurement findHit;
+        size_t found = 0;
+
+        parameters.cache = "cold";
+
+        for (const size_t index : order)
+        {
+            findHit.Time([&]() { found += map.Find(keys[index]) != nullptr; });
+        }
+        findHit.Report("find_hit", parameters, 0, footprint(map, filename, map.Size()));
+
+        if (found != options.entries)
+        {
+            std::cerr << "cold find_hit found " << found << " of " << options.entries << " keys" << std::endl;
+        }
+    }
+
+    {
+        StringMap map(filename.c_str());
+        Measurement erase;
+
+        parameters.cache = "warm";
+
+        for (const size_t index : order)
+        {
+            erase.Time([&]() { map.Erase(keys[index]); });
+        }
+        erase.Report("erase", parameters, 0, footprint(map, filename, options.entries));
+    }
+
+    std::remove(filename.c_str());
+}
+
+// Integer keys and values, which take the open-addressing layout: insert, hits and misses.
+void benchmarkIntegers(const Options& options, const size_t bucketCount)
+{
+    const std::string filename = "bench_map.tmp";
+    const std::vector<size_t> order = shuffledIndexes(options.entries);
+    const Parameters parameters {sizeof(uint64_t), bucketCount};
+    std::vector<uint64_t> keys(options.entries);
+    std::mt19937_64 random(seed);
+
+    for (uint64_t& key : keys)
+    {
+        key = random() | 1;
+    }
+
+    std::remove(filename.c_str());
+
+    {
+        IntegerMap map(filename.c_str(), initialFileSize, bucketCount);
+        Measurement insert;
+
+        for (const uint64_t key : keys)
+        {
+            insert.Time([&]() { map.Insert(key, key); });
+        }
+        insert.Report("integer_insert", parameters, 0, footprint(map, filename, map.Size()));
+
+        Measurement findHit;
+        size_t found = 0;
+
+        for (const size_t index : order)
+        {
+            findHit.Time([&]() { found += map.Find(keys[index]) != nullptr; });
+        }
+        findHit.Report("integer_find_hit", parameters, 0, footprint(map, filename, map.Size()));
+
+        Measurement findMiss;
+
+        for (const size_t index : order)
+        {
+            findMiss.Time([&]() { found += map.Find(keys[index] & ~uint64_t(1)) != nullptr; });
+        }
+        findMiss.Report("integer_find_miss", parameters, 0, footprint(map, filename, map.Size()));
+
+        if (found != options.entries)
+        {
+            std::cerr << "integer_find_hit found " << found << " of " << options.entries << " keys" << std::endl;
+        }
+    }
+
+    std::remove(filename.c_str());
+}
+
+// multiValueCount values per key: every Insert appends to a key's values, every FindAll
+// walks all of them.
+void benchmarkMultipleValues(const Options& options, const size_t keySize, const size_t bucketCount)
+{
+    const std::string filename = "bench_map.tmp";
+    const size_t keyCount = options.entries / multiValueCount;
+    const std::vector<size_t> order = shuffledIndexes(keyCount);
+    const Parameters parameters {keySize, bucketCount};
+    std::vector<std::string> keys;
+
+    for (size_t index = 0; index < keyCount; ++index)
+    {
+        keys.push_back(makeKey('k', index, keySize));
+    }
+
+    std::remove(filename.c_str());
+
+    {
+        StringMap map(filename.c_str(), initialFileSize, bucketCount);
+        Measurement insert;
+
+        for (size_t round = 0; round < multiValueCount; ++round)
+        {
+            const std::string value = makeKey('v', round, valueSize);
+
+            for (const std::string& key : keys)
+            {
+                insert.Time([&]() { map.Insert(key, value); });
+            }
+        }
+        insert.Report("multi_value_insert", parameters, 0, footprint(map, filename, map.Size()));
+
+        Measurement findAll;
+        size_t bytes = 0;
+
+        for (const size_t index : order)
+        {
+            findAll.Time([&]()
+            {
+                for (const std::string_view value : map.FindAll(keys[index]))
+                {
+                    bytes += value.size();
+                }
+            });
+        }
+        findAll.Report("multi_value_find_all", parameters, 0, footprint(map, filename, map.Size()));
+
+        if (bytes != keyCount * multiValueCount * valueSize)
+        {
+            std::cerr << "multi_value_find_all read " << bytes << " bytes" << std::endl;
+        }
+    }
+
+    std::remove(filename.c_str());
+}
+
+// Batches of file names inserted into a ShardedMap by one thread per shard, as 'fs_dump
+// scan' does: throughput is the whole load over its wall time.
+void benchmarkShardedInsert(const Options& options, const size_t shardCount)
+{
+    const std::string filename = "bench_shards.tmp";
+    const size_t batchSize = 4096;
+    Parameters parameters {32, options.entries};
+    std::vector<FsDump::FileBatch> batches((options.entries + batchSize - 1) / batchSize);
+
+    parameters.shards = shardCount;
+
+    for (size_t index = 0; index < options.entries; ++index)
+    {
+        batches[index / batchSize].emplace_back(makeKey('k', index, parameters.keySize), index);
+    }
+
+    ShardedFileStorage::Remove(filename);
+
+    {
+        ShardedFileStorage map(filename.c_str(), shardCount, initialFileSize * shardCount, options.entries);
+        std::vector<std::thread> threads;
+        Measurement insert;
+
+        for (size_t thread = 0; thread < shardCount; ++thread)
+        {
+            threads.emplace_back([&, thread]()
+            {
+                for (size_t batch = thread; batch < batches.size(); batch += shardCount)
+                {
+                    map.InsertBatch(batches[batch]);
+                }
+            });
+        }
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+        insert.Report("sharded_insert_batch", parameters, options.entries, footprint(map, filename, map.Size()));
+    }
+
+    ShardedFileStorage::Remove(filename);
+}
+
+// A tree of treeDirectories directories, 64 per parent, each holding filesPerDirectory
+// empty files. Reused when it is already there.
+fs::path makeTree(const Options& options)
+{
+    const fs::path root = "bench_tree_" + std::to_string(options.treeDirectories) + "x" + std::to_string(options.filesPerDirectory);
+
+    if (fs::is_directory(root))
+    {
+        return root;
+    }
+
+    std::vector<fs::path> directories {root};
+    fs::create_directory(root);
+
+    for (size_t index = 1; index < options.treeDirectories; ++index)
+    {
+        directories.push_back(directories[(index - 1) / 64] / ("dir" + std::to_string(index)));
+        fs::create_directory(directories.back());
+    }
+
+    for (const fs::path& directory : directories)
+    {
+        for (size_t file = 0; file < options.filesPerDirectory; ++file)
+        {
+            std::ofstream((directory / ("file" + std::to_string(file) + ".txt")).string());
+        }
+    }
+    return root;
+}
+
+// What 'fs_dump scan' does: the parallel scanner feeding the file index, the directory
+// index and the directory table.
+void benchmarkScan(const Options& options)
+{
+    const fs::path root = makeTree(options);
+    const std::string filename = "bench_storage.tmp";
+    const std::string directoryIndexFile = FsDump::DirectoryIndex::FilenameFor(filename);
+    const std::string directoryTableFile = FsDump::DirectoryTable::FilenameFor(filename);
+    const Parameters parameters {0, 0, "warm"};
+
+    for (const std::string& file : {filename, directoryIndexFile, directoryTableFile})
+    {
+        std::remove(file.c_str());
+    }
+
+    size_t files = 0;
+
+    {
+        FileStorage storage(filename.c_str());
+        FsDump::DirectoryIndex directoryIndex(directoryIndexFile);
+        FsDump::DirectoryTable directoryTable(directoryTableFile);
+        FsDump::DirectoryScanner scanner(FsDump::DirectoryScanner::DefaultThreadCount());
+        FsDump::FileBatch batch;
+        Measurement scan;
+
+        files = scanner.Scan(root, [&](FsDump::ScanBatch& scanned)
+        {
+            directoryIndex.Put(scanned.directories);
+            directoryTable.Add(scanned.directories);
+
+            for (FsDump::DirectoryListing& listing : scanned.directories)
+            {
+                for (std::string& name : listing.files)
+                {
+                    batch.emplace_back(std::move(name), listing.id);
+                }
+            }
+
+            storage.InsertBatch(batch);
+            batch.clear();
+        }, directoryTable.NextId());
+
+        scan.Report("fs_dump_scan", parameters, files, footprint(storage, filename, files));
+    }
+
+    for (const std::string& file : {filename, directoryIndexFile, directoryTableFile})
+    {
+        std::remove(file.c_str());
+    }
+}
+
+// --entries=, --tree-directories= and --files-per-directory= override the defaults.
+Options parseOptions(const int argc, const char** argv)
+{
+    Options options;
+
+    for (int arg = 1; arg < argc; ++arg)
+    {
+        const std::string option = argv[arg];
+        const size_t separator = option.find('=');
+        const std::string name = option.substr(0, separator);
+        const size_t value = (separator != std::string::npos) ? std::stoul(option.substr(separator + 1)) : 0;
+
+        if (name == "--entries")
+        {
+            options.entries = value;
+        }
+        else if (name == "--tree-directories")
+        {
+            options.treeDirectories = std::max<size_t>(value, 1);
+        }
+        else if (name == "--files-per-directory")
+        {
+            options.filesPerDirectory = value;
+        }
+        else
+        {
+            std::cerr << "Unknown option '" << option << "' ignored" << std::endl;
+        }
+    }
+    return options;
+}
+} //namespace
+
+int main(int argc, const char** argv)
+{
+    const Options options = parseOptions(argc, argv);
+
+    // A small initial bucket count exercises incremental bucket splits, a presized one
+    // the lookups alone.
+    for (const size_t keySize : {8, 32, 128})
+    {
+        for (const size_t bucketCount : {size_t(1024), options.entries})
+        {
+            benchmarkSingleValues(options, keySize, bucketCount);
+        }
+        benchmarkMultipleValues(options, keySize, options.entries / multiValueCount);
+    }
+
+    for (const size_t bucketCount : {size_t(1024), options.entries})
+    {
+        benchmarkIntegers(options, bucketCount);
+    }
+
+    for (const size_t shardCount : {1, 2, 4, 8})
+    {
+        benchmarkShardedInsert(options, shardCount);
+    }
+
+    benchmarkScan(options);
+    return 0;
+}
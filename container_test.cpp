@@ -2,8 +2,27 @@
 #define BOOST_TEST_DYN_LINK
 #include <boost/test/included/unit_test.hpp>
 #include "container.h"
+#include "directory_index.h"
+#include "directory_watcher.h"
+#include "frozen_map.h"
+#include "name_index.h"
+#include "query_server.h"
+#include "sharded_map.h"
 
 #include <boost/interprocess/containers/string.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/mpl/list.hpp>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string_view>
+#include <thread>
 
 BOOST_AUTO_TEST_SUITE(hdd_map_test_suite)
 
@@ -159,16 +178,1650 @@ BOOST_AUTO_TEST_CASE(move_test)
     BOOST_REQUIRE_EQUAL(b.Size(), 3ul);
     BOOST_REQUIRE_EQUAL(*b.Find("1"), "3");
 
-    auto valueNode = b.FindAll("1");
-
     std::vector<std::string> values;
-    for (; valueNode; valueNode = valueNode->nextValueNode)
+    for (const auto& value : b.FindAll("1"))
     {
-        values.push_back(valueNode->storedValue->c_str());
+        values.emplace_back(value);
     }
 
     BOOST_CHECK(values == std::vector<std::string>({"3", "2", "1"}));
 
     std::remove(storeFileme);
 }
+
+BOOST_AUTO_TEST_CASE(rehash_testing, *boost::unit_test::timeout(10))
+{
+    using namespace boost::interprocess;
+
+    using CharAllocator = allocator<char, managed_mapped_file::segment_manager>;
+    using string = basic_string<char, std::char_traits<char>, CharAllocator>;
+
+    const char* storeFileme = "store.tmp";
+
+    std::remove(storeFileme);
+
+    constexpr size_t elementCount = (size_t)1e5;
+
+    {
+        HardDriveContainers::Map<string, string> a(storeFileme, 1024ul, 4ul);
+
+        BOOST_REQUIRE_EQUAL(a.BucketCount(), 4ul);
+
+        for (size_t i = 0; i < elementCount; ++i)
+        {
+            a.Insert(std::to_string(i).c_str(), std::to_string(i).c_str());
+        }
+
+        BOOST_REQUIRE_EQUAL(a.Size(), elementCount);
+        BOOST_CHECK(a.BucketCount() >= elementCount / 2);
+        BOOST_CHECK(a.LoadFactor() <= a.MAX_LOAD_FACTOR);
+
+        for (size_t i = 0; i < elementCount; i += 2)
+        {
+            BOOST_REQUIRE_EQUAL(a.Erase(std::to_string(i).c_str()), 1ul);
+        }
+    }
+
+    HardDriveContainers::Map<string, string> b(storeFileme, 1024ul, 1000ul);
+
+    BOOST_REQUIRE_EQUAL(b.Size(), elementCount / 2);
+    BOOST_CHECK(b.BucketCount() >= elementCount / 2);
+
+    for (size_t i = 0; i < elementCount; ++i)
+    {
+        BOOST_REQUIRE_EQUAL(b.Count(std::to_string(i).c_str()), i % 2);
+    }
+
+    std::remove(storeFileme);
+}
+
+BOOST_AUTO_TEST_CASE(heterogeneous_lookup_testing)
+{
+    using namespace boost::interprocess;
+
+    using CharAllocator = allocator<char, managed_mapped_file::segment_manager>;
+    using string = basic_string<char, std::char_traits<char>, CharAllocator>;
+
+    const char* storeFileme = "store.tmp";
+
+    std::remove(storeFileme);
+
+    {
+        HardDriveContainers::Map<string, string> a(storeFileme, 1024 * 1024ul, 16ul);
+
+        a.Insert("key", "value");
+        a.Insert(std::string("key"), std::string("value2"));
+        a.Insert(std::string_view("other"), "value");
+
+        BOOST_REQUIRE_EQUAL(a.Count(std::string("key")), 2ul);
+        BOOST_REQUIRE_EQUAL(a.Count(std::string_view("other")), 1ul);
+        BOOST_REQUIRE_EQUAL(a.Erase(std::string_view("key"), std::string("value")), 1ul);
+        BOOST_REQUIRE_EQUAL(a.Count("key"), 1ul);
+    }
+
+    const HardDriveContainers::Map<string, string> b(open_read_only, storeFileme);
+
+    BOOST_REQUIRE_EQUAL(b.Size(), 2ul);
+    BOOST_REQUIRE_EQUAL(*b.Find(std::string_view("key")), "value2");
+    BOOST_REQUIRE_EQUAL(*b.Find(std::string("other")), "value");
+    BOOST_REQUIRE_EQUAL(b.Count("other"), 1ul);
+    BOOST_CHECK(b.Find("missing") == nullptr);
+    BOOST_CHECK(b.FindAll(std::string_view("missing")).empty());
+
+    HardDriveContainers::Map<string, string> c(open_read_only, storeFileme);
+    BOOST_CHECK_THROW(c.Insert("key", "value"), interprocess_exception);
+    BOOST_CHECK_THROW(c.Erase("key"), interprocess_exception);
+    BOOST_REQUIRE_EQUAL(c.Count("key"), 1ul);
+
+    HardDriveContainers::PrewarmOptions prewarm;
+    prewarm.populate = prewarm.randomAccess = prewarm.willNeedBuckets = prewarm.hugePages = true;
+
+    const HardDriveContainers::Map<string, string> d(open_read_only, storeFileme, prewarm);
+    BOOST_REQUIRE_EQUAL(*d.Find("key"), "value2");
+
+    std::remove(storeFileme);
+}
+
+BOOST_AUTO_TEST_CASE(record_layout_testing)
+{
+    using namespace boost::interprocess;
+
+    const char* storeFileme = "store.tmp";
+
+    std::remove(storeFileme);
+
+    HardDriveContainers::Map<std::string, std::string> a(storeFileme, 1024 * 1024ul, 16ul);
+
+    // Records come from size-class slabs with no per-record header: a key with its first
+    // value takes the node header and its bytes, rounded up to the next class.
+    constexpr size_t recordCount = 1000;
+    const size_t freeMemory = a.GetSegmentManager()->get_free_memory();
+
+    for (size_t i = 0; i < recordCount; ++i)
+    {
+        a.Insert("key" + std::to_string(1000 + i), "value");
+    }
+
+    const size_t recordsSize = freeMemory - a.GetSegmentManager()->get_free_memory();
+    BOOST_TEST_MESSAGE(recordsSize / recordCount);
+    BOOST_CHECK(recordsSize / recordCount < 80);
+
+    for (size_t i = 0; i < recordCount; ++i)
+    {
+        BOOST_REQUIRE_EQUAL(a.Erase("key" + std::to_string(1000 + i)), 1ul);
+    }
+
+    const size_t slabFreeMemory = a.GetSegmentManager()->get_free_memory();
+    a.Insert("key", "first");
+    BOOST_CHECK(a.Find("key") != nullptr);
+
+    a.Insert("key", "second");
+    a.Insert("key", "third");
+    BOOST_REQUIRE_EQUAL(*a.Find("key"), "third");
+
+    BOOST_REQUIRE_EQUAL(a.Erase("key", "first"), 1ul);
+    BOOST_REQUIRE_EQUAL(a.Count("key"), 2ul);
+
+    std::vector<std::string> values(a.FindAll("key").begin(), a.FindAll("key").end());
+    BOOST_CHECK(values == std::vector<std::string>({"third", "second"}));
+
+    BOOST_REQUIRE_EQUAL(a.Erase("key", "third"), 1ul);
+    BOOST_REQUIRE_EQUAL(a.Erase("key", "second"), 1ul);
+    BOOST_REQUIRE_EQUAL(a.Count("key"), 0ul);
+    BOOST_CHECK(a.GetSegmentManager()->get_free_memory() >= slabFreeMemory - HardDriveContainers::RecordArena::MAX_SLAB_SIZE);
+
+    // Freed records are reused: the same keys again take no new memory.
+    for (size_t i = 0; i < recordCount; ++i)
+    {
+        a.Insert("key" + std::to_string(1000 + i), "value");
+    }
+    BOOST_CHECK(a.GetSegmentManager()->get_free_memory() >= slabFreeMemory - HardDriveContainers::RecordArena::MAX_SLAB_SIZE);
+
+    HardDriveContainers::Map<uint64_t, uint64_t> b("store_ints.tmp", 1024 * 1024ul, 16ul);
+
+    b.Insert(1, 10);
+    b.Insert(1u, 11ul);
+    b.Insert(2, 20);
+    BOOST_REQUIRE_EQUAL(*b.Find(1), 11ul);
+    BOOST_REQUIRE_EQUAL(b.Count(1), 2ul);
+    BOOST_REQUIRE_EQUAL(b.Erase(1, 10), 1ul);
+    BOOST_REQUIRE_EQUAL(*b.Find(2ul), 20ul);
+
+    std::remove(storeFileme);
+    std::remove("store_ints.tmp");
+}
+
+BOOST_AUTO_TEST_CASE(value_chunk_testing, *boost::unit_test::timeout(10))
+{
+    const char* storeFileme = "store.tmp";
+
+    std::remove(storeFileme);
+
+    HardDriveContainers::Map<std::string, std::string> a(storeFileme, 1024 * 1024ul, 16ul);
+
+    constexpr size_t elementCount = (size_t)1e4;
+
+    std::vector<std::string> expected;
+    for (size_t i = 0; i < elementCount; ++i)
+    {
+        const std::string value(i % 7 + 1, char('a' + i % 3));
+
+        a.Insert("key", value);
+        expected.insert(expected.begin(), value);
+    }
+
+    std::vector<std::string> values(a.FindAll("key").begin(), a.FindAll("key").end());
+    BOOST_REQUIRE(values == expected);
+    BOOST_REQUIRE(a.GetAll("key") == expected);
+
+    const size_t erased = a.Erase("key", "bb");
+    expected.erase(std::remove(expected.begin(), expected.end(), "bb"), expected.end());
+
+    BOOST_REQUIRE_EQUAL(erased, elementCount - expected.size());
+    BOOST_REQUIRE_EQUAL(a.Count("key"), expected.size());
+    BOOST_REQUIRE_EQUAL(*a.Find("key"), expected.front());
+
+    values.assign(a.FindAll("key").begin(), a.FindAll("key").end());
+    BOOST_REQUIRE(values == expected);
+
+    a.Insert("key", "new");
+    expected.insert(expected.begin(), "new");
+    BOOST_REQUIRE(a.GetAll("key") == expected);
+
+    BOOST_REQUIRE_EQUAL(a.Erase("key"), expected.size());
+    BOOST_REQUIRE(a.FindAll("key").begin() == a.FindAll("key").end());
+
+    std::remove(storeFileme);
+}
+
+struct CountingEqual : HardDriveContainers::EqualTo
+{
+    template <class T, class U>
+    bool operator ()(const T& lhv, const U& rhv) const
+    {
+        ++comparisons;
+        return HardDriveContainers::EqualTo::operator ()(lhv, rhv);
+    }
+
+    static size_t comparisons;
+};
+
+size_t CountingEqual::comparisons = 0;
+
+BOOST_AUTO_TEST_CASE(stored_hash_testing)
+{
+    const char* storeFileme = "store.tmp";
+
+    std::remove(storeFileme);
+
+    HardDriveContainers::Map<std::string, std::string, HardDriveContainers::Hash, CountingEqual> a(storeFileme, 1024 * 1024ul, 1ul);
+
+    constexpr size_t elementCount = 1000;
+
+    for (size_t i = 0; i < elementCount; ++i)
+    {
+        a.Insert(std::to_string(i), std::to_string(i));
+    }
+
+    CountingEqual::comparisons = 0;
+
+    for (size_t i = 0; i < elementCount; ++i)
+    {
+        BOOST_REQUIRE_EQUAL(a.Count(std::to_string(i)), 1ul);
+        BOOST_REQUIRE_EQUAL(a.Count(std::to_string(i + elementCount)), 0ul);
+    }
+
+    BOOST_REQUIRE_EQUAL(CountingEqual::comparisons, elementCount);
+
+    for (size_t i = 0; i < elementCount; ++i)
+    {
+        BOOST_REQUIRE_EQUAL(a.Erase(std::to_string(i), std::to_string(i)), 1ul);
+    }
+
+    BOOST_REQUIRE_EQUAL(CountingEqual::comparisons, elementCount * 2);
+    BOOST_REQUIRE_EQUAL(a.Empty(), true);
+
+    std::remove(storeFileme);
+}
+
+BOOST_AUTO_TEST_CASE(batch_insert_testing, *boost::unit_test::timeout(10))
+{
+    const char* storeFileme = "store.tmp";
+
+    std::remove(storeFileme);
+
+    HardDriveContainers::Map<std::string, std::string> a(storeFileme, 1024ul, 4ul);
+
+    a.Insert("existing", "old");
+
+    constexpr size_t elementCount = (size_t)1e5;
+
+    std::vector<std::pair<std::string, std::string>> batch;
+    for (size_t i = 0; i < elementCount; ++i)
+    {
+        batch.emplace_back(std::to_string(i % (elementCount / 2)), std::to_string(i));
+    }
+    batch.emplace_back("existing", "new");
+
+    a.InsertBatch(batch);
+
+    BOOST_REQUIRE_EQUAL(a.Size(), elementCount + 2);
+    BOOST_CHECK(a.LoadFactor() <= a.MAX_LOAD_FACTOR);
+
+    for (size_t i = 0; i < elementCount / 2; ++i)
+    {
+        BOOST_REQUIRE_EQUAL(a.Count(std::to_string(i)), 2ul);
+        BOOST_REQUIRE_EQUAL(*a.Find(std::to_string(i)), std::to_string(i + elementCount / 2));
+    }
+
+    std::vector<std::string> values(a.FindAll("existing").begin(), a.FindAll("existing").end());
+    BOOST_CHECK(values == std::vector<std::string>({"new", "old"}));
+
+    for (size_t i = 0; i < elementCount / 2; ++i)
+    {
+        BOOST_REQUIRE_EQUAL(a.Erase(std::to_string(i)), 2ul);
+    }
+
+    a.InsertBatch(std::vector<std::pair<std::string, std::string>>());
+    BOOST_REQUIRE_EQUAL(a.Size(), 2ul);
+
+    std::remove(storeFileme);
+}
+BOOST_AUTO_TEST_CASE(compact_testing, *boost::unit_test::timeout(30))
+{
+    const char* storeFileme = "store.tmp";
+
+    std::remove(storeFileme);
+
+    HardDriveContainers::Map<std::string, std::string> a(storeFileme, 1024ul, 64ul);
+
+    constexpr size_t elementCount = (size_t)1e5;
+
+    for (size_t i = 0; i < elementCount; ++i)
+    {
+        a.Insert(std::to_string(i % (elementCount / 4)), std::string(i % 50, 'v') + std::to_string(i));
+    }
+
+    for (size_t i = 0; i < elementCount / 4; ++i)
+    {
+        if (i % 4 != 0)
+        {
+            BOOST_REQUIRE_EQUAL(a.Erase(std::to_string(i)), 4ul);
+        }
+        else
+        {
+            BOOST_REQUIRE_EQUAL(a.Erase(std::to_string(i), std::string(i % 50, 'v') + std::to_string(i)), 1ul);
+        }
+    }
+
+    std::vector<std::vector<std::string>> expected;
+    for (size_t i = 0; i < elementCount / 4; i += 4)
+    {
+        expected.push_back(a.GetAll(std::to_string(i)));
+    }
+
+    const HardDriveContainers::Map<std::string, std::string> reader(boost::interprocess::open_read_only, storeFileme);
+    BOOST_REQUIRE(reader.GetAll("4") == expected[1]);
+
+    const size_t size = a.Size();
+    const size_t usedMemory = a.GetSegmentManager()->get_size() - a.GetSegmentManager()->get_free_memory();
+
+    a.Compact();
+
+    BOOST_REQUIRE_EQUAL(a.Size(), size);
+    BOOST_CHECK(a.GetSegmentManager()->get_size() < usedMemory);
+    BOOST_CHECK(a.LoadFactor() > 0.5);
+
+    for (size_t i = 0; i < elementCount / 4; ++i)
+    {
+        if (i % 4 != 0)
+        {
+            BOOST_REQUIRE(a.Find(std::to_string(i)) == nullptr);
+        }
+        else
+        {
+            const auto values = a.FindAll(std::to_string(i));
+            BOOST_REQUIRE(std::vector<std::string>(values.begin(), values.end()) == expected[i / 4]);
+            BOOST_REQUIRE(reader.GetAll(std::to_string(i)) == expected[i / 4]);
+        }
+    }
+
+    // The compacted map keeps working as usual.
+    a.Insert("0", "new");
+    BOOST_REQUIRE_EQUAL(*reader.Get("0"), "new");
+    BOOST_REQUIRE_EQUAL(a.Erase("4"), expected[1].size());
+    BOOST_REQUIRE_EQUAL(a.Erase("8", expected[2].back()), 1ul);
+    BOOST_REQUIRE_EQUAL(a.Count("8"), expected[2].size() - 1);
+
+    std::remove(storeFileme);
+}
+
+BOOST_AUTO_TEST_CASE(frozen_map_testing, *boost::unit_test::timeout(30))
+{
+    const char* storeFileme = "store.tmp";
+    const std::string frozenFilename = HardDriveContainers::FrozenMap<std::string, std::string>::FilenameFor(storeFileme);
+
+    std::remove(storeFileme);
+
+    HardDriveContainers::Map<std::string, std::string> a(storeFileme, 1024ul, 64ul);
+
+    constexpr size_t elementCount = (size_t)1e5;
+
+    for (size_t i = 0; i < elementCount; ++i)
+    {
+        a.Insert(std::to_string(i % (elementCount / 3)), std::string(i % 20, 'v') + std::to_string(i));
+    }
+    a.Insert("", "empty key");
+
+    HardDriveContainers::FrozenMap<std::string, std::string>::Write(a, frozenFilename);
+
+    const HardDriveContainers::FrozenMap<std::string, std::string> frozen(frozenFilename.c_str());
+
+    BOOST_REQUIRE_EQUAL(frozen.Size(), a.Size());
+    BOOST_REQUIRE_EQUAL(frozen.KeyCount(), elementCount / 3 + 1);
+
+    for (size_t i = 0; i < elementCount / 3; ++i)
+    {
+        const std::string key = std::to_string(i);
+        const auto values = frozen.FindAll(key);
+
+        BOOST_REQUIRE_EQUAL(frozen.Count(key.c_str()), a.Count(key));
+        BOOST_REQUIRE(std::vector<std::string>(values.begin(), values.end()) == a.GetAll(key));
+        BOOST_REQUIRE(frozen.FindAll("missing" + key).empty());
+    }
+
+    BOOST_REQUIRE(frozen.GetAll(std::string_view("")) == std::vector<std::string>({"empty key"}));
+    BOOST_REQUIRE(frozen.GetMany(std::vector<std::string>({"1", "x"})) == a.GetMany(std::vector<std::string>({"1", "x"})));
+
+    HardDriveContainers::Map<uint64_t, uint64_t> b("store_ints.tmp", 1024 * 1024ul, 16ul);
+
+    for (uint64_t i = 0; i < 1000; ++i)
+    {
+        b.Insert(i * i, i);
+    }
+    b.Insert(4, 5);
+
+    HardDriveContainers::FrozenMap<uint64_t, uint64_t>::Write(b, "store_ints.tmp.frozen");
+    const HardDriveContainers::FrozenMap<uint64_t, uint64_t> frozenInts("store_ints.tmp.frozen");
+
+    BOOST_REQUIRE(frozenInts.GetAll(4) == std::vector<uint64_t>({5, 2}));
+    BOOST_REQUIRE_EQUAL(frozenInts.Count(998001u), 1ul);
+    BOOST_REQUIRE_EQUAL(frozenInts.Count(3), 0ul);
+
+    // Entries pointing past the records, or keys running into the entries, are reported
+    // instead of read. The header is 40 bytes, its last field the offset of the entries.
+    std::string snapshot;
+    {
+        std::ifstream input("store_ints.tmp.frozen", std::ios::binary);
+        snapshot.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    }
+    uint64_t entriesOffset = 0;
+    std::memcpy(&entriesOffset, snapshot.data() + 32, sizeof(entriesOffset));
+
+    auto lookUpCorrupted = [](const std::string& corrupted)
+    {
+        std::ofstream("store_ints.tmp.corrupted", std::ios::binary) << corrupted;
+        const HardDriveContainers::FrozenMap<uint64_t, uint64_t> map("store_ints.tmp.corrupted");
+        size_t found = 0;
+
+        for (uint64_t i = 0; i < 1000; ++i)
+        {
+            found += map.Count(i * i);
+        }
+        return found;
+    };
+
+    BOOST_REQUIRE_EQUAL(lookUpCorrupted(snapshot), 1001ul);
+
+    std::string corrupted = snapshot;
+    std::memcpy(&corrupted[entriesOffset + sizeof(uint64_t)], &entriesOffset, sizeof(entriesOffset));
+    BOOST_CHECK_THROW(lookUpCorrupted(corrupted), boost::interprocess::interprocess_exception);
+
+    corrupted = snapshot;
+    const uint32_t keySize = uint32_t(entriesOffset);
+    std::memcpy(&corrupted[40], &keySize, sizeof(keySize));
+    BOOST_CHECK_THROW(lookUpCorrupted(corrupted), boost::interprocess::interprocess_exception);
+
+    std::remove(storeFileme);
+    std::remove(frozenFilename.c_str());
+    std::remove("store_ints.tmp");
+    std::remove("store_ints.tmp.frozen");
+    std::remove("store_ints.tmp.corrupted");
+}
+
+BOOST_AUTO_TEST_CASE(find_many_testing, *boost::unit_test::timeout(10))
+{
+    const char* storeFileme = "store.tmp";
+
+    std::remove(storeFileme);
+
+    HardDriveContainers::Map<std::string, std::string> a(storeFileme, 1024ul, 4ul);
+
+    constexpr size_t elementCount = (size_t)1e4;
+
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < elementCount; ++i)
+    {
+        a.Insert(std::to_string(i), std::to_string(i));
+
+        if (i % 3 == 0)
+        {
+            a.Insert(std::to_string(i), std::to_string(i + elementCount));
+        }
+        keys.push_back(std::to_string(elementCount - 1 - i));
+        keys.push_back("missing" + std::to_string(i));
+    }
+
+    const auto ranges = a.FindMany(keys);
+    const auto counts = a.CountMany(keys);
+    const auto values = a.GetMany(keys);
+
+    BOOST_REQUIRE_EQUAL(ranges.size(), keys.size());
+    BOOST_REQUIRE_EQUAL(counts.size(), keys.size());
+    BOOST_REQUIRE_EQUAL(values.size(), keys.size());
+
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        BOOST_REQUIRE_EQUAL(counts[i], a.Count(keys[i]));
+        BOOST_REQUIRE_EQUAL(ranges[i].size(), counts[i]);
+        BOOST_REQUIRE(std::vector<std::string>(ranges[i].begin(), ranges[i].end()) == a.GetAll(keys[i]));
+        BOOST_REQUIRE(values[i] == a.GetAll(keys[i]));
+    }
+
+    BOOST_CHECK(a.FindMany(std::vector<std::string>()).empty());
+    BOOST_CHECK(a.CountMany(std::vector<std::string_view>({"0", "1"})) == std::vector<size_t>({2, 1}));
+
+    std::remove(storeFileme);
+}
+
+BOOST_AUTO_TEST_CASE(iteration_testing, *boost::unit_test::timeout(10))
+{
+    const char* storeFileme = "store.tmp";
+
+    std::remove(storeFileme);
+
+    HardDriveContainers::Map<std::string, std::string> a(storeFileme, 1024ul, 4ul);
+
+    BOOST_REQUIRE(a.begin() == a.end());
+
+    constexpr size_t elementCount = (size_t)1e4;
+
+    for (size_t i = 0; i < elementCount; ++i)
+    {
+        a.Insert(std::to_string(i), std::to_string(i));
+
+        if (i % 3 == 0)
+        {
+            a.Insert(std::to_string(i), std::to_string(i + elementCount));
+        }
+    }
+
+    std::vector<bool> seen(elementCount);
+    size_t valueCount = 0;
+
+    for (const auto& [key, values] : a)
+    {
+        const size_t i = std::stoul(std::string(key));
+
+        BOOST_REQUIRE(!seen[i]);
+        BOOST_REQUIRE(std::vector<std::string>(values.begin(), values.end()) == a.GetAll(key));
+        seen[i] = true;
+        valueCount += values.size();
+    }
+
+    BOOST_REQUIRE(std::find(seen.begin(), seen.end(), false) == seen.end());
+    BOOST_REQUIRE_EQUAL(valueCount, a.Size());
+    BOOST_REQUIRE_EQUAL(std::distance(a.begin(), a.end()), (std::ptrdiff_t)elementCount);
+
+    constexpr size_t threadCount = 4;
+    std::vector<size_t> rangeKeys(threadCount), rangeValues(threadCount);
+    std::vector<std::thread> threads;
+    const size_t bucketCount = a.BucketCount();
+
+    for (size_t range = 0; range < threadCount; ++range)
+    {
+        threads.emplace_back([&, range]()
+        {
+            a.ForEachInRange(bucketCount * range / threadCount, bucketCount * (range + 1) / threadCount,
+                             [&](std::string_view, const auto& values)
+            {
+                ++rangeKeys[range];
+                rangeValues[range] += values.size();
+            });
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    BOOST_REQUIRE_EQUAL(std::accumulate(rangeKeys.begin(), rangeKeys.end(), 0ul), elementCount);
+    BOOST_REQUIRE_EQUAL(std::accumulate(rangeValues.begin(), rangeValues.end(), 0ul), a.Size());
+
+    size_t tailKeys = 0;
+    a.ForEachInRange(bucketCount / 2, bucketCount * 2, [&](std::string_view, const auto&) { ++tailKeys; });
+    BOOST_REQUIRE_EQUAL(tailKeys, rangeKeys[2] + rangeKeys[3]);
+
+    std::remove(storeFileme);
+}
+
+BOOST_AUTO_TEST_CASE(flat_map_testing, *boost::unit_test::timeout(60))
+{
+    using FlatMap = HardDriveContainers::Map<uint64_t, uint32_t>;
+
+    static_assert(HardDriveContainers::IsFlatStorable<uint64_t, uint32_t>::value, "fixed-size pairs are stored flat");
+    static_assert(!HardDriveContainers::IsFlatStorable<uint64_t, std::string>::value, "strings are stored in key nodes");
+
+    const char* storeFileme = "store_ints.tmp";
+
+    std::remove(storeFileme);
+
+    // Values of every key newest first, as the map returns them.
+    std::map<uint64_t, std::vector<uint32_t>> expected;
+    std::mt19937_64 random(42);
+
+    {
+        FlatMap a(storeFileme, 1024ul, 16ul);
+
+        for (size_t i = 0; i < (size_t)2e5; ++i)
+        {
+            const uint64_t key = random() % 20000;
+            const uint32_t value = random() % 8;
+            std::vector<uint32_t>& values = expected[key];
+
+            switch (random() % 8)
+            {
+            case 0:
+                BOOST_REQUIRE_EQUAL(a.Erase(key), values.size());
+                values.clear();
+                break;
+            case 1:
+                BOOST_REQUIRE_EQUAL(a.Erase(key, value), (size_t)std::count(values.begin(), values.end(), value));
+                values.erase(std::remove(values.begin(), values.end(), value), values.end());
+                break;
+            default:
+                a.Insert(key, value);
+                values.insert(values.begin(), value);
+            }
+        }
+
+        std::vector<std::pair<uint64_t, uint32_t>> batch;
+
+        for (uint32_t i = 0; i < 5000; ++i)
+        {
+            batch.emplace_back(i % 3 == 0 ? 7 : 100000 + i / 2, i);
+            expected[batch.back().first].insert(expected[batch.back().first].begin(), i);
+        }
+        a.InsertBatch(batch);
+
+        size_t keyCount = 0, valueCount = 0;
+
+        for (const auto& [key, values] : expected)
+        {
+            BOOST_REQUIRE(std::vector<uint32_t>(a.FindAll(key).begin(), a.FindAll(key).end()) == values);
+            BOOST_REQUIRE(a.GetAll(key) == values);
+            BOOST_REQUIRE_EQUAL(a.Count(key), values.size());
+            BOOST_REQUIRE_EQUAL(a.Find(key) != nullptr, !values.empty());
+            keyCount += !values.empty();
+            valueCount += values.size();
+        }
+
+        BOOST_REQUIRE_EQUAL(a.Size(), valueCount);
+        BOOST_REQUIRE_EQUAL(std::distance(a.begin(), a.end()), (std::ptrdiff_t)keyCount);
+        BOOST_CHECK(a.LoadFactor() <= FlatMap::MAX_LOAD_FACTOR);
+
+        std::vector<uint64_t> keys = {7, 100000, 1, 1u << 30};
+        const auto ranges = a.FindMany(keys);
+        const auto values = a.GetMany(keys);
+
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            BOOST_REQUIRE(std::vector<uint32_t>(ranges[i].begin(), ranges[i].end()) == expected[keys[i]]);
+            BOOST_REQUIRE(values[i] == expected[keys[i]]);
+        }
+
+        const HardDriveContainers::MapStats stats = a.Stats(1, 3);
+
+        BOOST_REQUIRE_EQUAL(stats.sampledKeys, keyCount);
+        BOOST_REQUIRE_EQUAL(stats.sampledBuckets, a.BucketCount());
+        BOOST_REQUIRE_EQUAL(std::accumulate(stats.probeLengths.begin(), stats.probeLengths.end(), 0ul), keyCount);
+        BOOST_CHECK(stats.probeLengths[1] > keyCount * 9 / 10);
+
+        a.Compact();
+        BOOST_REQUIRE_EQUAL(a.Size(), valueCount);
+        BOOST_REQUIRE(a.GetAll(7) == expected[7]);
+    }
+
+    const FlatMap b(boost::interprocess::open_read_only, storeFileme);
+
+    for (const auto& [key, values] : expected)
+    {
+        BOOST_REQUIRE(b.GetAll(key) == values);
+    }
+    BOOST_CHECK_THROW(const_cast<FlatMap&>(b).Insert(1, 1), boost::interprocess::interprocess_exception);
+
+    // Another value of a key already in the map takes no slot, so it never rebuilds the
+    // slot array, even right at the load threshold.
+    std::remove(storeFileme);
+    {
+        FlatMap c(storeFileme, 1024ul, 16ul);
+
+        for (uint64_t key = 0; key < 100; ++key)
+        {
+            c.Insert(key, 0u);
+
+            const size_t bucketCount = c.BucketCount();
+            c.Insert(0ul, 1u);
+            BOOST_REQUIRE_EQUAL(c.BucketCount(), bucketCount);
+        }
+        BOOST_REQUIRE_EQUAL(c.Count(0ul), 101ul);
+    }
+
+    std::remove(storeFileme);
+}
+
+BOOST_AUTO_TEST_CASE(name_index_testing, *boost::unit_test::timeout(20))
+{
+    const std::string storeFileme = "store_names.tmp";
+    const std::string postingsFilename = FsDump::NameIndex::PostingsFilenameFor(storeFileme);
+
+    std::remove(storeFileme.c_str());
+    std::remove(postingsFilename.c_str());
+
+    auto sorted = [](std::vector<std::string> names)
+    {
+        std::sort(names.begin(), names.end());
+        return names;
+    };
+
+    auto glob = [&sorted](const FsDump::NameIndex& index, const std::string& pattern)
+    {
+        std::vector<std::string> names;
+        index.Glob(pattern, [&names](const std::string_view name) { names.emplace_back(name); });
+        return sorted(names);
+    };
+
+    auto substring = [&sorted](const FsDump::NameIndex& index, const std::string& text)
+    {
+        std::vector<std::string> names;
+        index.Substring(text, [&names](const std::string_view name) { names.emplace_back(name); });
+        return sorted(names);
+    };
+
+    {
+        FsDump::NameIndex index(storeFileme);
+        const std::vector<std::string> names {"main.h", "util.h", "main.cpp", "readme", "a.hpp", "x", "main.h"};
+
+        index.Add(names);
+        BOOST_REQUIRE_EQUAL(index.NameCount(), 6ul);
+
+        // A trigram, a bigram of an extension, single characters, which match every name.
+        BOOST_REQUIRE(substring(index, "mai") == sorted({"main.cpp", "main.h"}));
+        BOOST_REQUIRE(glob(index, "*.h") == sorted({"main.h", "util.h"}));
+        BOOST_REQUIRE(glob(index, "*.?pp") == sorted({"a.hpp", "main.cpp"}));
+        BOOST_REQUIRE(glob(index, "?") == std::vector<std::string> {"x"});
+        BOOST_REQUIRE(substring(index, "e") == sorted({"readme"}));
+        BOOST_REQUIRE(glob(index, "*.java").empty());
+
+        const size_t postings = index.PostingCount();
+
+        index.Remove(std::string("util.h"));
+        BOOST_REQUIRE(glob(index, "*.h") == std::vector<std::string> {"main.h"});
+        BOOST_REQUIRE(substring(index, "til").empty());
+        BOOST_REQUIRE_EQUAL(index.PostingCount(), postings);
+
+        // Compact drops the postings of the removed name.
+        index.Compact();
+        BOOST_CHECK(index.PostingCount() < postings);
+        BOOST_REQUIRE(glob(index, "*.h") == std::vector<std::string> {"main.h"});
+
+        index.Add(std::vector<std::string> {"util.h"});
+        BOOST_REQUIRE(glob(index, "*.h") == sorted({"main.h", "util.h"}));
+    }
+
+    const FsDump::NameIndex index(boost::interprocess::open_read_only, storeFileme);
+    BOOST_REQUIRE(glob(index, "u*.h") == std::vector<std::string> {"util.h"});
+    BOOST_REQUIRE(substring(index, "ain.") == sorted({"main.cpp", "main.h"}));
+
+    std::remove(storeFileme.c_str());
+    std::remove(postingsFilename.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(incremental_update_testing, *boost::unit_test::timeout(20))
+{
+    namespace fs = boost::filesystem;
+    using Storage = HardDriveContainers::Map<std::string, uint64_t>;
+
+    const std::string storeFileme = "store_update.tmp";
+    const std::string directoryIndexFile = FsDump::DirectoryIndex::FilenameFor(storeFileme);
+    const std::string directoryTableFile = FsDump::DirectoryTable::FilenameFor(storeFileme);
+    const fs::path root = fs::absolute("update_tree.tmp");
+
+    auto removeAll = [&]()
+    {
+        for (const std::string& file : {storeFileme, directoryIndexFile, directoryTableFile})
+        {
+            std::remove(file.c_str());
+        }
+        fs::remove_all(root);
+    };
+
+    auto touch = [](const fs::path& file)
+    {
+        std::ofstream(file.string());
+    };
+
+    removeAll();
+    fs::create_directories(root / "sub" / "deep");
+    touch(root / "a.txt");
+    touch(root / "b.txt");
+    touch(root / "sub" / "c.txt");
+    touch(root / "sub" / "deep" / "d.txt");
+    touch(root / "sub" / "deep" / "a.txt");
+
+    {
+        Storage storage(storeFileme.c_str());
+        FsDump::DirectoryIndex directoryIndex(directoryIndexFile);
+        FsDump::DirectoryTable directoryTable(directoryTableFile);
+        // Flushes added files after every directory.
+        FsDump::IncrementalUpdater<Storage> updater(storage, directoryIndex, directoryTable, 1);
+
+        FsDump::UpdateStatistics statistics = updater.Update(root.string());
+        BOOST_REQUIRE_EQUAL(statistics.readDirectories, 3ul);
+        BOOST_REQUIRE_EQUAL(statistics.addedFiles, 5ul);
+        BOOST_REQUIRE_EQUAL(statistics.removedFiles, 0ul);
+        BOOST_REQUIRE_EQUAL(storage.Size(), 5ul);
+        BOOST_REQUIRE_EQUAL(storage.Count("a.txt"), 2ul);
+
+        uint64_t rootId = 0, subId = 0, deepId = 0;
+        BOOST_REQUIRE(directoryIndex.GetId(root.string(), rootId));
+        BOOST_REQUIRE(directoryIndex.GetId((root / "sub").string(), subId));
+        BOOST_REQUIRE(directoryIndex.GetId((root / "sub" / "deep").string(), deepId));
+        BOOST_REQUIRE_EQUAL(*storage.Get("c.txt"), subId);
+        BOOST_REQUIRE_EQUAL(*storage.Get("d.txt"), deepId);
+
+        FsDump::DirectoryListing listing, summary;
+        BOOST_REQUIRE(directoryIndex.Get((root / "sub").string(), listing));
+        BOOST_REQUIRE(directoryIndex.GetWithoutFiles((root / "sub").string(), summary));
+        BOOST_REQUIRE(listing.files == std::vector<std::string> {"c.txt"});
+        BOOST_REQUIRE(summary.files.empty());
+        BOOST_REQUIRE(summary.directories == listing.directories);
+        BOOST_REQUIRE(summary.stamp == listing.stamp);
+        BOOST_REQUIRE_EQUAL(summary.id, subId);
+        BOOST_REQUIRE(!directoryIndex.GetWithoutFiles((root / "missing").string(), summary));
+
+        // Unchanged stamps: every directory is checked, none is read again.
+        statistics = updater.Update(root.string());
+        BOOST_REQUIRE_EQUAL(statistics.checkedDirectories, 3ul);
+        BOOST_REQUIRE_EQUAL(statistics.readDirectories, 0ul);
+        BOOST_REQUIRE_EQUAL(statistics.addedFiles, 0ul);
+
+        fs::remove(root / "b.txt");
+        touch(root / "e.txt");
+        fs::remove_all(root / "sub" / "deep");
+        fs::create_directory(root / "sub" / "new");
+        touch(root / "sub" / "new" / "f.txt");
+
+        statistics = updater.Update(root.string());
+        BOOST_REQUIRE_EQUAL(statistics.readDirectories, 3ul);
+        BOOST_REQUIRE_EQUAL(statistics.removedDirectories, 1ul);
+        BOOST_REQUIRE_EQUAL(statistics.addedFiles, 2ul);
+        BOOST_REQUIRE_EQUAL(statistics.removedFiles, 3ul);
+
+        uint64_t newId = 0;
+        BOOST_REQUIRE(!directoryIndex.GetId((root / "sub" / "deep").string(), deepId));
+        BOOST_REQUIRE(directoryIndex.GetId((root / "sub" / "new").string(), newId));
+        BOOST_REQUIRE(!directoryTable.Directories().Get(deepId));
+        BOOST_REQUIRE(storage.FindAll("b.txt").empty());
+        BOOST_REQUIRE(storage.FindAll("d.txt").empty());
+        BOOST_REQUIRE(storage.GetAll("a.txt") == std::vector<uint64_t> {rootId});
+        BOOST_REQUIRE_EQUAL(*storage.Get("e.txt"), rootId);
+        BOOST_REQUIRE_EQUAL(*storage.Get("f.txt"), newId);
+        BOOST_REQUIRE_EQUAL(storage.Size(), 4ul);
+    }
+
+    removeAll();
+}
+
+BOOST_AUTO_TEST_CASE(directory_table_testing, *boost::unit_test::timeout(10))
+{
+    using Files = HardDriveContainers::Map<std::string, uint64_t>;
+
+    const std::string storeFileme = "store_table.tmp";
+    const std::string filesFilename = "store_table_files.tmp";
+
+    std::remove(storeFileme.c_str());
+    std::remove(filesFilename.c_str());
+
+    uint64_t rootId, aId, bId, cId;
+
+    {
+        FsDump::DirectoryTable table(storeFileme);
+
+        rootId = table.AllocateId();
+        aId = table.AllocateId();
+        bId = table.AllocateId();
+        BOOST_REQUIRE_EQUAL(rootId, 1ul);
+        BOOST_REQUIRE_EQUAL(bId, 3ul);
+
+        table.Add(rootId, FsDump::DirectoryTable::NO_PARENT, "/root");
+        table.Add(aId, rootId, "/root/a");
+        table.Add(bId, aId, "/root/a/b");
+
+        // Ids handed out by a scanner are never given again.
+        table.ReserveIds(10);
+        cId = table.AllocateId();
+        BOOST_REQUIRE_EQUAL(cId, 10ul);
+        table.Add(cId, rootId, "/root/c");
+    }
+
+    {
+        // The rest of the reserved block is skipped after reopening.
+        FsDump::DirectoryTable table(storeFileme);
+        BOOST_CHECK(table.NextId() > cId);
+
+        const uint64_t id = table.AllocateId();
+        BOOST_CHECK(id > cId);
+
+        Files files(filesFilename.c_str());
+        files.Insert("x", aId);
+        files.Insert("x", bId);
+        files.Insert("y", cId);
+
+        const std::vector<std::string> names {"x", "missing", "y"};
+        std::vector<std::vector<std::string>> paths = FsDump::FileLookup<Files, FsDump::DirectoryTable::Storage>(files, table.Directories()).GetMany(names);
+
+        BOOST_REQUIRE_EQUAL(paths.size(), 3ul);
+        BOOST_REQUIRE(paths[0] == (std::vector<std::string> {"/root/a/b/x", "/root/a/x"}));
+        BOOST_REQUIRE(paths[1].empty());
+        BOOST_REQUIRE(paths[2] == std::vector<std::string> {"/root/c/y"});
+
+        // Without a parent the path can't be rebuilt, the siblings of the parent still can.
+        table.Remove(aId);
+        paths = FsDump::FileLookup<Files, FsDump::DirectoryTable::Storage>(files, table.Directories()).GetMany(names);
+
+        BOOST_REQUIRE(paths[0].empty());
+        BOOST_REQUIRE(paths[2] == std::vector<std::string> {"/root/c/y"});
+    }
+
+    std::remove(storeFileme.c_str());
+    std::remove(filesFilename.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(directory_scanner_testing, *boost::unit_test::timeout(20))
+{
+    namespace fs = boost::filesystem;
+
+    const fs::path root = fs::absolute("scan_tree.tmp");
+    fs::remove_all(root);
+
+    // Five directories with three files each on every one of three levels.
+    std::function<void(const fs::path&, size_t)> generate = [&](const fs::path& directory, const size_t depth)
+    {
+        fs::create_directories(directory);
+        for (size_t file = 0; file < 3; ++file)
+        {
+            std::ofstream((directory / ("file" + std::to_string(file))).string());
+        }
+        for (size_t child = 0; depth < 3 && child < 5; ++child)
+        {
+            generate(directory / ("dir" + std::to_string(child)), depth + 1);
+        }
+    };
+    generate(root, 0);
+
+    // Listings by path with sorted names, every parent id checked against the parent's listing.
+    auto scan = [&](const size_t threadCount)
+    {
+        FsDump::DirectoryScanner scanner(threadCount, 7);
+        std::map<std::string, FsDump::DirectoryListing> listings;
+        const size_t fileCount = scanner.Scan(root, [&](FsDump::ScanBatch& batch)
+        {
+            for (FsDump::DirectoryListing& listing : batch.directories)
+            {
+                std::sort(listing.files.begin(), listing.files.end());
+                std::sort(listing.directories.begin(), listing.directories.end());
+                BOOST_REQUIRE(listings.emplace(listing.path, listing).second);
+            }
+        }, 10);
+
+        BOOST_REQUIRE_EQUAL(fileCount, 156 * 3ul);
+        BOOST_REQUIRE_EQUAL(listings.size(), 156ul);
+        BOOST_REQUIRE_EQUAL(scanner.NextDirectoryId(), 10 + 156ul);
+        BOOST_REQUIRE_EQUAL(listings.at(root.string()).id, 10ul);
+
+        std::set<uint64_t> ids;
+        for (const auto& entry : listings)
+        {
+            const FsDump::DirectoryListing& listing = entry.second;
+            BOOST_REQUIRE(ids.insert(listing.id).second);
+            if (listing.path != root.string())
+            {
+                BOOST_REQUIRE_EQUAL(listing.parentId, listings.at(fs::path(listing.path).parent_path().string()).id);
+            }
+        }
+        return listings;
+    };
+
+    const auto walked = scan(1);
+    const auto scanned = scan(4);
+
+    BOOST_REQUIRE_EQUAL(walked.size(), scanned.size());
+    for (const auto& entry : walked)
+    {
+        const FsDump::DirectoryListing& listing = scanned.at(entry.first);
+        BOOST_REQUIRE(listing.files == entry.second.files);
+        BOOST_REQUIRE(listing.directories == entry.second.directories);
+    }
+
+    fs::remove_all(root);
+}
+
+#ifdef __linux__
+BOOST_AUTO_TEST_CASE(list_directory_testing, *boost::unit_test::timeout(20))
+{
+    namespace fs = boost::filesystem;
+    using Listing = std::map<std::string, FsDump::EntryType>;
+
+    const fs::path root = fs::absolute("list_tree.tmp");
+    fs::remove_all(root);
+    fs::create_directories(root / "sub");
+
+    for (size_t file = 0; file < 100; ++file)
+    {
+        std::ofstream((root / ("file" + std::to_string(file))).string());
+    }
+    fs::create_symlink(root / "file0", root / "file_link");
+    fs::create_symlink(root / "sub", root / "directory_link");
+    fs::create_symlink(root / "missing", root / "dangling_link");
+    BOOST_REQUIRE_EQUAL(::mkfifo((root / "fifo").c_str(), 0600), 0);
+
+    // The same rules over boost::filesystem: directories themselves, files through links.
+    Listing expected;
+    for (fs::directory_iterator entry(root), end; entry != end; ++entry)
+    {
+        boost::system::error_code error;
+        const std::string name = entry->path().filename().string();
+
+        if (fs::is_directory(entry->symlink_status()))
+        {
+            expected[name] = FsDump::EntryType::Directory;
+        }
+        else
+        {
+            expected[name] = fs::is_regular_file(entry->status(error)) ? FsDump::EntryType::RegularFile : FsDump::EntryType::Other;
+        }
+    }
+    BOOST_REQUIRE_EQUAL(expected.size(), 105ul);
+    BOOST_REQUIRE(expected["file_link"] == FsDump::EntryType::RegularFile);
+    BOOST_REQUIRE(expected["directory_link"] == FsDump::EntryType::Other);
+
+    Listing listed;
+    std::vector<char> buffer;
+    FsDump::DirectoryStamp stamp;
+    BOOST_REQUIRE(FsDump::ListDirectory(root.string(), buffer, stamp, [&](const FsDump::EntryType type, const char* name)
+    {
+        BOOST_REQUIRE(listed.emplace(name, type).second);
+    }));
+    BOOST_REQUIRE(listed == expected);
+
+    struct stat status;
+    BOOST_REQUIRE_EQUAL(::stat(root.c_str(), &status), 0);
+    BOOST_REQUIRE_EQUAL(stamp.inode, uint64_t(status.st_ino));
+
+    // Filesystems that don't fill d_type get the same answers from fstatat.
+    const int directoryFd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY);
+    BOOST_REQUIRE(directoryFd >= 0);
+    for (const auto& entry : expected)
+    {
+        BOOST_REQUIRE(FsDump::GetEntryType(directoryFd, entry.first.c_str(), DT_UNKNOWN) == entry.second);
+    }
+    ::close(directoryFd);
+
+    BOOST_REQUIRE(!FsDump::ListDirectory((root / "missing").string(), buffer, stamp, [](FsDump::EntryType, const char*) {}));
+
+    fs::remove_all(root);
+}
+#endif
+
+#ifdef __linux__
+BOOST_AUTO_TEST_CASE(directory_watcher_testing, *boost::unit_test::timeout(30))
+{
+    namespace fs = boost::filesystem;
+    using Storage = HardDriveContainers::Map<std::string, uint64_t>;
+
+    const std::string storeFileme = "store_watch.tmp";
+    const std::string directoryIndexFile = FsDump::DirectoryIndex::FilenameFor(storeFileme);
+    const std::string directoryTableFile = FsDump::DirectoryTable::FilenameFor(storeFileme);
+    const fs::path root = fs::absolute("watch_tree.tmp");
+
+    auto removeAll = [&]()
+    {
+        for (const std::string& file : {storeFileme, directoryIndexFile, directoryTableFile})
+        {
+            std::remove(file.c_str());
+        }
+        fs::remove_all(root);
+    };
+
+    auto touch = [](const fs::path& file)
+    {
+        std::ofstream(file.string());
+    };
+
+    removeAll();
+    fs::create_directories(root / "sub");
+    touch(root / "a.txt");
+    touch(root / "sub" / "b.txt");
+
+    {
+        Storage storage(storeFileme.c_str());
+        FsDump::DirectoryIndex directoryIndex(directoryIndexFile);
+        FsDump::DirectoryTable directoryTable(directoryTableFile);
+        FsDump::DirectoryWatcher<Storage> watcher(storage, directoryIndex, directoryTable, std::chrono::milliseconds(20));
+
+        // The writer is the watcher's thread, so the changes are looked at as another process would.
+        const Storage reader(boost::interprocess::open_read_only, storeFileme.c_str());
+        auto eventually = [&](const std::function<bool()>& condition)
+        {
+            for (size_t attempt = 0; attempt < 500 && !condition(); ++attempt)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            return condition();
+        };
+
+        std::atomic<bool> stop {false};
+        std::thread watching([&]() { watcher.Run(root.string(), stop); });
+
+        // Checks don't abort while the watcher runs, it has to be joined. The first full
+        // update scans the tree and watches every directory.
+        BOOST_CHECK(eventually([&]() { return reader.Count("a.txt") == 1 && reader.Count("b.txt") == 1; }));
+
+        touch(root / "created.txt");
+        BOOST_CHECK(eventually([&]() { return reader.Count("created.txt") == 1; }));
+
+        fs::remove(root / "a.txt");
+        BOOST_CHECK(eventually([&]() { return reader.Count("a.txt") == 0; }));
+
+        // A rename is the old name removed and the new one added.
+        fs::rename(root / "sub" / "b.txt", root / "sub" / "renamed.txt");
+        BOOST_CHECK(eventually([&]() { return reader.Count("b.txt") == 0 && reader.Count("renamed.txt") == 1; }));
+
+        // New directories are read and watched as they appear.
+        fs::create_directories(root / "new" / "deep");
+        touch(root / "new" / "deep" / "c.txt");
+        BOOST_CHECK(eventually([&]() { return reader.Count("c.txt") == 1; }));
+        touch(root / "new" / "deep" / "d.txt");
+        BOOST_CHECK(eventually([&]() { return reader.Count("d.txt") == 1; }));
+
+        // A burst of creates is coalesced into a few passes over the directory.
+        for (size_t file = 0; file < 100; ++file)
+        {
+            touch(root / "new" / ("burst" + std::to_string(file)));
+        }
+        BOOST_CHECK(eventually([&]() { return reader.Size() == 104; }));
+
+        fs::rename(root / "sub", root / "moved");
+        fs::remove_all(root / "new");
+        BOOST_CHECK(eventually([&]() { return reader.Size() == 2 && reader.Count("c.txt") == 0; }));
+
+        stop = true;
+        watching.join();
+
+        uint64_t movedId = 0, removedId = 0;
+        BOOST_REQUIRE(directoryIndex.GetId((root / "moved").string(), movedId));
+        BOOST_REQUIRE(!directoryIndex.GetId((root / "sub").string(), removedId));
+        BOOST_REQUIRE(!directoryIndex.GetId((root / "new" / "deep").string(), removedId));
+        BOOST_REQUIRE_EQUAL(*storage.Get("renamed.txt"), movedId);
+        BOOST_REQUIRE_EQUAL(storage.Count("created.txt"), 1ul);
+    }
+
+    removeAll();
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(query_server_testing, *boost::unit_test::timeout(20))
+{
+    struct Lookup
+    {
+        std::vector<std::vector<std::string>> GetMany(const std::vector<std::string_view>& names) const
+        {
+            std::vector<std::vector<std::string>> paths;
+            for (const std::string_view name : names)
+            {
+                const auto found = files.find(std::string(name));
+                paths.push_back(found == files.end() ? std::vector<std::string>() : found->second);
+            }
+            return paths;
+        }
+
+        std::map<std::string, std::vector<std::string>> files;
+    };
+
+    Lookup lookup;
+    lookup.files["a.txt"] = {"/x/a.txt", "/y/a.txt"};
+    lookup.files["b.txt"] = {"/x/b.txt"};
+    FsDump::QueryServer<Lookup> server(lookup);
+
+    // Runs the whole input through ServeStream at once, as a client pipelining its requests.
+    auto serve = [&](const std::string& input)
+    {
+        int inputFds[2], outputFds[2];
+        BOOST_REQUIRE_EQUAL(::pipe(inputFds), 0);
+        BOOST_REQUIRE_EQUAL(::pipe(outputFds), 0);
+        BOOST_REQUIRE_EQUAL(::write(inputFds[1], input.data(), input.size()), ssize_t(input.size()));
+        ::close(inputFds[1]);
+
+        const std::atomic<bool> stop {false};
+        server.ServeStream(inputFds[0], outputFds[1], stop);
+        ::close(inputFds[0]);
+        ::close(outputFds[1]);
+
+        std::string output;
+        char buffer[4096];
+        for (ssize_t bytes; (bytes = ::read(outputFds[0], buffer, sizeof(buffer))) > 0;)
+        {
+            output.append(buffer, bytes);
+        }
+        ::close(outputFds[0]);
+        return output;
+    };
+
+    std::stringstream requests;
+    requests << "a.txt\n" << "missing\n" << "b.txt\r\n" << "\n" << "a.txt";
+    BOOST_REQUIRE_EQUAL(serve(requests.str()), "/x/a.txt\n/y/a.txt\n\n" "\n" "/x/b.txt\n\n" "\n" "/x/a.txt\n/y/a.txt\n\n");
+
+    // An overlong request ends the stream, after the answers to the requests before it.
+    const std::string overlong(FsDump::QueryServer<Lookup>::MAX_REQUEST_SIZE + 1, 'x');
+    BOOST_REQUIRE_EQUAL(serve("b.txt\n" + overlong + "\na.txt\n"), "/x/b.txt\n\n");
+    BOOST_REQUIRE_EQUAL(serve("b.txt\n" + overlong), "/x/b.txt\n\n");
+    BOOST_REQUIRE_EQUAL(serve(overlong.substr(1) + "\n"), "\n");
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_create_testing, *boost::unit_test::timeout(30))
+{
+    using HardDriveContainers::GrowableMappedFile;
+    const char* storeFileme = "store_create.tmp";
+    constexpr size_t openerCount = 8;
+
+    std::remove(storeFileme);
+
+    // A second writer is refused while the first one has the file open; readers are not.
+    {
+        GrowableMappedFile writer(boost::interprocess::open_or_create, storeFileme, 0);
+
+        BOOST_REQUIRE_THROW(GrowableMappedFile(boost::interprocess::open_or_create, storeFileme, 0), boost::interprocess::interprocess_exception);
+        BOOST_REQUIRE_NO_THROW(GrowableMappedFile(boost::interprocess::open_read_only, storeFileme));
+    }
+    BOOST_REQUIRE_NO_THROW(GrowableMappedFile(boost::interprocess::open_or_create, storeFileme, 0));
+
+    // Writers racing to create the same file all end up in one segment: none of them lays
+    // it out again over an object another one already put there, and those refused while
+    // another one has it open leave it alone.
+    for (size_t round = 0; round < 20; ++round)
+    {
+        std::remove(storeFileme);
+        std::vector<std::thread> openers;
+        std::atomic<size_t> refused {0};
+
+        for (size_t opener = 0; opener < openerCount; ++opener)
+        {
+            openers.emplace_back([storeFileme, &refused]()
+            {
+                try
+                {
+                    GrowableMappedFile file(boost::interprocess::open_or_create, storeFileme, 0);
+                    file.get_segment_manager()->find_or_construct<std::atomic<uint64_t>>("Openers")(0)->fetch_add(1);
+                }
+                catch (const boost::interprocess::interprocess_exception&)
+                {
+                    ++refused;
+                }
+            });
+        }
+
+        for (std::thread& opener : openers)
+        {
+            opener.join();
+        }
+
+        const GrowableMappedFile file(boost::interprocess::open_read_only, storeFileme);
+        const auto opened = file.get_segment_manager()->find_no_lock<std::atomic<uint64_t>>("Openers").first;
+        BOOST_REQUIRE(opened != nullptr);
+        BOOST_REQUIRE(refused < openerCount);
+        BOOST_REQUIRE_EQUAL(opened->load() + refused, openerCount);
+    }
+
+    std::remove(storeFileme);
+}
+
+BOOST_AUTO_TEST_CASE(stats_testing, *boost::unit_test::timeout(20))
+{
+    const char* storeFileme = "store.tmp";
+
+    std::remove(storeFileme);
+
+    HardDriveContainers::Map<std::string, std::string> a(storeFileme, 1024ul, 1000ul);
+
+    constexpr size_t elementCount = (size_t)1e4;
+
+    for (size_t i = 0; i < elementCount; ++i)
+    {
+        a.Insert(std::to_string(i), std::to_string(i));
+    }
+
+    for (size_t i = 0; i < 100; ++i)
+    {
+        a.Insert("0", std::to_string(i));
+    }
+
+    const HardDriveContainers::MapStats stats = a.Stats();
+
+    BOOST_REQUIRE_EQUAL(stats.keyCount, elementCount);
+    BOOST_REQUIRE_EQUAL(stats.valueCount, elementCount + 100);
+    BOOST_REQUIRE_EQUAL(stats.bucketCount, a.BucketCount());
+    BOOST_REQUIRE_EQUAL(stats.sampledBuckets, a.BucketCount());
+    BOOST_REQUIRE_EQUAL(stats.sampledKeys, elementCount);
+    BOOST_REQUIRE_EQUAL(stats.maxValuesPerKey, 101ul);
+    BOOST_REQUIRE_EQUAL(stats.valuesPerKey.size(), 7ul);
+    BOOST_REQUIRE_EQUAL(stats.valuesPerKey[0], elementCount - 1);
+    BOOST_REQUIRE_EQUAL(stats.valuesPerKey[6], 1ul);
+    BOOST_REQUIRE_EQUAL(stats.chainLengths.size(), stats.maxChainLength + 1);
+    BOOST_REQUIRE_EQUAL(stats.chainLengths[0], stats.emptyBuckets);
+
+    size_t buckets = 0, keys = 0;
+
+    for (size_t length = 0; length < stats.chainLengths.size(); ++length)
+    {
+        buckets += stats.chainLengths[length];
+        keys += stats.chainLengths[length] * length;
+    }
+
+    BOOST_REQUIRE_EQUAL(buckets, stats.bucketCount);
+    BOOST_REQUIRE_EQUAL(keys, elementCount);
+
+    const HardDriveContainers::MapStats parallel = a.Stats(1, 4);
+
+    BOOST_REQUIRE(parallel.chainLengths == stats.chainLengths);
+    BOOST_REQUIRE(parallel.valuesPerKey == stats.valuesPerKey);
+    BOOST_REQUIRE_EQUAL(a.Stats(4).sampledBuckets, (stats.bucketCount + 3) / 4);
+
+    BOOST_REQUIRE_EQUAL(stats.counters.inserts, elementCount + 100);
+    BOOST_REQUIRE_EQUAL(stats.counters.erases, 0ul);
+    BOOST_CHECK(stats.counters.lookups >= elementCount + 100);
+
+    for (size_t i = 1; i < elementCount; i += 2)
+    {
+        a.Erase(std::to_string(i));
+    }
+
+    const HardDriveContainers::MapCounters counters = a.Counters();
+    const size_t chainStepsBefore = counters.chainSteps;
+
+    BOOST_REQUIRE_EQUAL(counters.erases, elementCount / 2);
+    BOOST_CHECK(a.Find("0"));
+    BOOST_REQUIRE_EQUAL(a.Counters().lookups, counters.lookups + 1);
+    BOOST_CHECK(a.Counters().chainSteps > chainStepsBefore);
+    BOOST_CHECK(a.Stats().recordFreeBytes > stats.recordFreeBytes);
+
+    // Lookups from threads sharing the Map are all counted.
+    const uint64_t lookupsBefore = a.Counters().lookups;
+    std::vector<std::thread> readers;
+
+    for (size_t t = 0; t < 4; ++t)
+    {
+        readers.emplace_back([&a]()
+        {
+            for (size_t i = 0; i < 10000; ++i)
+            {
+                a.Find("0");
+            }
+        });
+    }
+
+    for (std::thread& reader : readers)
+    {
+        reader.join();
+    }
+    BOOST_REQUIRE_EQUAL(a.Counters().lookups, lookupsBefore + 4 * 10000);
+
+    std::remove(storeFileme);
+}
+
+BOOST_AUTO_TEST_CASE(reserve_testing, *boost::unit_test::timeout(20))
+{
+    const char* storeFileme = "store.tmp";
+
+    std::remove(storeFileme);
+
+    HardDriveContainers::Map<std::string, std::string> a(storeFileme, 1024ul, 16ul);
+
+    a.Insert("first", "value");
+    const std::string_view first = *a.Find("first");
+    const void* header = a.GetSegmentManager();
+
+    // Views taken before the file grows stay valid: the mapping never moves.
+    for (size_t i = 0; i < (size_t)1e5; ++i)
+    {
+        a.Insert(std::to_string(i), std::string(64, 'v'));
+    }
+
+    BOOST_CHECK(a.GetSegmentManager() == header);
+    BOOST_REQUIRE_EQUAL(first, "value");
+    BOOST_CHECK(a.Find("first")->data() == first.data());
+
+    const size_t reserved = 256 * 1024 * 1024ul;
+    a.Reserve(reserved);
+    BOOST_CHECK(a.GetSegmentManager()->get_free_memory() >= reserved);
+
+    const size_t size = a.GetSegmentManager()->get_size();
+    a.Reserve(reserved / 2);
+    BOOST_REQUIRE_EQUAL(a.GetSegmentManager()->get_size(), size);
+
+    HardDriveContainers::Map<std::string, std::string> b(boost::interprocess::open_read_only, storeFileme);
+    BOOST_REQUIRE_EQUAL(*b.Find("first"), "value");
+    BOOST_REQUIRE_EQUAL(b.Size(), (size_t)1e5 + 1);
+    BOOST_CHECK_THROW(b.Reserve(1), boost::interprocess::interprocess_exception);
+
+    std::remove(storeFileme);
+}
+
+// The i-th key of the concurrent read test, and its value, or its second value if second.
+template <class T>
+T ConcurrentTestItem(const size_t i, const bool second = false)
+{
+    if constexpr (std::is_same<T, std::string>::value)
+    {
+        return std::to_string(i) + (second ? "b" : "");
+    }
+    else
+    {
+        return second ? i + (size_t)1e6 : i;
+    }
+}
+
+using ConcurrentTestMaps = boost::mpl::list<HardDriveContainers::Map<std::string, std::string>, HardDriveContainers::Map<uint64_t, uint64_t>>;
+
+BOOST_TEST_DECORATOR(*boost::unit_test::timeout(60))
+BOOST_AUTO_TEST_CASE_TEMPLATE(concurrent_read_testing, MapT, ConcurrentTestMaps)
+{
+    using Key = typename MapT::key_type;
+    using Value = typename MapT::value_type;
+    const char* storeFileme = "store.tmp";
+
+    std::remove(storeFileme);
+
+    MapT writer(storeFileme, 1024ul, 16ul);
+    writer.Insert(ConcurrentTestItem<Key>(0), ConcurrentTestItem<Value>(0));
+
+    constexpr size_t elementCount = (size_t)1e5;
+    std::atomic<size_t> written {1};
+    std::atomic<size_t> inconsistentReads {0};
+    std::atomic<size_t> foundKeys {0};
+
+    // Another mapping of the same file, as a reader process would have, started before
+    // the file grows: the buckets split, or the slot array is rebuilt, many times while
+    // the reader looks keys up.
+    std::thread reader([&]()
+    {
+        const MapT map(boost::interprocess::open_read_only, storeFileme);
+
+        for (size_t i = 0; written < elementCount; i = (i + 7919) % elementCount)
+        {
+            const Key key = ConcurrentTestItem<Key>(i);
+            const size_t writtenBefore = written;
+            const std::optional<Value> value = map.Get(key);
+
+            if (i < writtenBefore && i % 5 != 4 && !value)
+            {
+                ++inconsistentReads;
+            }
+
+            if (value)
+            {
+                inconsistentReads += (*value != ConcurrentTestItem<Value>(i) && *value != ConcurrentTestItem<Value>(i, true));
+                ++foundKeys;
+            }
+
+            for (const Value& stored : map.GetAll(key))
+            {
+                inconsistentReads += (stored != ConcurrentTestItem<Value>(i) && stored != ConcurrentTestItem<Value>(i, true));
+            }
+
+            if (i % 64 == 0)
+            {
+                std::vector<Key> keys;
+
+                for (size_t next = i; next < i + 16; ++next)
+                {
+                    keys.push_back(ConcurrentTestItem<Key>(next));
+                }
+
+                const std::vector<std::vector<Value>> batch = map.GetMany(keys);
+
+                for (size_t index = 0; index < batch.size(); ++index)
+                {
+                    for (const Value& stored : batch[index])
+                    {
+                        inconsistentReads += (stored != ConcurrentTestItem<Value>(i + index) && stored != ConcurrentTestItem<Value>(i + index, true));
+                    }
+                }
+            }
+        }
+    });
+
+    for (size_t i = 1; i < elementCount; ++i)
+    {
+        writer.Insert(ConcurrentTestItem<Key>(i), ConcurrentTestItem<Value>(i));
+
+        if (i % 3 == 0)
+        {
+            writer.Insert(ConcurrentTestItem<Key>(i), ConcurrentTestItem<Value>(i, true));
+        }
+
+        if (i % 5 == 4)
+        {
+            writer.Erase(ConcurrentTestItem<Key>(i));
+        }
+        written = i + 1;
+    }
+
+    reader.join();
+
+    BOOST_REQUIRE_EQUAL(inconsistentReads, 0ul);
+    BOOST_CHECK(foundKeys > 0);
+
+    const MapT reopened(boost::interprocess::open_read_only, storeFileme);
+    BOOST_REQUIRE(*reopened.Get(ConcurrentTestItem<Key>(3)) == ConcurrentTestItem<Value>(3, true));
+    BOOST_REQUIRE_EQUAL(reopened.GetAll(ConcurrentTestItem<Key>(3)).size(), 2ul);
+    BOOST_CHECK(!reopened.Get(ConcurrentTestItem<Key>(4)));
+    BOOST_CHECK(reopened.GetAll(ConcurrentTestItem<Key>(4)).empty());
+
+    std::remove(storeFileme);
+}
+
+BOOST_AUTO_TEST_CASE(sharded_map_testing, *boost::unit_test::timeout(30))
+{
+    using ShardedMap = HardDriveContainers::ShardedMap<std::string, uint64_t>;
+
+    const char* storeFileme = "store_sharded.tmp";
+    const size_t threadCount = 4;
+    const size_t elementCount = 20000;
+
+    ShardedMap::Remove(storeFileme);
+
+    {
+        ShardedMap map(storeFileme, 4, 16 * 1024 * 1024ul, 4096);
+        std::vector<std::thread> threads;
+
+        BOOST_REQUIRE_EQUAL(map.ShardCount(), 4ul);
+
+        // Every thread inserts every key once, so each key ends up with threadCount values.
+        for (size_t thread = 0; thread < threadCount; ++thread)
+        {
+            threads.emplace_back([&map, thread]()
+            {
+                std::vector<std::pair<std::string, uint64_t>> batch;
+
+                for (size_t i = 0; i < elementCount; ++i)
+                {
+                    batch.emplace_back(std::to_string(i), i * threadCount + thread);
+
+                    if (batch.size() == 1000)
+                    {
+                        map.InsertBatch(batch);
+                        batch.clear();
+                    }
+                }
+                map.InsertBatch(batch);
+            });
+        }
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        BOOST_REQUIRE_EQUAL(map.Size(), elementCount * threadCount);
+
+        for (size_t i = 0; i < elementCount; i += 97)
+        {
+            std::vector<uint64_t> values = map.GetAll(std::to_string(i));
+            std::sort(values.begin(), values.end());
+
+            BOOST_REQUIRE_EQUAL(values.size(), threadCount);
+            BOOST_REQUIRE_EQUAL(values.front(), i * threadCount);
+            BOOST_REQUIRE_EQUAL(values.back(), i * threadCount + threadCount - 1);
+        }
+
+        map.Insert("extra", 1);
+        BOOST_REQUIRE_EQUAL(map.Erase("extra"), 1ul);
+        BOOST_REQUIRE_EQUAL(map.Erase("7", 7 * threadCount), 1ul);
+        BOOST_REQUIRE_EQUAL(map.Count("7"), threadCount - 1);
+
+        size_t shardKeys = 0;
+
+        for (size_t index = 0; index < map.ShardCount(); ++index)
+        {
+            shardKeys += map.GetShard(index).Size();
+            BOOST_CHECK(map.GetShard(index).Size() > 0);
+        }
+        BOOST_REQUIRE_EQUAL(shardKeys, map.Size());
+        BOOST_REQUIRE_EQUAL(map.Counters().inserts, elementCount * threadCount + 1);
+    }
+
+    {
+        // Reopening keeps the shards there are, whatever count is asked for.
+        ShardedMap reopened(storeFileme, 2);
+        BOOST_REQUIRE_EQUAL(reopened.ShardCount(), 4ul);
+        reopened.Compact();
+    }
+
+    {
+        const ShardedMap map(boost::interprocess::open_read_only, storeFileme);
+        const std::vector<std::string> keys {"12", "missing", "7", "12"};
+        const std::vector<std::vector<uint64_t>> results = map.GetMany(keys);
+
+        BOOST_REQUIRE_EQUAL(results.size(), keys.size());
+        BOOST_REQUIRE_EQUAL(results[0].size(), threadCount);
+        BOOST_REQUIRE(results[1].empty());
+        BOOST_REQUIRE_EQUAL(results[2].size(), threadCount - 1);
+        BOOST_REQUIRE(results[3] == results[0]);
+
+        // Bucket ranges split anywhere, across shards too, cover every key once.
+        const size_t bucketCount = map.BucketCount();
+        size_t values = 0;
+
+        for (size_t range = 0; range < 7; ++range)
+        {
+            map.ForEachInRange(bucketCount * range / 7, bucketCount * (range + 1) / 7, [&values](const std::string_view, const auto& ids)
+            {
+                values += ids.size();
+            });
+        }
+        BOOST_REQUIRE_EQUAL(values, elementCount * threadCount - 1);
+    }
+
+    // Without a middle shard the map must not open with fewer, and Remove still clears
+    // every shard the manifest records.
+    std::remove(ShardedMap::FilenameFor(storeFileme, 2).c_str());
+    BOOST_CHECK_THROW(ShardedMap(boost::interprocess::open_read_only, storeFileme), boost::interprocess::interprocess_exception);
+    BOOST_CHECK_THROW(ShardedMap(storeFileme, 4), boost::interprocess::interprocess_exception);
+
+    ShardedMap::Remove(storeFileme);
+    BOOST_CHECK(!ShardedMap::Exists(storeFileme));
+    BOOST_CHECK(!std::ifstream(ShardedMap::FilenameFor(storeFileme, 3)).is_open());
+    BOOST_CHECK_THROW(ShardedMap(boost::interprocess::open_read_only, storeFileme), boost::interprocess::interprocess_exception);
+
+    {
+        // A new map starts over the shard files a previous one left without a manifest.
+        std::ofstream(ShardedMap::FilenameFor(storeFileme, 0)) << "stale";
+        ShardedMap map(storeFileme, 2);
+        BOOST_REQUIRE(map.Empty());
+    }
+
+    ShardedMap::Remove(storeFileme);
+}
 BOOST_AUTO_TEST_SUITE_END()
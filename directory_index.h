@@ -0,0 +1,457 @@
+#pragma once
+
+#include "container.h"
+#include "directory_scanner.h"
+#include "directory_table.h"
+#include "name_index.h"
+#include <boost/log/trivial.hpp>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace FsDump
+{
+
+// Listings of all directories of the last scan, kept in a Map next to the file index:
+// every directory path maps to its id in the DirectoryTable, one stamp value and one value
+// per regular file and subdirectory, each tagged with its kind.
+class DirectoryIndex
+{
+public:
+    using Storage = HardDriveContainers::Map<std::string, std::string>;
+
+    explicit DirectoryIndex(const std::string& filename)
+        : m_Listings(filename.c_str(), DEFAULT_FILE_SIZE, DEFAULT_BUCKET_COUNT)
+    {}
+
+    static std::string FilenameFor(const std::string& storageFile)
+    {
+        return storageFile + ".dirs";
+    }
+
+    bool Get(const std::string& directory, DirectoryListing& listing) const
+    {
+        auto values = m_Listings.FindAll(directory);
+
+        if (values.empty())
+        {
+            return false;
+        }
+
+        listing = DirectoryListing();
+        listing.path = directory;
+
+        for (const std::string_view value : values)
+        {
+            const std::string_view name = value.substr(1);
+
+            switch (value[0])
+            {
+            case ID_TAG:
+                std::memcpy(&listing.id, name.data(), std::min(name.size(), sizeof(listing.id)));
+                break;
+            case STAMP_TAG:
+                std::memcpy(&listing.stamp, name.data(), std::min(name.size(), sizeof(DirectoryStamp)));
+                break;
+            case FILE_TAG:
+                listing.files.emplace_back(name);
+                break;
+            case DIRECTORY_TAG:
+                listing.directories.emplace_back(name);
+                break;
+            }
+        }
+        return true;
+    }
+
+    // Like Get, but leaves listing.files empty and reads no file entry: Put stores them
+    // before the stamp, the subdirectories and the id, which come first newest first.
+    // Listings stored with the stamp first are still read whole, the files skipped.
+    bool GetWithoutFiles(const std::string& directory, DirectoryListing& listing) const
+    {
+        listing = DirectoryListing();
+        listing.path = directory;
+
+        bool found = false;
+
+        for (const std::string_view value : m_Listings.FindAll(directory))
+        {
+            const std::string_view name = value.substr(1);
+            found = true;
+
+            if (value[0] == ID_TAG)
+            {
+                std::memcpy(&listing.id, name.data(), std::min(name.size(), sizeof(listing.id)));
+            }
+            else if (value[0] == DIRECTORY_TAG)
+            {
+                listing.directories.emplace_back(name);
+            }
+            else if (value[0] == STAMP_TAG)
+            {
+                std::memcpy(&listing.stamp, name.data(), std::min(name.size(), sizeof(DirectoryStamp)));
+                break;
+            }
+        }
+        return found;
+    }
+
+    // The id alone, without copying the listing out: it is the newest value of a directory.
+    bool GetId(const std::string& directory, uint64_t& id) const
+    {
+        for (const std::string_view value : m_Listings.FindAll(directory))
+        {
+            if (value[0] == ID_TAG)
+            {
+                std::memcpy(&id, value.data() + 1, std::min(value.size() - 1, sizeof(id)));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Replaces the stored listings of the given directories.
+    void Put(const std::vector<DirectoryListing>& listings)
+    {
+        std::vector<std::pair<std::string, std::string>> values;
+
+        for (const DirectoryListing& listing : listings)
+        {
+            m_Listings.Erase(listing.path);
+
+            for (const std::string& file : listing.files)
+            {
+                values.emplace_back(listing.path, FILE_TAG + file);
+            }
+
+            values.emplace_back(listing.path, STAMP_TAG + std::string(reinterpret_cast<const char*>(&listing.stamp), sizeof(DirectoryStamp)));
+
+            for (const std::string& directory : listing.directories)
+            {
+                values.emplace_back(listing.path, DIRECTORY_TAG + directory);
+            }
+
+            values.emplace_back(listing.path, ID_TAG + std::string(reinterpret_cast<const char*>(&listing.id), sizeof(listing.id)));
+        }
+
+        m_Listings.InsertBatch(values);
+    }
+
+    void Remove(const std::string& directory)
+    {
+        m_Listings.Erase(directory);
+    }
+
+    void Compact(const size_t maxBytesPerSecond = 0)
+    {
+        m_Listings.Compact(maxBytesPerSecond);
+    }
+
+private:
+    static constexpr char ID_TAG {'i'};
+    static constexpr char STAMP_TAG {'s'};
+    static constexpr char FILE_TAG {'f'};
+    static constexpr char DIRECTORY_TAG {'d'};
+    static constexpr size_t DEFAULT_FILE_SIZE {16 * 1024 * 1024ul};
+    static constexpr size_t DEFAULT_BUCKET_COUNT {64 * 1024ul};
+
+    Storage m_Listings;
+};
+
+struct UpdateStatistics
+{
+    size_t checkedDirectories {0};
+    size_t readDirectories {0};
+    size_t removedDirectories {0};
+    size_t addedFiles {0};
+    size_t removedFiles {0};
+};
+
+// Brings a file index, its DirectoryIndex and DirectoryTable up to date with the
+// filesystem. Only directories whose stamp changed since they were last listed are read
+// again; their entries are diffed against the stored listing and applied with Insert and
+// Erase. Unchanged directories cost one stat. New directories get the next free id.
+// Added files are inserted in batches of addBatchSize, and at the end of every update.
+template <class Storage>
+class IncrementalUpdater
+{
+public:
+    IncrementalUpdater(Storage& storage, DirectoryIndex& directoryIndex, DirectoryTable& directoryTable,
+                       const size_t addBatchSize = DEFAULT_ADD_BATCH_SIZE)
+        : m_Storage(storage)
+        , m_DirectoryIndex(directoryIndex)
+        , m_DirectoryTable(directoryTable)
+        , m_AddBatchSize(std::max(addBatchSize, 1ul))
+    {}
+
+    static constexpr size_t DEFAULT_ADD_BATCH_SIZE {65536};
+
+    using DirectoryCallback = std::function<void(const std::string&)>;
+
+    // Called for every directory read from disk and for every directory dropped from the index.
+    void OnDirectoryRead(DirectoryCallback callback)
+    {
+        m_OnDirectoryRead = std::move(callback);
+    }
+
+    void OnDirectoryRemoved(DirectoryCallback callback)
+    {
+        m_OnDirectoryRemoved = std::move(callback);
+    }
+
+    // Keeps a NameIndex of the file names up to date as well.
+    void IndexNames(NameIndex& nameIndex)
+    {
+        m_NameIndex = &nameIndex;
+    }
+
+    UpdateStatistics Update(const std::string& root)
+    {
+        return Process({root}, true);
+    }
+
+    // Re-reads only the given directories, descending just into subdirectories that are new.
+    // Meant for callers that know exactly which directories changed.
+    UpdateStatistics UpdateDirectories(std::vector<std::string> directories)
+    {
+        return Process(std::move(directories), false);
+    }
+
+private:
+    UpdateStatistics Process(std::vector<std::string> directories, const bool descendUnchanged)
+    {
+        DirectoryListing stored, current;
+        std::vector<std::string> addedDirectories;
+
+        m_Statistics = UpdateStatistics();
+
+        while (!directories.empty())
+        {
+            const std::string directory = std::move(directories.back());
+            directories.pop_back();
+
+            // The file names are only needed to diff a changed directory.
+            const bool known = m_DirectoryIndex.GetWithoutFiles(directory, stored);
+            ++m_Statistics.checkedDirectories;
+
+            if (!ReadDirectoryStamp(directory, current.stamp))
+            {
+                if (known)
+                {
+                    RemoveTree(directory);
+                }
+                continue;
+            }
+
+            if (known && current.stamp == stored.stamp)
+            {
+                if (descendUnchanged)
+                {
+                    for (const std::string& name : stored.directories)
+                    {
+                        directories.push_back(ChildPath(directory, name));
+                    }
+                }
+                continue;
+            }
+
+            if (!Read(directory, current))
+            {
+                continue;
+            }
+
+            if (known)
+            {
+                m_DirectoryIndex.Get(directory, stored);
+            }
+            else
+            {
+                stored = DirectoryListing();
+                stored.id = AddDirectory(directory);
+            }
+
+            current.id = stored.id;
+            addedDirectories.clear();
+            ApplyChanges(directory, stored, current, addedDirectories);
+
+            for (const std::string& name : descendUnchanged ? current.directories : addedDirectories)
+            {
+                directories.push_back(ChildPath(directory, name));
+            }
+
+            m_DirectoryIndex.Put({current});
+        }
+
+        FlushAddedFiles();
+        return m_Statistics;
+    }
+
+    bool Read(const std::string& directory, DirectoryListing& listing)
+    {
+        listing = DirectoryListing();
+        listing.path = directory;
+        ++m_Statistics.readDirectories;
+
+        const bool listed = ListDirectory(directory, m_Buffer, listing.stamp, [&](const EntryType type, const char* name)
+        {
+            if (type == EntryType::Directory)
+            {
+                listing.directories.emplace_back(name);
+            }
+            else if (type == EntryType::RegularFile)
+            {
+                listing.files.emplace_back(name);
+            }
+        });
+
+        if (listed && m_OnDirectoryRead)
+        {
+            m_OnDirectoryRead(directory);
+        }
+        return listed;
+    }
+
+    // Interns a directory seen for the first time, under its parent if that is listed:
+    // parents are listed before their new subdirectories are descended into.
+    uint64_t AddDirectory(const std::string& directory)
+    {
+        const size_t separator = directory.rfind('/');
+        uint64_t parentId = DirectoryTable::NO_PARENT;
+
+        if (separator != std::string::npos && separator + 1 < directory.size())
+        {
+            m_DirectoryIndex.GetId(directory.substr(0, std::max<size_t>(separator, 1)), parentId);
+        }
+
+        const uint64_t id = m_DirectoryTable.AllocateId();
+        m_DirectoryTable.Add(id, parentId, directory);
+        return id;
+    }
+
+    // stored holds just the id for directories that were not listed before.
+    void ApplyChanges(const std::string& directory, DirectoryListing& stored, DirectoryListing& current, std::vector<std::string>& addedDirectories)
+    {
+        std::vector<std::string> addedFiles, removedFiles, removedDirectories;
+
+        Difference(current.files, stored.files, addedFiles);
+        Difference(stored.files, current.files, removedFiles);
+        Difference(current.directories, stored.directories, addedDirectories);
+        Difference(stored.directories, current.directories, removedDirectories);
+
+        for (const std::string& name : removedFiles)
+        {
+            EraseFile(name, current.id);
+        }
+
+        for (const std::string& name : removedDirectories)
+        {
+            RemoveTree(ChildPath(directory, name));
+        }
+
+        for (std::string& name : addedFiles)
+        {
+            auto directoryIds = m_Storage.FindAll(name);
+
+            if (std::find(directoryIds.begin(), directoryIds.end(), current.id) == directoryIds.end())
+            {
+                m_AddedFiles.emplace_back(std::move(name), current.id);
+            }
+        }
+
+        if (m_AddedFiles.size() >= m_AddBatchSize)
+        {
+            FlushAddedFiles();
+        }
+    }
+
+    // Drops a directory that no longer exists, with everything listed below it.
+    void RemoveTree(const std::string& root)
+    {
+        std::vector<std::string> directories {root};
+        DirectoryListing listing;
+
+        while (!directories.empty())
+        {
+            const std::string directory = std::move(directories.back());
+            directories.pop_back();
+
+            if (!m_DirectoryIndex.Get(directory, listing))
+            {
+                continue;
+            }
+
+            for (const std::string& name : listing.files)
+            {
+                EraseFile(name, listing.id);
+            }
+
+            for (const std::string& name : listing.directories)
+            {
+                directories.push_back(ChildPath(directory, name));
+            }
+
+            m_DirectoryIndex.Remove(directory);
+            m_DirectoryTable.Remove(listing.id);
+            ++m_Statistics.removedDirectories;
+
+            if (m_OnDirectoryRemoved)
+            {
+                m_OnDirectoryRemoved(directory);
+            }
+        }
+    }
+
+    void EraseFile(const std::string& name, const uint64_t directoryId)
+    {
+        m_Statistics.removedFiles += m_Storage.Erase(name, directoryId);
+
+        if (m_NameIndex && m_Storage.Count(name) == 0)
+        {
+            m_NameIndex->Remove(name);
+        }
+    }
+
+    void FlushAddedFiles()
+    {
+        if (m_NameIndex)
+        {
+            std::vector<std::string_view> names;
+            names.reserve(m_AddedFiles.size());
+
+            for (const auto& file : m_AddedFiles)
+            {
+                names.push_back(file.first);
+            }
+            m_NameIndex->Add(names);
+        }
+
+        m_Storage.InsertBatch(m_AddedFiles);
+        m_Statistics.addedFiles += m_AddedFiles.size();
+        m_AddedFiles.clear();
+    }
+
+    // Names in from that are missing in what.
+    static void Difference(std::vector<std::string>& from, std::vector<std::string>& what, std::vector<std::string>& result)
+    {
+        std::sort(from.begin(), from.end());
+        std::sort(what.begin(), what.end());
+        std::set_difference(from.begin(), from.end(), what.begin(), what.end(), std::back_inserter(result));
+    }
+
+    Storage& m_Storage;
+    DirectoryIndex& m_DirectoryIndex;
+    DirectoryTable& m_DirectoryTable;
+    const size_t m_AddBatchSize;
+    NameIndex* m_NameIndex {nullptr};
+    UpdateStatistics m_Statistics;
+    FileBatch m_AddedFiles;
+    std::vector<char> m_Buffer;
+    DirectoryCallback m_OnDirectoryRead;
+    DirectoryCallback m_OnDirectoryRemoved;
+};
+} //FsDump
@@ -0,0 +1,584 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <boost/log/trivial.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace FsDump
+{
+
+namespace fs = boost::filesystem;
+
+// (file name, directory id) pairs, ready for Map::InsertBatch.
+using FileBatch = std::vector<std::pair<std::string, uint64_t>>;
+
+// Identifies a state of a directory's entry list: any entry added, removed or renamed
+// changes the modification time, replacing the directory changes the inode.
+struct DirectoryStamp
+{
+    bool operator ==(const DirectoryStamp& rhv) const
+    {
+        return modified == rhv.modified && changed == rhv.changed && inode == rhv.inode;
+    }
+
+    bool operator !=(const DirectoryStamp& rhv) const
+    {
+        return !(*this == rhv);
+    }
+
+    int64_t modified {0};
+    int64_t changed {0};
+    uint64_t inode {0};
+};
+
+// The regular files and subdirectories (names only) of one directory. id names the
+// directory in the DirectoryTable, the root of a scan has no parent (parentId 0).
+struct DirectoryListing
+{
+    std::string path;
+    uint64_t id {0};
+    uint64_t parentId {0};
+    DirectoryStamp stamp;
+    std::vector<std::string> files;
+    std::vector<std::string> directories;
+};
+
+struct ScanBatch
+{
+    std::vector<DirectoryListing> directories;
+    size_t fileCount {0};
+};
+
+enum class EntryType
+{
+    Directory,
+    RegularFile,
+    Other
+};
+
+constexpr size_t DIRENT_BUFFER_SIZE {256 * 1024};
+
+inline std::string ChildPath(const std::string& directory, const std::string& name)
+{
+    return (!directory.empty() && directory.back() == '/') ? directory + name : directory + '/' + name;
+}
+
+#ifdef __linux__
+inline DirectoryStamp MakeStamp(const struct stat& status)
+{
+    DirectoryStamp stamp;
+    stamp.modified = int64_t(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+    stamp.changed = int64_t(status.st_ctim.tv_sec) * 1000000000 + status.st_ctim.tv_nsec;
+    stamp.inode = status.st_ino;
+    return stamp;
+}
+
+inline bool ReadDirectoryStamp(const std::string& directory, DirectoryStamp& stamp)
+{
+    struct stat status;
+
+    if (::lstat(directory.c_str(), &status) != 0 || !S_ISDIR(status.st_mode))
+    {
+        return false;
+    }
+
+    stamp = MakeStamp(status);
+    return true;
+}
+
+struct LinuxDirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+// d_type already tells directories and regular files apart; fstatat relative to the
+// directory fd is only needed for symbolic links and when the filesystem reports
+// DT_UNKNOWN.
+inline EntryType GetEntryType(const int directoryFd, const char* name, const unsigned char type)
+{
+    struct stat status;
+
+    switch (type)
+    {
+    case DT_DIR:
+        return EntryType::Directory;
+    case DT_REG:
+        return EntryType::RegularFile;
+    case DT_UNKNOWN:
+        if (::fstatat(directoryFd, name, &status, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            return EntryType::Other;
+        }
+        if (S_ISDIR(status.st_mode))
+        {
+            return EntryType::Directory;
+        }
+        if (!S_ISLNK(status.st_mode))
+        {
+            return (S_ISREG(status.st_mode)) ? EntryType::RegularFile : EntryType::Other;
+        }
+        // Fall through to resolve the link target.
+    case DT_LNK:
+        return (::fstatat(directoryFd, name, &status, 0) == 0 && S_ISREG(status.st_mode)) ? EntryType::RegularFile
+                                                                                         : EntryType::Other;
+    default:
+        return EntryType::Other;
+    }
+}
+
+// Calls onEntry(EntryType, const char* name) for every entry of directory except "." and
+// "..", reading them with raw getdents64 calls into buffer. Symbolic links to regular
+// files are reported as regular files, links to directories as EntryType::Other. The
+// stamp is taken before reading. Returns false, after logging, if the directory could
+// not be read.
+template <class Callback>
+bool ListDirectory(const std::string& directory, std::vector<char>& buffer, DirectoryStamp& stamp, Callback onEntry)
+{
+    const int directoryFd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat status;
+
+    if (directoryFd < 0 || ::fstat(directoryFd, &status) != 0)
+    {
+        BOOST_LOG_TRIVIAL(error) << "Filesystem error while processing " << directory << ": " << std::strerror(errno);
+
+        if (directoryFd >= 0)
+        {
+            ::close(directoryFd);
+        }
+        return false;
+    }
+
+    stamp = MakeStamp(status);
+    buffer.resize(DIRENT_BUFFER_SIZE);
+    bool listed = true;
+
+    for (;;)
+    {
+        const long bytes = ::syscall(SYS_getdents64, directoryFd, buffer.data(), buffer.size());
+
+        if (bytes <= 0)
+        {
+            if (bytes < 0)
+            {
+                BOOST_LOG_TRIVIAL(error) << "Filesystem error while processing " << directory << ": " << std::strerror(errno);
+                listed = false;
+            }
+            break;
+        }
+
+        for (long offset = 0; offset < bytes;)
+        {
+            const LinuxDirent64* entry = reinterpret_cast<const LinuxDirent64*>(buffer.data() + offset);
+            const char* name = entry->d_name;
+            offset += entry->d_reclen;
+
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+            {
+                continue;
+            }
+
+            onEntry(GetEntryType(directoryFd, name, entry->d_type), name);
+        }
+    }
+
+    ::close(directoryFd);
+    return listed;
+}
+#else
+inline bool ReadDirectoryStamp(const std::string& directory, DirectoryStamp& stamp)
+{
+    boost::system::error_code error;
+
+    if (!fs::is_directory(fs::symlink_status(directory, error)))
+    {
+        return false;
+    }
+
+    stamp.modified = fs::last_write_time(directory, error);
+    return !error;
+}
+
+template <class Callback>
+bool ListDirectory(const std::string& directory, std::vector<char>&, DirectoryStamp& stamp, Callback onEntry)
+{
+    boost::system::error_code error;
+
+    ReadDirectoryStamp(directory, stamp);
+    fs::directory_iterator entry(directory, error), end;
+
+    for (; !error && entry != end; entry.increment(error))
+    {
+        const std::string name = entry->path().filename().string();
+
+        if (fs::is_directory(entry->symlink_status(error)))
+        {
+            onEntry(EntryType::Directory, name.c_str());
+        }
+        else if (fs::is_regular_file(entry->status(error)))
+        {
+            onEntry(EntryType::RegularFile, name.c_str());
+        }
+        error.clear();
+    }
+
+    if (error)
+    {
+        BOOST_LOG_TRIVIAL(error) << "Filesystem error while processing " << directory << ": " << error.message();
+        return false;
+    }
+    return true;
+}
+#endif
+
+// Multi-producer, multi-consumer FIFO that blocks producers while it is full.
+template <class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(const size_t capacity)
+        : m_Capacity(capacity)
+    {}
+
+    // Returns false if the queue was closed, the item is then dropped.
+    bool Push(T&& item)
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_NotFull.wait(lock, [this]() { return m_Closed || m_Items.size() < m_Capacity; });
+
+        if (m_Closed)
+        {
+            return false;
+        }
+
+        m_Items.push_back(std::move(item));
+        m_NotEmpty.notify_one();
+        return true;
+    }
+
+    // Blocks until an item is available. Returns false once the queue is closed and drained.
+    bool Pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_NotEmpty.wait(lock, [this]() { return m_Closed || !m_Items.empty(); });
+
+        if (m_Items.empty())
+        {
+            return false;
+        }
+
+        item = std::move(m_Items.front());
+        m_Items.pop_front();
+        m_NotFull.notify_one();
+        return true;
+    }
+
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Closed = true;
+        m_NotEmpty.notify_all();
+        m_NotFull.notify_all();
+    }
+
+private:
+    const size_t m_Capacity;
+    std::mutex m_Mutex;
+    std::condition_variable m_NotEmpty;
+    std::condition_variable m_NotFull;
+    std::deque<T> m_Items;
+    bool m_Closed {false};
+};
+
+// Walks a directory tree with a pool of threads. Every walker owns a deque of directories
+// to read: it pushes the subdirectories it finds to the back and pops from the back, and
+// idle walkers steal from the front of the others. The listings of the directories read
+// are grouped in batches and handed over a bounded queue to the single thread that called
+// Scan. Every directory gets its id when it is found, so a listing names its parent by id
+// whatever order the batches arrive in. On Linux the directories are read with raw
+// getdents64 calls, elsewhere with boost::filesystem.
+class DirectoryScanner
+{
+public:
+    explicit DirectoryScanner(const size_t threadCount = DefaultThreadCount(), const size_t batchSize = DEFAULT_BATCH_SIZE)
+        : m_ThreadCount(std::max(threadCount, 1ul))
+        , m_BatchSize(std::max(batchSize, 1ul))
+    {}
+
+    static size_t DefaultThreadCount()
+    {
+        return std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    // Calls consumeBatch(ScanBatch&) on the calling thread for every batch of directory
+    // listings found under root, symbolic links to directories are not followed. Directory
+    // ids are handed out from firstDirectoryId on, root getting the first; NextDirectoryId
+    // tells the first one left unused. Returns the number of files found.
+    template <class Consumer>
+    size_t Scan(const fs::path& root, Consumer consumeBatch, const uint64_t firstDirectoryId = 1)
+    {
+        BoundedQueue<ScanBatch> batches(m_ThreadCount * 4);
+        std::vector<Walker> walkers(m_ThreadCount);
+        std::vector<std::thread> threads;
+        std::atomic<size_t> activeWalkers {m_ThreadCount};
+
+        m_Walkers = &walkers;
+        m_Batches = &batches;
+        m_PendingDirectories = 1;
+        m_Stopped = false;
+        m_QueuedDirectories = 1;
+        m_NextDirectoryId = firstDirectoryId + 1;
+        walkers[0].directories.push_back(PendingDirectory {root.string(), firstDirectoryId, 0});
+
+        for (size_t index = 0; index < m_ThreadCount; ++index)
+        {
+            threads.emplace_back([this, index, &activeWalkers, &batches]()
+            {
+                Walk(index);
+
+                if (--activeWalkers == 0)
+                {
+                    batches.Close();
+                }
+            });
+        }
+
+        size_t scannedFiles = 0;
+        std::exception_ptr error;
+
+        try
+        {
+            ScanBatch batch;
+            while (batches.Pop(batch))
+            {
+                scannedFiles += batch.fileCount;
+                consumeBatch(batch);
+            }
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+            Notify([this]() { m_Stopped = true; });
+            batches.Close();
+        }
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+
+        return scannedFiles;
+    }
+
+    uint64_t NextDirectoryId() const
+    {
+        return m_NextDirectoryId;
+    }
+
+private:
+    struct PendingDirectory
+    {
+        std::string path;
+        uint64_t id;
+        uint64_t parentId;
+    };
+
+    struct Walker
+    {
+        std::mutex mutex;
+        std::deque<PendingDirectory> directories;
+        ScanBatch batch;
+        std::vector<char> buffer;
+    };
+
+    void Walk(const size_t index)
+    {
+        Walker& walker = (*m_Walkers)[index];
+        PendingDirectory directory;
+
+        while (!m_Stopped && m_PendingDirectories != 0)
+        {
+            if (!PopDirectory(index, directory, false))
+            {
+                {
+                    std::unique_lock<std::mutex> lock(m_IdleMutex);
+                    m_WorkAvailable.wait(lock, [this]() { return m_Stopped || m_PendingDirectories == 0 || m_QueuedDirectories != 0; });
+                }
+
+                // Woken for queued directories, the walker waits for the deques other
+                // walkers hold rather than spin on failed try_locks.
+                if (m_Stopped || !PopDirectory(index, directory, true))
+                {
+                    continue;
+                }
+            }
+
+            ReadDirectory(walker, directory);
+
+            if (--m_PendingDirectories == 0)
+            {
+                Notify([]() {});
+            }
+        }
+
+        if (!walker.batch.directories.empty())
+        {
+            m_Batches->Push(std::move(walker.batch));
+        }
+    }
+
+    // Takes the newest directory of the walker's own deque, or steals the oldest of another
+    // one. Unless blocking, deques that another walker holds are skipped.
+    bool PopDirectory(const size_t index, PendingDirectory& directory, const bool blocking)
+    {
+        {
+            Walker& walker = (*m_Walkers)[index];
+            std::lock_guard<std::mutex> lock(walker.mutex);
+
+            if (!walker.directories.empty())
+            {
+                directory = std::move(walker.directories.back());
+                walker.directories.pop_back();
+                --m_QueuedDirectories;
+                return true;
+            }
+        }
+
+        for (size_t offset = 1; offset < m_ThreadCount; ++offset)
+        {
+            Walker& victim = (*m_Walkers)[(index + offset) % m_ThreadCount];
+            std::unique_lock<std::mutex> lock(victim.mutex, std::defer_lock);
+
+            if (blocking)
+            {
+                lock.lock();
+            }
+            else if (!lock.try_lock())
+            {
+                continue;
+            }
+
+            if (!victim.directories.empty())
+            {
+                directory = std::move(victim.directories.front());
+                victim.directories.pop_front();
+                --m_QueuedDirectories;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Only file names are kept, under the listing: paths are rebuilt from directory ids.
+    void ReadDirectory(Walker& walker, PendingDirectory& directory)
+    {
+        DirectoryListing listing;
+        listing.path = std::move(directory.path);
+        listing.id = directory.id;
+        listing.parentId = directory.parentId;
+
+        const bool listed = ListDirectory(listing.path, walker.buffer, listing.stamp, [&](const EntryType type, const char* name)
+        {
+            switch (type)
+            {
+            case EntryType::Directory:
+                AddDirectory(walker, PendingDirectory {ChildPath(listing.path, name), m_NextDirectoryId++, listing.id});
+                listing.directories.emplace_back(name);
+                break;
+            case EntryType::RegularFile:
+                listing.files.emplace_back(name);
+                break;
+            case EntryType::Other:
+                break;
+            }
+        });
+
+        if (listed)
+        {
+            walker.batch.fileCount += listing.files.size();
+            walker.batch.directories.push_back(std::move(listing));
+        }
+
+        if (walker.batch.fileCount >= m_BatchSize || walker.batch.directories.size() >= m_BatchSize)
+        {
+            m_Batches->Push(std::move(walker.batch));
+            walker.batch = ScanBatch();
+        }
+    }
+
+    // Counted as queued before it is pushed, so the count may briefly run ahead of the
+    // deques, never behind: a walker that saw none queued is woken by the push.
+    void AddDirectory(Walker& walker, PendingDirectory&& directory)
+    {
+        ++m_PendingDirectories;
+        {
+            std::lock_guard<std::mutex> lock(m_IdleMutex);
+            ++m_QueuedDirectories;
+        }
+        {
+            std::lock_guard<std::mutex> lock(walker.mutex);
+            walker.directories.push_back(std::move(directory));
+        }
+        m_WorkAvailable.notify_one();
+    }
+
+    // Wakes all idle walkers after change, made under their mutex so that none misses it
+    // between checking what it waits for and starting to wait.
+    template <class Change>
+    void Notify(Change change)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_IdleMutex);
+            change();
+        }
+        m_WorkAvailable.notify_all();
+    }
+
+public:
+    static constexpr size_t DEFAULT_BATCH_SIZE {1024};
+
+private:
+    const size_t m_ThreadCount;
+    const size_t m_BatchSize;
+
+    std::vector<Walker>* m_Walkers {nullptr};
+    BoundedQueue<ScanBatch>* m_Batches {nullptr};
+    // Directories found and not read yet; those of them still in a deque, not taken by a walker.
+    std::atomic<size_t> m_PendingDirectories {0};
+    std::atomic<size_t> m_QueuedDirectories {0};
+    std::atomic<uint64_t> m_NextDirectoryId {1};
+    std::atomic<bool> m_Stopped {false};
+    std::mutex m_IdleMutex;
+    std::condition_variable m_WorkAvailable;
+};
+} //FsDump
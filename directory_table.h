@@ -0,0 +1,217 @@
+#pragma once
+
+#include "container.h"
+#include "directory_scanner.h"
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace FsDump
+{
+
+// Directory paths interned once: every directory id maps to a single value, the id of its
+// parent followed by its name. The roots of scans have parent NO_PARENT and their full
+// path as name. The file index then keeps the 8 byte id of its directory for every file
+// instead of the file's path, and paths are rebuilt only to answer lookups. Id 0 is no
+// directory, its value is the first id not reserved yet: AllocateId reserves ID_BLOCK_SIZE
+// ids at a time and hands them out from memory, so the ids left in the block of a closed
+// table are skipped.
+class DirectoryTable
+{
+public:
+    using Storage = HardDriveContainers::Map<uint64_t, std::string>;
+
+    static constexpr uint64_t NO_PARENT {0};
+
+    explicit DirectoryTable(const std::string& filename)
+        : m_Directories(filename.c_str(), DEFAULT_FILE_SIZE, DEFAULT_BUCKET_COUNT)
+    {
+        if (const std::optional<std::string> nextId = m_Directories.Get(NEXT_ID_KEY))
+        {
+            std::memcpy(&m_NextId, nextId->data(), std::min(nextId->size(), sizeof(m_NextId)));
+        }
+        m_ReservedId = m_NextId;
+    }
+
+    static std::string FilenameFor(const std::string& storageFile)
+    {
+        return storageFile + ".tree";
+    }
+
+    uint64_t NextId() const
+    {
+        return m_NextId;
+    }
+
+    // Ids below nextId are taken, e.g. handed out by a DirectoryScanner.
+    void ReserveIds(const uint64_t nextId)
+    {
+        m_NextId = std::max(m_NextId, nextId);
+
+        if (nextId > m_ReservedId)
+        {
+            StoreReservedId(nextId);
+        }
+    }
+
+    uint64_t AllocateId()
+    {
+        if (m_NextId == m_ReservedId)
+        {
+            StoreReservedId(m_NextId + ID_BLOCK_SIZE);
+        }
+        return m_NextId++;
+    }
+
+    // Adds the directories of a scan under the ids their listings were given.
+    void Add(const std::vector<DirectoryListing>& listings)
+    {
+        std::vector<std::pair<uint64_t, std::string>> entries;
+        entries.reserve(listings.size());
+
+        for (const DirectoryListing& listing : listings)
+        {
+            entries.emplace_back(listing.id, Entry(listing.parentId, listing.path));
+        }
+
+        m_Directories.InsertBatch(entries);
+    }
+
+    void Add(const uint64_t id, const uint64_t parentId, const std::string& path)
+    {
+        m_Directories.Insert(id, Entry(parentId, path));
+    }
+
+    void Remove(const uint64_t id)
+    {
+        m_Directories.Erase(id);
+    }
+
+    const Storage& Directories() const
+    {
+        return m_Directories;
+    }
+
+    void Compact(const size_t maxBytesPerSecond = 0)
+    {
+        m_Directories.Compact(maxBytesPerSecond);
+    }
+
+private:
+    void StoreReservedId(const uint64_t reservedId)
+    {
+        m_ReservedId = reservedId;
+        m_Directories.Erase(NEXT_ID_KEY);
+        m_Directories.Insert(NEXT_ID_KEY, std::string(reinterpret_cast<const char*>(&m_ReservedId), sizeof(m_ReservedId)));
+    }
+
+    // Roots keep their whole path, other directories the part after the last separator.
+    static std::string Entry(const uint64_t parentId, const std::string& path)
+    {
+        const std::string name = (parentId == NO_PARENT) ? path : path.substr(path.rfind('/') + 1);
+        std::string entry(reinterpret_cast<const char*>(&parentId), sizeof(parentId));
+
+        return entry += name;
+    }
+
+    static constexpr uint64_t NEXT_ID_KEY {0};
+    static constexpr uint64_t ID_BLOCK_SIZE {4096};
+    static constexpr size_t DEFAULT_FILE_SIZE {16 * 1024 * 1024ul};
+    static constexpr size_t DEFAULT_BUCKET_COUNT {64 * 1024ul};
+
+    Storage m_Directories;
+    uint64_t m_NextId {1};
+    uint64_t m_ReservedId {1};
+};
+
+// Answers file name lookups with full paths, over a file index of directory ids and the
+// directory table they refer to: either Maps or their FrozenMap snapshots. Directory paths
+// are rebuilt parent by parent, each at most once per GetMany.
+template <class Files, class Directories>
+class FileLookup
+{
+public:
+    FileLookup(const Files& files, const Directories& directories)
+        : m_Files(files)
+        , m_Directories(directories)
+    {}
+
+    template <typename Range>
+    std::vector<std::vector<std::string>> GetMany(const Range& names) const
+    {
+        std::vector<std::vector<std::string>> paths;
+        std::unordered_map<uint64_t, std::string> directoryPaths;
+        auto name = std::begin(names);
+
+        paths.reserve(std::distance(std::begin(names), std::end(names)));
+
+        for (const std::vector<uint64_t>& directoryIds : m_Files.GetMany(names))
+        {
+            std::vector<std::string>& result = paths.emplace_back();
+
+            for (const uint64_t directoryId : directoryIds)
+            {
+                const std::string* directory = DirectoryPath(directoryId, directoryPaths);
+
+                if (directory)
+                {
+                    result.push_back(ChildPath(*directory, std::string(HardDriveContainers::AsStringView(*name))));
+                }
+            }
+            ++name;
+        }
+        return paths;
+    }
+
+private:
+    // Null if the directory or one of its parents is missing, e.g. removed by a concurrent
+    // update after its files were read.
+    const std::string* DirectoryPath(const uint64_t id, std::unordered_map<uint64_t, std::string>& directoryPaths) const
+    {
+        const auto cached = directoryPaths.find(id);
+
+        if (cached != directoryPaths.end())
+        {
+            return &cached->second;
+        }
+
+        const std::optional<std::string> entry = m_Directories.Get(id);
+        uint64_t parentId;
+
+        if (!entry || entry->size() < sizeof(parentId))
+        {
+            return nullptr;
+        }
+
+        std::memcpy(&parentId, entry->data(), sizeof(parentId));
+        const std::string_view name = std::string_view(*entry).substr(sizeof(parentId));
+        std::string path;
+
+        if (parentId == DirectoryTable::NO_PARENT)
+        {
+            path = name;
+        }
+        else
+        {
+            const std::string* parent = DirectoryPath(parentId, directoryPaths);
+
+            if (!parent)
+            {
+                return nullptr;
+            }
+            path = ChildPath(*parent, std::string(name));
+        }
+
+        return &directoryPaths.emplace(id, std::move(path)).first->second;
+    }
+
+    const Files& m_Files;
+    const Directories& m_Directories;
+};
+} //FsDump
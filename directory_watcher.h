@@ -0,0 +1,273 @@
+#pragma once
+
+#ifdef __linux__
+#include "directory_index.h"
+#include "directory_scanner.h"
+#include <boost/log/trivial.hpp>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace FsDump
+{
+
+// Keeps a file index, its DirectoryIndex and DirectoryTable in sync with a directory tree
+// through inotify. The event loop only translates events into the set of directories whose
+// entries changed; a separate thread waits for bursts to settle, then re-reads those
+// directories with IncrementalUpdater. An rm -rf of a large tree thus becomes a few
+// batched updates, and the event loop keeps draining the inotify queue while they run.
+template <class Storage>
+class DirectoryWatcher
+{
+public:
+    DirectoryWatcher(Storage& storage, DirectoryIndex& directoryIndex, DirectoryTable& directoryTable,
+                     const std::chrono::milliseconds coalesceDelay = DEFAULT_COALESCE_DELAY)
+        : m_Updater(storage, directoryIndex, directoryTable)
+        , m_CoalesceDelay(coalesceDelay)
+        , m_InotifyFd(::inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+    {
+        if (m_InotifyFd < 0)
+        {
+            throw std::runtime_error(std::string("inotify_init1 failed: ") + std::strerror(errno));
+        }
+
+        m_Updater.OnDirectoryRead([this](const std::string& directory) { Watch(directory); });
+        m_Updater.OnDirectoryRemoved([this](const std::string& directory) { Unwatch(directory); });
+    }
+
+    DirectoryWatcher(const DirectoryWatcher&) = delete;
+    DirectoryWatcher& operator =(const DirectoryWatcher&) = delete;
+
+    ~DirectoryWatcher()
+    {
+        ::close(m_InotifyFd);
+    }
+
+    // Keeps a NameIndex of the watched files up to date as well.
+    void IndexNames(NameIndex& nameIndex)
+    {
+        m_Updater.IndexNames(nameIndex);
+    }
+
+    // Starts watching one directory, not its subdirectories. Idempotent.
+    void Watch(const std::string& directory)
+    {
+        const int watch = ::inotify_add_watch(m_InotifyFd, directory.c_str(), WATCH_MASK);
+
+        if (watch < 0)
+        {
+            if (errno == ENOSPC && !m_WatchLimitReported)
+            {
+                m_WatchLimitReported = true;
+                BOOST_LOG_TRIVIAL(error) << "Out of inotify watches, raise fs.inotify.max_user_watches; changes in unwatched directories are missed";
+            }
+            else if (errno != ENOSPC && errno != ENOENT)
+            {
+                BOOST_LOG_TRIVIAL(error) << "Can't watch " << directory << ": " << std::strerror(errno);
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        auto found = m_WatchPaths.find(watch);
+
+        // A renamed directory keeps its watch, only the path it is known by changes.
+        if (found != m_WatchPaths.end() && found->second != directory)
+        {
+            m_Watches.erase(found->second);
+        }
+        m_WatchPaths[watch] = directory;
+        m_Watches[directory] = watch;
+    }
+
+    // Applies filesystem changes under root until stop is set. The tree is expected to be
+    // scanned and watched already; one full update pass at the start picks up whatever
+    // changed before the watches were in place.
+    void Run(const std::string& root, const std::atomic<bool>& stop)
+    {
+        m_Root = root;
+        m_FullUpdate = true;
+        m_Stopped = false;
+
+        std::thread applier([this]() { ApplyChanges(); });
+
+        while (!stop)
+        {
+            pollfd descriptor {m_InotifyFd, POLLIN, 0};
+
+            if (::poll(&descriptor, 1, POLL_TIMEOUT_MS) > 0)
+            {
+                ReadEvents();
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Stopped = true;
+        }
+        m_Changed.notify_one();
+        applier.join();
+    }
+
+private:
+    void Unwatch(const std::string& directory)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        auto found = m_Watches.find(directory);
+
+        if (found == m_Watches.end())
+        {
+            return;
+        }
+
+        const int watch = found->second;
+        m_Watches.erase(found);
+
+        auto path = m_WatchPaths.find(watch);
+
+        // The watch may already belong to the directory's new path after a rename.
+        if (path != m_WatchPaths.end() && path->second == directory)
+        {
+            m_WatchPaths.erase(path);
+            ::inotify_rm_watch(m_InotifyFd, watch);
+        }
+    }
+
+    void ReadEvents()
+    {
+        alignas(inotify_event) char buffer[EVENT_BUFFER_SIZE];
+        bool changed = false;
+
+        for (;;)
+        {
+            const ssize_t bytes = ::read(m_InotifyFd, buffer, sizeof(buffer));
+
+            if (bytes <= 0)
+            {
+                break;
+            }
+
+            std::lock_guard<std::mutex> lock(m_Mutex);
+
+            for (ssize_t offset = 0; offset < bytes;)
+            {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                offset += sizeof(inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    m_FullUpdate = true;
+                    changed = true;
+                    continue;
+                }
+
+                auto path = m_WatchPaths.find(event->wd);
+
+                if (path == m_WatchPaths.end())
+                {
+                    continue;
+                }
+
+                if (event->mask & IN_IGNORED)
+                {
+                    m_Watches.erase(path->second);
+                    m_WatchPaths.erase(path);
+                    continue;
+                }
+
+                // Entry events name the watched directory itself; so do the self events,
+                // whose directory then fails to stat and is dropped with its subtree.
+                m_ChangedDirectories.insert(path->second);
+                changed = true;
+            }
+        }
+
+        if (changed)
+        {
+            m_Changed.notify_one();
+        }
+    }
+
+    void ApplyChanges()
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        for (;;)
+        {
+            m_Changed.wait(lock, [this]() { return m_Stopped || m_FullUpdate || !m_ChangedDirectories.empty(); });
+
+            if (!m_Stopped)
+            {
+                lock.unlock();
+                std::this_thread::sleep_for(m_CoalesceDelay);
+                lock.lock();
+            }
+
+            if (!m_FullUpdate && m_ChangedDirectories.empty())
+            {
+                return;
+            }
+
+            const bool fullUpdate = m_FullUpdate;
+            std::vector<std::string> directories(m_ChangedDirectories.begin(), m_ChangedDirectories.end());
+            m_FullUpdate = false;
+            m_ChangedDirectories.clear();
+            lock.unlock();
+
+            try
+            {
+                const UpdateStatistics statistics = fullUpdate ? m_Updater.Update(m_Root) : m_Updater.UpdateDirectories(std::move(directories));
+
+                if (statistics.addedFiles != 0 || statistics.removedFiles != 0 || statistics.removedDirectories != 0)
+                {
+                    BOOST_LOG_TRIVIAL(info) << "Applied changes: " << statistics.readDirectories << " directories read, "
+                        << statistics.removedDirectories << " removed, " << statistics.addedFiles << " files added, "
+                        << statistics.removedFiles << " files removed";
+                }
+            }
+            catch (const std::exception& ex)
+            {
+                BOOST_LOG_TRIVIAL(error) << "Error applying filesystem changes: " << ex.what();
+            }
+
+            lock.lock();
+        }
+    }
+
+    static constexpr uint32_t WATCH_MASK {IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF
+                                          | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK};
+    static constexpr size_t EVENT_BUFFER_SIZE {64 * 1024};
+    static constexpr int POLL_TIMEOUT_MS {250};
+
+public:
+    static constexpr std::chrono::milliseconds DEFAULT_COALESCE_DELAY {200};
+
+private:
+    IncrementalUpdater<Storage> m_Updater;
+    const std::chrono::milliseconds m_CoalesceDelay;
+    const int m_InotifyFd;
+    std::string m_Root;
+    bool m_WatchLimitReported {false};
+
+    std::mutex m_Mutex;
+    std::condition_variable m_Changed;
+    std::unordered_map<int, std::string> m_WatchPaths;
+    std::unordered_map<std::string, int> m_Watches;
+    std::set<std::string> m_ChangedDirectories;
+    bool m_FullUpdate {false};
+    bool m_Stopped {false};
+};
+} //FsDump
+#endif
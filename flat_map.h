@@ -0,0 +1,1471 @@
+#pragma once
+
+#include "container.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace HardDriveContainers
+{
+
+// The Map for keys and values that are both fixed-size, trivially copyable types, chosen
+// by IsFlatStorable. Instead of a bucket array of chains of key nodes, the file holds one
+// open-addressing array of slots, each with a key and its first value inline, so a key
+// costs no allocation of its own and a lookup mostly reads one group of slots. Later
+// values of a key go to value chunks as in the key node layout.
+//
+// Slots come in groups of GROUP_SIZE preceded by a tag byte each: empty, deleted, or 7 bits
+// of the key's hash. A lookup compares the tags of a whole group at once, with SSE2 where
+// available, and only reads the keys of the matching slots. Groups are probed
+// triangularly from the one the hash picks, until a group with an empty slot. When live
+// and deleted slots pass MAX_LOAD_FACTOR, the array is rebuilt at up to half full, doubled
+// if the keys need it.
+//
+// The public interface is the one of the key node layout. Buckets are slots, so
+// BucketCount, ForEachInRange and Stats count slots and the latter also reports how many
+// groups the lookups of the sampled keys probe.
+template <class Key, class Value, class KeyHash, class KeyEqual>
+class Map<Key, Value, KeyHash, KeyEqual, std::enable_if_t<IsFlatStorable<Key, Value>::value>>
+    : public MappedMap<Map<Key, Value, KeyHash, KeyEqual, std::enable_if_t<IsFlatStorable<Key, Value>::value>>>
+{
+private:
+    using Base = MappedMap<Map>;
+    friend Base;
+
+    using Base::m_Filename;
+    using Base::m_ReadOnly;
+    using Base::m_Prewarm;
+    using Base::m_MappedSize;
+    using Base::m_MappedFile;
+    using Base::m_Counters;
+    using Base::Reopen;
+    using Base::Prewarm;
+    using Base::RemapIfGrown;
+    using Base::CheckFormat;
+    using Base::FindHeader;
+    using Base::CheckWritable;
+    using Base::ReserveFreeMemory;
+    using Base::GrowFile;
+    using Base::ReplaceFile;
+    using Base::InBounds;
+    using Base::AddToHistogram;
+    using Base::AddHistogram;
+
+    using KeyTraits = RecordTraits<Key>;
+    using ValueTraits = RecordTraits<Value>;
+
+    struct ValueChunkT;
+    using ValueChunkPtr = bipc::offset_ptr<ValueChunkT>;
+
+    // Values after a key's first one: entries [begin, capacity) run newest first and the
+    // newest chunk heads the list, as in the key node layout, but all entries have the
+    // size of Value, so there is no size header.
+    struct ValueChunkT
+    {
+        explicit ValueChunkT(const uint32_t values)
+            : capacity(values)
+            , begin(values)
+        {}
+
+        ValueChunkT(const ValueChunkT&) = delete;
+        ValueChunkT& operator =(const ValueChunkT&) = delete;
+
+        const char* Entry(const size_t index) const
+        {
+            return reinterpret_cast<const char*>(this + 1) + index * sizeof(Value);
+        }
+
+        char* Entry(const size_t index)
+        {
+            return reinterpret_cast<char*>(this + 1) + index * sizeof(Value);
+        }
+
+        ValueChunkPtr nextChunk {nullptr};
+        const uint32_t capacity;
+        uint32_t begin;
+    };
+
+    // A key with its oldest value and the chunks of the others. Keys and values are kept
+    // as their bytes, copied in and out, so they need no alignment or default constructor.
+    // The offset pointer makes slots move by assignment only.
+    struct SlotT
+    {
+        ValueChunkPtr valueChunk {nullptr};
+        size_t childCount {0};
+        char key[sizeof(Key)];
+        char firstValue[sizeof(Value)];
+    };
+
+    static constexpr size_t GROUP_SIZE {16};
+    static constexpr uint8_t EMPTY_TAG {0x80};
+    static constexpr uint8_t DELETED_TAG {0xFE};
+
+    // Tags of full slots have the high bit clear, so the free slots of a group are the
+    // high bits of its tags.
+    struct GroupT
+    {
+        GroupT()
+        {
+            std::fill(tags, tags + GROUP_SIZE, EMPTY_TAG);
+        }
+
+        GroupT(const GroupT&) = delete;
+        GroupT& operator =(const GroupT&) = delete;
+
+        uint8_t tags[GROUP_SIZE];
+        SlotT slots[GROUP_SIZE];
+    };
+
+    using GroupPtr = bipc::offset_ptr<GroupT>;
+
+    static constexpr size_t STRIPE_COUNT {1024};
+    static constexpr uint32_t FORMAT_VERSION {1};
+
+    using SequenceT = std::atomic<uint64_t>;
+
+    // Persistent map state. usedSlots counts live and deleted slots, the ones a lookup
+    // probes past. The sequences are seqlocks for readers in other processes as in the key
+    // node layout: a key's stripe is taken from its hash, so it does not depend on where
+    // the key sits, and layoutSequence covers the rebuilds of the slot array.
+    struct HeaderT
+    {
+        HeaderT(const size_t groups)
+            : groupCount(groups)
+        {}
+
+        HeaderT(const HeaderT&) = delete;
+        HeaderT& operator =(const HeaderT&) = delete;
+
+        const uint32_t formatVersion {FORMAT_VERSION};
+        size_t groupCount;
+        size_t usedSlots {0};
+        size_t keyCount {0};
+        size_t size {0};
+        GroupPtr groups {nullptr};
+        RecordArena records;
+        SequenceT layoutSequence {0};
+        SequenceT stripeSequences[STRIPE_COUNT] {};
+        std::atomic<bool> replaced {false};
+    };
+
+    // A slot found by a probe: the group holding it and its position in the group.
+    struct SlotRef
+    {
+        explicit operator bool() const
+        {
+            return group != nullptr;
+        }
+
+        SlotT& Slot() const
+        {
+            return group->slots[position];
+        }
+
+        uint8_t& Tag() const
+        {
+            return group->tags[position];
+        }
+
+        GroupT* group {nullptr};
+        size_t position {0};
+    };
+
+    using EncodedKeyT = decltype(KeyTraits::Encode(std::declval<const Key&>()));
+    using EncodedValueT = decltype(ValueTraits::Encode(std::declval<const Value&>()));
+
+    struct BatchEntryT
+    {
+        EncodedKeyT key;
+        EncodedValueT value;
+        size_t hash {0};
+    };
+
+    // How the lookup and iteration results shared with the key node layout read slots.
+    struct LayoutT
+    {
+        using MapT = Map;
+        using Node = SlotT;
+        using Chunk = ValueChunkT;
+        using key_view = typename KeyTraits::view_type;
+        using value_view = typename ValueTraits::view_type;
+
+        // An erased first value is replaced by the oldest chunk value, so a slot always has one.
+        static bool HasFirstValue(const SlotT&)
+        {
+            return true;
+        }
+
+        static value_view FirstValue(const SlotT& slot)
+        {
+            return ValueTraits::View(slot.firstValue, sizeof(Value));
+        }
+
+        // Positions are entry indexes.
+        static value_view ChunkValue(const ValueChunkT& chunk, const size_t index)
+        {
+            return ValueTraits::View(chunk.Entry(index), sizeof(Value));
+        }
+
+        static size_t NextPosition(const ValueChunkT&, const size_t index)
+        {
+            return index + 1;
+        }
+
+        static key_view KeyOf(const SlotT& slot)
+        {
+            return StoredKey(slot);
+        }
+
+        // The first full slot at slotIndex or after it, null past the last one.
+        static const SlotT* Seek(const Map& map, size_t& slotIndex)
+        {
+            const GroupT* groups = map.m_Header->groups.get();
+
+            for (const size_t slotCount = map.BucketCount(); slotIndex < slotCount; ++slotIndex)
+            {
+                const GroupT& group = groups[slotIndex / GROUP_SIZE];
+
+                if (IsFull(group.tags[slotIndex % GROUP_SIZE]))
+                {
+                    return &group.slots[slotIndex % GROUP_SIZE];
+                }
+            }
+            return nullptr;
+        }
+
+        static const SlotT* Next(const Map& map, size_t& slotIndex, const SlotT&)
+        {
+            return Seek(map, ++slotIndex);
+        }
+    };
+
+public:
+    using Base::GetSegmentManager;
+    using Base::Counters;
+
+    using key_type = Key;
+    using value_type = Value;
+    using key_view = typename KeyTraits::view_type;
+    using value_view = typename ValueTraits::view_type;
+
+    // Result of Find: a copy of the newest value of a key, or null if there is none.
+    using ValuePtr = MapValuePtr<value_view>;
+    // Values iterate through the chunks, then the slot's own value.
+    using ValueIterator = MapValueIterator<LayoutT>;
+    using ValueRange = MapValueRange<LayoutT>;
+    // Keys iterate in slot order.
+    using KeyIterator = MapKeyIterator<LayoutT>;
+    using iterator = KeyIterator;
+    using const_iterator = KeyIterator;
+
+    // bucketCount is the initial number of slots of a newly created file, rounded up to a
+    // power of two groups. An existing file keeps its slot array, whatever is passed.
+    Map(const char* filename, const size_t fileSize = DEFAULT_FILE_SIZE, const size_t bucketCount = DEFAULT_BUCKET_COUNT)
+        : Base(filename, std::max(fileSize, GroupCountFor(bucketCount) * sizeof(GroupT) + sizeof(HeaderT) + MAX_PAIR_SIZE * 10))
+    {
+        m_Header = GetSegmentManager()->template find_or_construct<HeaderT>("FlatHeader")(GroupCountFor(bucketCount));
+        CheckFormat(m_Header);
+
+        if (!m_Header->groups)
+        {
+            m_Header->groups = AllocateGroups(m_Header->groupCount);
+        }
+    }
+
+    // Opens an existing file without write access: lookups work, modifications throw.
+    Map(bipc::open_read_only_t, const char* filename, const PrewarmOptions& prewarm = PrewarmOptions())
+        : Base(bipc::open_read_only, filename, prewarm)
+    {
+        FindHeader("FlatHeader", m_Header);
+        Prewarm(prewarm);
+    }
+
+    Map(const Map&) = delete;
+    Map& operator =(const Map&) = delete;
+
+    Map(Map&& rhv)
+        : Base(std::move(rhv))
+        , m_Header(rhv.m_Header)
+        , m_KeyHasher(std::move(rhv.m_KeyHasher))
+        , m_KeyEqual(std::move(rhv.m_KeyEqual))
+    {}
+
+    Map& operator=(Map&& rhv)
+    {
+        Base::operator =(std::move(rhv));
+        m_Header = rhv.m_Header;
+        m_KeyHasher = std::move(rhv.m_KeyHasher);
+        m_KeyEqual = std::move(rhv.m_KeyEqual);
+        return *this;
+    }
+
+    template <typename ProvidedKeyT, typename ProvidedValueT>
+    void Insert(const ProvidedKeyT& key, const ProvidedValueT& value)
+    {
+        CheckWritable();
+        ReserveFreeMemory(MAX_PAIR_SIZE);
+
+        const auto keyBytes = KeyTraits::Encode(key);
+        const auto valueBytes = ValueTraits::Encode(value);
+        const auto& lookupKey = LookupParam<Key>(key);
+        const size_t keyHash = HashOf(lookupKey);
+        const SlotRef found = FindSlot(lookupKey, keyHash);
+
+        // Only a new key takes a slot, so only a new key may rebuild the slot array.
+        if (!found)
+        {
+            ReserveSlots(1);
+        }
+
+        WriteSection section(Stripe(keyHash));
+
+        if (found)
+        {
+            AppendValue(found.Slot(), valueBytes.data(), 1);
+        }
+        else
+        {
+            FillSlot(FreeSlot(m_Header->groups.get(), m_Header->groupCount, keyHash), keyHash, keyBytes.data(), valueBytes.data());
+        }
+
+        ++m_Header->size;
+        m_Counters.inserts.Add();
+    }
+
+    // Bulk load of (key, value) pairs. The slot array is rebuilt at most once, for the
+    // distinct new keys of the batch, and the values a batch adds to one key go to a
+    // single chunk.
+    template <typename Iterator>
+    void InsertBatch(Iterator first, Iterator last)
+    {
+        CheckWritable();
+
+        std::vector<BatchEntryT> batch;
+
+        for (; first != last; ++first)
+        {
+            BatchEntryT entry {KeyTraits::Encode(first->first), ValueTraits::Encode(first->second)};
+
+            entry.hash = HashOf(KeyTraits::View(entry.key.data(), sizeof(Key)));
+            batch.push_back(std::move(entry));
+        }
+
+        if (batch.empty())
+        {
+            return;
+        }
+
+        // Runs of one key keep the batch order, so its last value ends up the newest.
+        std::stable_sort(batch.begin(), batch.end(), [](const BatchEntryT& lhv, const BatchEntryT& rhv)
+        {
+            return std::tie(lhv.hash, lhv.key) < std::tie(rhv.hash, rhv.key);
+        });
+
+        size_t newKeys = 0;
+        size_t chunkBytes = MAX_PAIR_SIZE;
+
+        ForEachKeyRun(batch, [&](const auto run, const auto runEnd)
+        {
+            const bool newKey = !FindSlot(KeyTraits::View(run->key.data(), sizeof(Key)), run->hash);
+            const size_t chunkValues = (runEnd - run) - newKey;
+
+            newKeys += newKey;
+            chunkBytes += (chunkValues != 0) ? chunkValues * sizeof(Value) + sizeof(ValueChunkT) + ALLOCATION_OVERHEAD : 0;
+        });
+
+        ReserveFreeMemory(chunkBytes * 2);
+        ReserveSlots(newKeys);
+
+        ForEachKeyRun(batch, [&](auto run, const auto runEnd)
+        {
+            SlotRef slot = FindSlot(KeyTraits::View(run->key.data(), sizeof(Key)), run->hash);
+            WriteSection section(Stripe(run->hash));
+            const size_t values = runEnd - run;
+
+            if (!slot)
+            {
+                slot = FreeSlot(m_Header->groups.get(), m_Header->groupCount, run->hash);
+                FillSlot(slot, run->hash, run->key.data(), run->value.data());
+                ++run;
+            }
+
+            for (; run != runEnd; ++run)
+            {
+                AppendValue(slot.Slot(), run->value.data(), runEnd - run);
+            }
+
+            m_Header->size += values;
+            m_Counters.inserts.Add(values);
+        });
+    }
+
+    template <typename Range>
+    void InsertBatch(const Range& pairs)
+    {
+        InsertBatch(std::begin(pairs), std::end(pairs));
+    }
+
+    // Lookups and erases accept any key convertible to Key. Find, FindAll and Count read
+    // the mapping directly and assume no other process is writing to the file; Get, GetAll
+    // and GetMany can run while another process writes, as in the key node layout.
+    template <typename ProvidedKeyT>
+    ValuePtr Find(const ProvidedKeyT& key) const
+    {
+        ValueRange values = FindAll(key);
+
+        return (values.empty()) ? nullptr : ValuePtr(*values.begin());
+    }
+
+    template <typename ProvidedKeyT>
+    ValueRange FindAll(const ProvidedKeyT& key) const
+    {
+        const auto& lookupKey = LookupParam<Key>(key);
+        const SlotRef found = FindSlot(lookupKey, HashOf(lookupKey));
+
+        return (found) ? ValueRange(&found.Slot()) : ValueRange();
+    }
+
+    template <typename ProvidedKeyT>
+    std::optional<Value> Get(const ProvidedKeyT& key) const
+    {
+        std::optional<Value> value;
+
+        ReadShared(LookupParam<Key>(key), [&value]() { value.reset(); }, [&value](const value_view& stored)
+        {
+            value.emplace(stored);
+            return false;
+        });
+        return value;
+    }
+
+    template <typename ProvidedKeyT>
+    std::vector<Value> GetAll(const ProvidedKeyT& key) const
+    {
+        std::vector<Value> values;
+
+        ReadShared(LookupParam<Key>(key), [&values]() { values.clear(); }, [&values](const value_view& stored)
+        {
+            values.emplace_back(stored);
+            return true;
+        });
+        return values;
+    }
+
+    // Batch lookups: the first groups of PREFETCH_GROUP_SIZE keys are prefetched before
+    // any of them is probed.
+    template <typename Range>
+    std::vector<ValueRange> FindMany(const Range& keys) const
+    {
+        std::vector<ValueRange> results;
+        results.reserve(std::distance(std::begin(keys), std::end(keys)));
+
+        ForEachPrefetchedKey(keys, [&](const auto& key, const size_t keyHash)
+        {
+            const SlotRef found = FindSlot(LookupParam<Key>(key), keyHash);
+            results.push_back((found) ? ValueRange(&found.Slot()) : ValueRange());
+        });
+        return results;
+    }
+
+    template <typename Range>
+    std::vector<size_t> CountMany(const Range& keys) const
+    {
+        std::vector<size_t> counts;
+
+        for (const ValueRange& values : FindMany(keys))
+        {
+            counts.push_back(values.size());
+        }
+        return counts;
+    }
+
+    template <typename Range>
+    std::vector<std::vector<Value>> GetMany(const Range& keys) const
+    {
+        std::vector<std::vector<Value>> results;
+
+        ForEachPrefetchedKey(keys, [&](const auto& key, const size_t)
+        {
+            results.push_back(GetAll(key));
+        });
+        return results;
+    }
+
+    // Calls visit(key_view, ValueRange) for every key, in slot order. Like Find, assumes
+    // no other process writes to the file meanwhile.
+    template <typename Visitor>
+    void ForEach(Visitor visit) const
+    {
+        ForEachInRange(0, BucketCount(), visit);
+    }
+
+    // ForEach over the slots in [bucketBegin, bucketEnd) only, for threads walking disjoint
+    // ranges. Slots are read in order; the value chunks of a group's keys are prefetched
+    // before the first of them is visited.
+    template <typename Visitor>
+    void ForEachInRange(const size_t bucketBegin, size_t bucketEnd, Visitor visit) const
+    {
+        const GroupT* groups = m_Header->groups.get();
+
+        bucketEnd = std::min(bucketEnd, BucketCount());
+
+        for (size_t index = bucketBegin; index < bucketEnd;)
+        {
+            const GroupT& group = groups[index / GROUP_SIZE];
+            const size_t groupEnd = std::min((index / GROUP_SIZE + 1) * GROUP_SIZE, bucketEnd);
+
+            for (size_t position = index % GROUP_SIZE; position < GROUP_SIZE; ++position)
+            {
+                if (IsFull(group.tags[position]) && group.slots[position].valueChunk)
+                {
+                    __builtin_prefetch(group.slots[position].valueChunk.get());
+                }
+            }
+
+            for (; index < groupEnd; ++index)
+            {
+                const size_t position = index % GROUP_SIZE;
+
+                if (IsFull(group.tags[position]))
+                {
+                    visit(StoredKey(group.slots[position]), ValueRange(&group.slots[position]));
+                }
+            }
+        }
+    }
+
+    KeyIterator begin() const
+    {
+        return KeyIterator(this, 0);
+    }
+
+    KeyIterator end() const
+    {
+        return KeyIterator();
+    }
+
+    template <typename ProvidedKeyT>
+    size_t Erase(const ProvidedKeyT& key)
+    {
+        CheckWritable();
+
+        const auto& lookupKey = LookupParam<Key>(key);
+        const size_t keyHash = HashOf(lookupKey);
+        const SlotRef found = FindSlot(lookupKey, keyHash);
+
+        if (!found)
+        {
+            return 0ul;
+        }
+
+        WriteSection section(Stripe(keyHash));
+        const size_t erasedValues = found.Slot().childCount;
+
+        for (ValueChunkPtr chunk = found.Slot().valueChunk; chunk;)
+        {
+            ValueChunkPtr toBeDestroyed = chunk;
+
+            chunk = chunk->nextChunk;
+            DeallocateChunk(toBeDestroyed.get());
+        }
+
+        ReleaseSlot(found);
+        m_Header->size -= erasedValues;
+        m_Counters.erases.Add(erasedValues);
+        return erasedValues;
+    }
+
+    template <typename ProvidedKeyT, typename ProvidedValueT>
+    size_t Erase(const ProvidedKeyT& key, const ProvidedValueT& value)
+    {
+        CheckWritable();
+
+        const auto& lookupKey = LookupParam<Key>(key);
+        const auto& lookupValue = LookupParam<Value>(value);
+        const size_t keyHash = HashOf(lookupKey);
+        const SlotRef found = FindSlot(lookupKey, keyHash);
+
+        if (!found)
+        {
+            return 0ul;
+        }
+
+        WriteSection section(Stripe(keyHash));
+        SlotT& slot = found.Slot();
+        size_t erasedValues = 0ul;
+
+        for (ValueChunkPtr* chunk = &slot.valueChunk; *chunk;)
+        {
+            erasedValues += EraseFromChunk(**chunk, lookupValue);
+
+            if ((*chunk)->begin == (*chunk)->capacity)
+            {
+                ValueChunkPtr toBeDestroyed = *chunk;
+
+                *chunk = toBeDestroyed->nextChunk;
+                DeallocateChunk(toBeDestroyed.get());
+            }
+            else
+            {
+                chunk = &(*chunk)->nextChunk;
+            }
+        }
+
+        if (EqualTo()(ValueTraits::View(slot.firstValue, sizeof(Value)), lookupValue))
+        {
+            ++erasedValues;
+
+            if (erasedValues != slot.childCount)
+            {
+                TakeOldestChunkValue(slot);
+            }
+        }
+
+        if (erasedValues == slot.childCount)
+        {
+            ReleaseSlot(found);
+        }
+        else
+        {
+            slot.childCount -= erasedValues;
+        }
+
+        m_Header->size -= erasedValues;
+        m_Counters.erases.Add(erasedValues);
+        return erasedValues;
+    }
+
+    template <typename ProvidedKeyT>
+    size_t Count(const ProvidedKeyT& key) const
+    {
+        return FindAll(key).size();
+    }
+
+    // Makes sure at least bytes more can be stored without growing the file.
+    void Reserve(const size_t bytes)
+    {
+        CheckWritable();
+        ReserveFreeMemory(bytes);
+    }
+
+    // Rewrites the map into a new file with a slot array of up to half full, the values
+    // of each key in as few chunks as possible and no deleted slots, then renames it over
+    // this map's file, as Compact of the key node layout does.
+    void Compact(const size_t maxBytesPerSecond = 0)
+    {
+        CheckWritable();
+
+        const size_t groupCount = GroupCountFor(size_t(m_Header->keyCount / REBUILD_LOAD_FACTOR));
+        std::vector<size_t> chunkSizes;
+        size_t chunkBytes = 0;
+
+        ForEach([&chunkSizes](const key_view&, const ValueRange& values)
+        {
+            CompactChunkSizes(values.size() - 1, chunkSizes);
+        });
+
+        for (const size_t bytes : chunkSizes)
+        {
+            chunkBytes += bytes + ALLOCATION_OVERHEAD;
+        }
+
+        ReplaceFile([&](const char* compactFilename)
+        {
+            Map compacted(compactFilename, groupCount * sizeof(GroupT) + chunkBytes + chunkBytes / 8, groupCount * GROUP_SIZE);
+
+            compacted.Reserve(chunkBytes + MAX_PAIR_SIZE);
+            CopySlots(compacted, maxBytesPerSecond);
+        }, m_Header->replaced);
+    }
+
+    size_t Size() const
+    {
+        return m_Header->size;
+    }
+
+    bool Empty() const
+    {
+        return m_Header->size == 0;
+    }
+
+    size_t BucketCount() const
+    {
+        return m_Header->groupCount * GROUP_SIZE;
+    }
+
+    double LoadFactor() const
+    {
+        return double(m_Header->keyCount) / BucketCount();
+    }
+
+    // Samples every sampleStride-th group, split in ranges over threadCount threads. Each
+    // slot is a bucket of at most one key; probeLengths counts the groups the lookup of
+    // each sampled key probes. Assumes no other process writes meanwhile.
+    MapStats Stats(const size_t sampleStride = 1, const size_t threadCount = 1) const
+    {
+        const size_t stride = std::max<size_t>(sampleStride, 1);
+        const size_t samples = (m_Header->groupCount + stride - 1) / stride;
+        const size_t rangeCount = std::max<size_t>(std::min(threadCount, samples), 1);
+        std::vector<MapStats> ranges(rangeCount);
+        std::vector<std::thread> threads;
+
+        for (size_t range = 1; range < rangeCount; ++range)
+        {
+            threads.emplace_back([&, range]() { SampleGroups(samples * range / rangeCount, samples * (range + 1) / rangeCount, stride, ranges[range]); });
+        }
+
+        SampleGroups(0, samples / rangeCount, stride, ranges[0]);
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        MapStats stats;
+
+        for (const MapStats& range : ranges)
+        {
+            stats.sampledBuckets += range.sampledBuckets;
+            stats.sampledKeys += range.sampledKeys;
+            stats.emptyBuckets += range.emptyBuckets;
+            stats.maxChainLength = std::max(stats.maxChainLength, range.maxChainLength);
+            stats.maxValuesPerKey = std::max(stats.maxValuesPerKey, range.maxValuesPerKey);
+            AddHistogram(range.chainLengths, stats.chainLengths);
+            AddHistogram(range.valuesPerKey, stats.valuesPerKey);
+            AddHistogram(range.probeLengths, stats.probeLengths);
+        }
+
+        stats.keyCount = m_Header->keyCount;
+        stats.valueCount = m_Header->size;
+        stats.bucketCount = BucketCount();
+        stats.loadFactor = LoadFactor();
+        stats.segmentBytes = GetSegmentManager()->get_size();
+        stats.freeBytes = GetSegmentManager()->get_free_memory();
+        stats.recordFreeBytes = m_Header->records.FreeBytes();
+        stats.counters = Counters();
+        return stats;
+    }
+
+private:
+    static bool IsFull(const uint8_t tag)
+    {
+        return (tag & EMPTY_TAG) == 0;
+    }
+
+    // Bit i is set if tag i of the group equals tag.
+    static uint32_t MatchTags(const uint8_t* tags, const uint8_t tag)
+    {
+#ifdef __SSE2__
+        const __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(static_cast<char>(tag)))));
+#else
+        uint32_t matches = 0;
+
+        for (size_t position = 0; position < GROUP_SIZE; ++position)
+        {
+            matches |= uint32_t(tags[position] == tag) << position;
+        }
+        return matches;
+#endif
+    }
+
+    // Bit i is set if slot i of the group is empty or deleted.
+    static uint32_t MatchFree(const uint8_t* tags)
+    {
+#ifdef __SSE2__
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tags))));
+#else
+        uint32_t matches = 0;
+
+        for (size_t position = 0; position < GROUP_SIZE; ++position)
+        {
+            matches |= uint32_t(!IsFull(tags[position])) << position;
+        }
+        return matches;
+#endif
+    }
+
+    // Integer keys mostly hash to themselves, so the hash is mixed before its low 7 bits
+    // become the tag and the others pick the first group.
+    template <typename LookupKeyT>
+    size_t HashOf(const LookupKeyT& key) const
+    {
+        uint64_t hash = m_KeyHasher(key);
+
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    static uint8_t TagOf(const size_t keyHash)
+    {
+        return keyHash & 0x7F;
+    }
+
+    static size_t FirstGroup(const size_t keyHash, const size_t groupCount)
+    {
+        return (keyHash >> 7) & (groupCount - 1);
+    }
+
+    // Triangular probing: the n-th group probed is n * (n + 1) / 2 groups after the first,
+    // which visits every group of a power of two count once.
+    static size_t NextGroup(const size_t group, const size_t step, const size_t groupCount)
+    {
+        return (group + step + 1) & (groupCount - 1);
+    }
+
+    static size_t GroupCountFor(const size_t slots)
+    {
+        size_t groupCount = 1;
+
+        while (groupCount * GROUP_SIZE < slots)
+        {
+            groupCount *= 2;
+        }
+        return groupCount;
+    }
+
+    template <typename LookupKeyT>
+    SlotRef FindSlot(const LookupKeyT& key, const size_t keyHash) const
+    {
+        GroupT* groups = m_Header->groups.get();
+        const size_t groupCount = m_Header->groupCount;
+        const uint8_t tag = TagOf(keyHash);
+        size_t group = FirstGroup(keyHash, groupCount);
+        SlotRef found;
+        size_t step = 0;
+
+        for (; step < groupCount; group = NextGroup(group, step++, groupCount))
+        {
+            const uint8_t* tags = groups[group].tags;
+
+            for (uint32_t matches = MatchTags(tags, tag); matches != 0; matches &= matches - 1)
+            {
+                const size_t position = __builtin_ctz(matches);
+
+                if (m_KeyEqual(StoredKey(groups[group].slots[position]), key))
+                {
+                    found = SlotRef {&groups[group], position};
+                    break;
+                }
+            }
+
+            if (found || MatchTags(tags, EMPTY_TAG) != 0)
+            {
+                ++step;
+                break;
+            }
+        }
+
+        m_Counters.lookups.Add();
+        m_Counters.chainSteps.Add(step);
+        return found;
+    }
+
+    // The first free slot on the probe sequence of a key that is not in the map.
+    static SlotRef FreeSlot(GroupT* groups, const size_t groupCount, const size_t keyHash)
+    {
+        size_t group = FirstGroup(keyHash, groupCount);
+
+        for (size_t step = 0;; group = NextGroup(group, step++, groupCount))
+        {
+            const uint32_t free = MatchFree(groups[group].tags);
+
+            if (free != 0)
+            {
+                return SlotRef {&groups[group], size_t(__builtin_ctz(free))};
+            }
+        }
+    }
+
+    // Writes a new key with its first value into a free slot; the tag goes last, so that
+    // readers never see a tag with a half written key.
+    void FillSlot(const SlotRef free, const size_t keyHash, const char* key, const char* value)
+    {
+        SlotT& slot = free.Slot();
+
+        slot.valueChunk = nullptr;
+        slot.childCount = 1;
+        std::memcpy(slot.key, key, sizeof(Key));
+        std::memcpy(slot.firstValue, value, sizeof(Value));
+
+        m_Header->usedSlots += free.Tag() == EMPTY_TAG;
+        ++m_Header->keyCount;
+        std::atomic_thread_fence(std::memory_order_release);
+        free.Tag() = TagOf(keyHash);
+    }
+
+    // A group with an empty slot ends every probe sequence that reaches it, so a slot freed
+    // there can be empty again; elsewhere it stays deleted for the lookups passing through.
+    void ReleaseSlot(const SlotRef slot)
+    {
+        if (MatchTags(slot.group->tags, EMPTY_TAG) != 0)
+        {
+            slot.Tag() = EMPTY_TAG;
+            --m_Header->usedSlots;
+        }
+        else
+        {
+            slot.Tag() = DELETED_TAG;
+        }
+        --m_Header->keyCount;
+    }
+
+    // Rebuilds the slot array if newKeys more keys would pass MAX_LOAD_FACTOR, with twice
+    // the groups as long as the keys would fill more than REBUILD_LOAD_FACTOR of them.
+    void ReserveSlots(const size_t newKeys)
+    {
+        if (double(m_Header->usedSlots + newKeys) <= BucketCount() * MAX_LOAD_FACTOR)
+        {
+            return;
+        }
+
+        size_t groupCount = m_Header->groupCount;
+
+        while (double(m_Header->keyCount + newKeys) > groupCount * GROUP_SIZE * REBUILD_LOAD_FACTOR)
+        {
+            groupCount *= 2;
+        }
+
+        Rebuild(groupCount);
+    }
+
+    // Readers keep probing the old array until the layout section switches to the new one.
+    void Rebuild(const size_t groupCount)
+    {
+        ReserveFreeMemory(groupCount * sizeof(GroupT) + MAX_PAIR_SIZE);
+
+        GroupPtr groups = AllocateGroups(groupCount);
+        GroupPtr oldGroups = m_Header->groups;
+        const size_t oldGroupCount = m_Header->groupCount;
+
+        for (size_t group = 0; group < oldGroupCount; ++group)
+        {
+            for (size_t position = 0; position < GROUP_SIZE; ++position)
+            {
+                if (IsFull(oldGroups[group].tags[position]))
+                {
+                    const SlotT& slot = oldGroups[group].slots[position];
+                    const size_t keyHash = HashOf(StoredKey(slot));
+                    const SlotRef free = FreeSlot(groups.get(), groupCount, keyHash);
+
+                    free.Slot().valueChunk = slot.valueChunk;
+                    free.Slot().childCount = slot.childCount;
+                    std::memcpy(free.Slot().key, slot.key, sizeof(Key));
+                    std::memcpy(free.Slot().firstValue, slot.firstValue, sizeof(Value));
+                    free.Tag() = TagOf(keyHash);
+                }
+            }
+        }
+
+        {
+            WriteSection layoutSection(m_Header->layoutSequence);
+
+            m_Header->groups = groups;
+            m_Header->groupCount = groupCount;
+            m_Header->usedSlots = m_Header->keyCount;
+        }
+
+        GetSegmentManager()->deallocate(oldGroups.get());
+    }
+
+    // The arrays freed by earlier rebuilds are too small for the next one, so free memory
+    // may be plenty but scattered; the file then grows by a whole array.
+    GroupPtr AllocateGroups(const size_t groupCount)
+    {
+        const size_t bytes = groupCount * sizeof(GroupT);
+        GroupT* groups = static_cast<GroupT*>(GetSegmentManager()->allocate(bytes, std::nothrow));
+
+        if (!groups)
+        {
+            GrowFile(bytes + MAX_PAIR_SIZE);
+            groups = static_cast<GroupT*>(GetSegmentManager()->allocate(bytes));
+        }
+
+        std::uninitialized_default_construct_n(groups, groupCount);
+        return groups;
+    }
+
+    // Appends a value to a key's chunks; a new chunk fits up to expectedValues values, those
+    // a batch is about to add.
+    void AppendValue(SlotT& slot, const char* value, const size_t expectedValues)
+    {
+        ValueChunkT* chunk = slot.valueChunk.get();
+
+        if (!chunk || chunk->begin == 0)
+        {
+            chunk = AllocateValueChunk(slot.valueChunk, std::min(expectedValues, MAX_CHUNK_VALUES));
+        }
+
+        std::memcpy(chunk->Entry(--chunk->begin), value, sizeof(Value));
+        ++slot.childCount;
+    }
+
+    // A key's first chunk fits the values needed, later ones double the previous one, up
+    // to MAX_CHUNK_VALUES or the free memory left, as in the key node layout.
+    ValueChunkT* AllocateValueChunk(ValueChunkPtr& head, const size_t values)
+    {
+        size_t capacity = (head) ? std::max(values, std::min<size_t>(head->capacity * 2, MAX_CHUNK_VALUES)) : values;
+
+        if (GetSegmentManager()->get_free_memory() < sizeof(ValueChunkT) + capacity * sizeof(Value) + ALLOCATION_OVERHEAD)
+        {
+            capacity = values;
+        }
+
+        ValueChunkT* chunk = NewChunk(m_Header->records, capacity);
+        chunk->nextChunk = head;
+        head = chunk;
+        return chunk;
+    }
+
+    // A chunk for at least values values, taking up the slack of its size class.
+    ValueChunkT* NewChunk(RecordArena& records, const size_t values) const
+    {
+        const size_t recordSize = RecordArena::RoundUp(sizeof(ValueChunkT) + values * sizeof(Value));
+        void* record = records.Allocate(GetSegmentManager(), recordSize);
+
+        return new (record) ValueChunkT(static_cast<uint32_t>((recordSize - sizeof(ValueChunkT)) / sizeof(Value)));
+    }
+
+    void DeallocateChunk(ValueChunkT* chunk)
+    {
+        m_Header->records.Deallocate(GetSegmentManager(), chunk, RecordArena::RoundUp(sizeof(ValueChunkT) + chunk->capacity * sizeof(Value)));
+    }
+
+    // Removes the chunk's entries equal to value and moves the remaining ones, in order,
+    // back against the end of the chunk. Returns the number of entries removed.
+    template <typename LookupValueT>
+    size_t EraseFromChunk(ValueChunkT& chunk, const LookupValueT& value)
+    {
+        uint32_t end = chunk.capacity;
+        size_t erasedValues = 0;
+
+        for (uint32_t index = chunk.capacity; index-- > chunk.begin;)
+        {
+            if (EqualTo()(ValueTraits::View(chunk.Entry(index), sizeof(Value)), value))
+            {
+                ++erasedValues;
+            }
+            else if (--end != index)
+            {
+                std::memcpy(chunk.Entry(end), chunk.Entry(index), sizeof(Value));
+            }
+        }
+
+        chunk.begin = end;
+        return erasedValues;
+    }
+
+    // Replaces an erased first value with the oldest chunk value, the last entry of the
+    // last chunk, so the slot's value stays the oldest one.
+    void TakeOldestChunkValue(SlotT& slot)
+    {
+        ValueChunkPtr* last = &slot.valueChunk;
+
+        while ((*last)->nextChunk)
+        {
+            last = &(*last)->nextChunk;
+        }
+
+        ValueChunkT& chunk = **last;
+
+        std::memcpy(slot.firstValue, chunk.Entry(chunk.capacity - 1), sizeof(Value));
+        std::memmove(chunk.Entry(chunk.begin + 1), chunk.Entry(chunk.begin), (chunk.capacity - 1 - chunk.begin) * sizeof(Value));
+
+        if (++chunk.begin == chunk.capacity)
+        {
+            ValueChunkT* toBeDestroyed = last->get();
+
+            *last = nullptr;
+            DeallocateChunk(toBeDestroyed);
+        }
+    }
+
+    // Calls visit(key, hash) for every key, after prefetching the first groups of the next
+    // PREFETCH_GROUP_SIZE keys. The layout is read without synchronization: a prefetch is a
+    // hint only and never faults.
+    template <typename Range, typename Visitor>
+    void ForEachPrefetchedKey(const Range& keys, Visitor visit) const
+    {
+        size_t hashes[PREFETCH_GROUP_SIZE];
+
+        for (auto group = std::begin(keys), last = std::end(keys); group != last;)
+        {
+            const GroupT* groups = m_Header->groups.get();
+            const size_t groupCount = m_Header->groupCount;
+            auto key = group;
+            size_t count = 0;
+
+            for (; key != last && count < PREFETCH_GROUP_SIZE; ++key, ++count)
+            {
+                hashes[count] = HashOf(LookupParam<Key>(*key));
+                __builtin_prefetch(groups + FirstGroup(hashes[count], groupCount));
+            }
+
+            for (size_t index = 0; group != key; ++group, ++index)
+            {
+                visit(*group, hashes[index]);
+            }
+        }
+    }
+
+    template <typename Runs, typename Visitor>
+    void ForEachKeyRun(Runs& batch, Visitor visit)
+    {
+        for (auto run = batch.begin(); run != batch.end();)
+        {
+            auto runEnd = run + 1;
+
+            while (runEnd != batch.end() && runEnd->hash == run->hash && runEnd->key == run->key)
+            {
+                ++runEnd;
+            }
+
+            visit(run, runEnd);
+            run = runEnd;
+        }
+    }
+
+    // Adds the groups in [first, last) of the samples to stats, the sample-th being group
+    // sample * stride.
+    void SampleGroups(const size_t first, const size_t last, const size_t stride, MapStats& stats) const
+    {
+        const GroupT* groups = m_Header->groups.get();
+        const size_t groupCount = m_Header->groupCount;
+
+        for (size_t sample = first; sample < last; ++sample)
+        {
+            const size_t group = sample * stride;
+
+            for (size_t position = 0; position < GROUP_SIZE; ++position)
+            {
+                const bool full = IsFull(groups[group].tags[position]);
+
+                AddToHistogram(full, stats.chainLengths);
+                stats.emptyBuckets += !full;
+                ++stats.sampledBuckets;
+
+                if (!full)
+                {
+                    continue;
+                }
+
+                const size_t values = groups[group].slots[position].childCount;
+                size_t magnitude = 0;
+                size_t probes = 1;
+
+                while ((values >> (magnitude + 1)) != 0)
+                {
+                    ++magnitude;
+                }
+
+                for (size_t probe = FirstGroup(HashOf(StoredKey(groups[group].slots[position])), groupCount);
+                     probe != group && probes < groupCount; probe = NextGroup(probe, probes++ - 1, groupCount))
+                {}
+
+                AddToHistogram(magnitude, stats.valuesPerKey);
+                AddToHistogram(probes, stats.probeLengths);
+                stats.maxValuesPerKey = std::max(stats.maxValuesPerKey, values);
+                stats.maxChainLength = 1;
+                ++stats.sampledKeys;
+            }
+        }
+    }
+
+    // The chunk records Compact builds for a key's values after the first, appended to sizes.
+    static void CompactChunkSizes(size_t values, std::vector<size_t>& sizes)
+    {
+        for (; values != 0; values -= std::min(values, MAX_CHUNK_VALUES))
+        {
+            sizes.push_back(RecordArena::RoundUp(sizeof(ValueChunkT) + std::min(values, MAX_CHUNK_VALUES) * sizeof(Value)));
+        }
+    }
+
+    // Fills an empty map in slot order. The values of COMPACT_GROUP_KEYS keys after their
+    // first go to one block, each key's packed into full chunks of up to MAX_CHUNK_VALUES,
+    // newest first.
+    void CopySlots(Map& target, const size_t maxBytesPerSecond) const
+    {
+        const auto started = std::chrono::steady_clock::now();
+        const GroupT* groups = m_Header->groups.get();
+        std::vector<const SlotT*> slots;
+        std::vector<size_t> recordSizes;
+        std::vector<void*> records;
+        size_t copiedBytes = 0;
+
+        auto copyGroup = [&]()
+        {
+            recordSizes.clear();
+
+            for (const SlotT* slot : slots)
+            {
+                CompactChunkSizes(slot->childCount - 1, recordSizes);
+            }
+
+            target.m_Header->records.AllocateContiguous(target.GetSegmentManager(), recordSizes, records);
+            auto record = records.begin();
+
+            for (const SlotT* slot : slots)
+            {
+                const size_t keyHash = HashOf(StoredKey(*slot));
+                const SlotRef free = FreeSlot(target.m_Header->groups.get(), target.m_Header->groupCount, keyHash);
+                ValueChunkPtr* chunkLink = &free.Slot().valueChunk;
+                ValueIterator value(slot);
+
+                target.FillSlot(free, keyHash, slot->key, slot->firstValue);
+
+                for (size_t remaining = slot->childCount - 1; remaining != 0; ++record)
+                {
+                    const size_t count = std::min(remaining, MAX_CHUNK_VALUES);
+                    const size_t recordSize = RecordArena::RoundUp(sizeof(ValueChunkT) + count * sizeof(Value));
+                    ValueChunkT* chunk = new (*record) ValueChunkT(static_cast<uint32_t>((recordSize - sizeof(ValueChunkT)) / sizeof(Value)));
+
+                    chunk->begin = static_cast<uint32_t>(chunk->capacity - count);
+
+                    for (size_t index = chunk->begin; index < chunk->capacity; ++index, ++value)
+                    {
+                        const Value copied = *value;
+                        std::memcpy(chunk->Entry(index), &copied, sizeof(Value));
+                    }
+
+                    *chunkLink = chunk;
+                    chunkLink = &chunk->nextChunk;
+                    remaining -= count;
+                    copiedBytes += recordSize;
+                }
+
+                free.Slot().childCount = slot->childCount;
+                copiedBytes += sizeof(SlotT);
+            }
+
+            slots.clear();
+
+            if (maxBytesPerSecond != 0)
+            {
+                std::this_thread::sleep_until(started + std::chrono::microseconds(copiedBytes * 1000000 / maxBytesPerSecond));
+            }
+        };
+
+        for (size_t group = 0; group < m_Header->groupCount; ++group)
+        {
+            for (size_t position = 0; position < GROUP_SIZE; ++position)
+            {
+                if (IsFull(groups[group].tags[position]))
+                {
+                    slots.push_back(&groups[group].slots[position]);
+                }
+            }
+
+            if (slots.size() >= COMPACT_GROUP_KEYS || group + 1 == m_Header->groupCount)
+            {
+                copyGroup();
+            }
+        }
+
+        target.m_Header->size = m_Header->size;
+    }
+
+    // Called after the mapping had to move: the header address is stale.
+    void OnMappingMoved() const
+    {
+        FindHeader("FlatHeader", m_Header);
+    }
+
+    // For PrewarmOptions::willNeedBuckets.
+    void AdviseBuckets() const
+    {
+        m_MappedFile->Advise(m_Header->groups.get(), m_Header->groupCount * sizeof(GroupT), MADV_WILLNEED);
+    }
+
+    static key_view StoredKey(const SlotT& slot)
+    {
+        return KeyTraits::View(slot.key, sizeof(Key));
+    }
+
+    // Accepts a key hash, which stays with the key when the slot array is rebuilt.
+    SequenceT& Stripe(const size_t keyHash) const
+    {
+        return m_Header->stripeSequences[(keyHash >> 7) % STRIPE_COUNT];
+    }
+
+    // Probes for the key's values until a probe ran on a state of the stripe and of the
+    // layout that no write overlapped, calling restart() before every probe and
+    // visit(value_view), which returns false to stop early, for the values, newest first.
+    // A probe that gets retried may have visited garbage, so visit must only copy data out.
+    template <typename LookupKeyT, typename Restart, typename Visitor>
+    void ReadShared(const LookupKeyT& key, Restart restart, Visitor visit) const
+    {
+        const size_t keyHash = HashOf(key);
+
+        if (m_Header->replaced.load(std::memory_order_acquire))
+        {
+            Reopen();
+        }
+
+        m_Counters.lookups.Add();
+
+        for (;;)
+        {
+            SequenceT& sequence = Stripe(keyHash);
+            const uint64_t before = sequence.load(std::memory_order_acquire);
+
+            if (before % 2 == 0)
+            {
+                uint64_t layout;
+
+                restart();
+                const bool inBounds = WalkShared(key, keyHash, sequence, before, layout, visit);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+
+                if (sequence.load(std::memory_order_relaxed) == before &&
+                    m_Header->layoutSequence.load(std::memory_order_relaxed) == layout)
+                {
+                    if (inBounds)
+                    {
+                        return;
+                    }
+
+                    if (!RemapIfGrown())
+                    {
+                        throw bipc::interprocess_exception("Map file is corrupted");
+                    }
+                    continue;
+                }
+            }
+
+            std::this_thread::yield();
+            RemapIfGrown();
+        }
+    }
+
+    // FindSlot and ValueIterator for readers racing with a writer. The slot array and every
+    // chunk are bounds checked with the sizes read once, and probing stops after every
+    // group was probed or as soon as the stripe changes. Returns false if a pointer led
+    // outside the mapping; layout is the even layout sequence the probe ran on.
+    template <typename LookupKeyT, typename Visitor>
+    bool WalkShared(const LookupKeyT& key, const size_t keyHash, const SequenceT& sequence, const uint64_t before,
+                    uint64_t& layout, Visitor& visit) const
+    {
+        const GroupT* groups;
+        size_t groupCount;
+
+        do
+        {
+            while ((layout = m_Header->layoutSequence.load(std::memory_order_acquire)) % 2 != 0)
+            {
+                std::this_thread::yield();
+            }
+
+            groups = m_Header->groups.get();
+            groupCount = m_Header->groupCount;
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while (m_Header->layoutSequence.load(std::memory_order_relaxed) != layout);
+
+        if (groupCount == 0 || (groupCount & (groupCount - 1)) != 0 || groupCount > m_MappedSize / sizeof(GroupT) ||
+            !InBounds(groups, groupCount * sizeof(GroupT)))
+        {
+            return false;
+        }
+
+        const uint8_t tag = TagOf(keyHash);
+        size_t group = FirstGroup(keyHash, groupCount);
+
+        for (size_t step = 0; step < groupCount; group = NextGroup(group, step++, groupCount))
+        {
+            if (sequence.load(std::memory_order_relaxed) != before)
+            {
+                return true;
+            }
+
+            m_Counters.chainSteps.Add();
+
+            const uint32_t matches = MatchTags(groups[group].tags, tag);
+            const uint32_t empty = MatchTags(groups[group].tags, EMPTY_TAG);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            for (uint32_t match = matches; match != 0; match &= match - 1)
+            {
+                const SlotT& slot = groups[group].slots[__builtin_ctz(match)];
+
+                if (!m_KeyEqual(StoredKey(slot), key))
+                {
+                    continue;
+                }
+
+                for (const ValueChunkT* chunk = slot.valueChunk.get(); chunk; chunk = chunk->nextChunk.get())
+                {
+                    if (sequence.load(std::memory_order_relaxed) != before)
+                    {
+                        return true;
+                    }
+
+                    if (!InBounds(chunk, sizeof(ValueChunkT)))
+                    {
+                        return false;
+                    }
+
+                    const size_t capacity = chunk->capacity;
+
+                    if (!InBounds(chunk, sizeof(ValueChunkT) + capacity * sizeof(Value)))
+                    {
+                        return false;
+                    }
+
+                    for (size_t index = chunk->begin; index < capacity; ++index)
+                    {
+                        if (!visit(ValueTraits::View(chunk->Entry(index), sizeof(Value))))
+                        {
+                            return true;
+                        }
+                    }
+                }
+
+                visit(ValueTraits::View(slot.firstValue, sizeof(Value)));
+                return true;
+            }
+
+            if (empty != 0)
+            {
+                return true;
+            }
+        }
+        return true;
+    }
+
+public:
+    static constexpr size_t DEFAULT_FILE_SIZE {16 * 1024 * 1024ul};
+    static constexpr size_t DEFAULT_BUCKET_COUNT {64 * 1024ul};
+    static constexpr size_t MAX_VALUE_CHUNK_SIZE {64 * 1024};
+    static constexpr size_t MAX_CHUNK_VALUES {std::max<size_t>(MAX_VALUE_CHUNK_SIZE / sizeof(Value), 1)};
+    static constexpr size_t MAX_PAIR_SIZE {RecordArena::MAX_SLAB_SIZE + sizeof(ValueChunkT) + MAX_VALUE_CHUNK_SIZE};
+    static constexpr double MAX_LOAD_FACTOR {0.875};
+    static constexpr double REBUILD_LOAD_FACTOR {0.5};
+    static constexpr size_t ALLOCATION_OVERHEAD {32};
+    static constexpr size_t PREFETCH_GROUP_SIZE {16};
+    static constexpr size_t COMPACT_GROUP_KEYS {4096};
+
+private:
+    // Readers remap the file from const lookups once the writer has grown it.
+    mutable HeaderT* m_Header;
+    KeyHash m_KeyHasher;
+    KeyEqual m_KeyEqual;
+};
+} //HardDriveContainers
@@ -0,0 +1,411 @@
+#pragma once
+
+#include "container.h"
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace HardDriveContainers
+{
+
+// An immutable snapshot of a Map, for indexes that only change at scan time. The file is
+// the records of all keys, each its key and all its values in one length-prefixed run,
+// followed by an array of (hash, record offset) entries sorted by hash. Hashes are close
+// to uniform between the smallest and the largest, whether they are string hashes or
+// dense integer keys, so a lookup interpolates its entry's position and mostly touches one
+// page of the array and the page of the record, all read in place from a read-only mapping.
+// There is no allocator and no bucket array, so the file is about the size of the data.
+template <class Key,
+         class Value,
+         class KeyHash = Hash,
+         class KeyEqual = EqualTo>
+class FrozenMap
+{
+private:
+    using KeyTraits = RecordTraits<Key>;
+    using ValueTraits = RecordTraits<Value>;
+
+    struct HeaderT
+    {
+        char magic[8];
+        uint32_t formatVersion;
+        uint32_t reserved;
+        uint64_t keyCount;
+        uint64_t valueCount;
+        uint64_t entriesOffset;
+    };
+
+    struct EntryT
+    {
+        uint64_t hash;
+        uint64_t recordOffset;
+    };
+
+    // A record: key size and value count, the key bytes, then every value as its size
+    // followed by its bytes, newest first as in the Map. Fields are unaligned.
+    struct RecordHeaderT
+    {
+        uint32_t keySize;
+        uint32_t valueCount;
+    };
+
+    static constexpr char MAGIC[8] {'H', 'D', 'M', 'F', 'R', 'O', 'Z', 'N'};
+    static constexpr uint32_t FORMAT_VERSION {1};
+    static constexpr size_t VALUE_HEADER_SIZE {sizeof(uint32_t)};
+
+public:
+    using key_type = Key;
+    using value_type = Value;
+    using value_view = typename ValueTraits::view_type;
+
+    // Iterates the values of one key, newest first.
+    class ValueIterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = value_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_view*;
+        using reference = value_view;
+
+        ValueIterator()
+        {}
+
+        ValueIterator(const char* entry, const uint32_t remaining)
+            : m_Entry(entry)
+            , m_Remaining(remaining)
+        {}
+
+        value_view operator *() const
+        {
+            return ValueTraits::View(m_Entry + VALUE_HEADER_SIZE, ValueSize());
+        }
+
+        ValueIterator& operator ++()
+        {
+            m_Entry += VALUE_HEADER_SIZE + ValueSize();
+
+            if (--m_Remaining == 0)
+            {
+                m_Entry = nullptr;
+            }
+            return *this;
+        }
+
+        ValueIterator operator ++(int)
+        {
+            ValueIterator previous = *this;
+            ++(*this);
+            return previous;
+        }
+
+        bool operator ==(const ValueIterator& rhv) const
+        {
+            return m_Entry == rhv.m_Entry;
+        }
+
+        bool operator !=(const ValueIterator& rhv) const
+        {
+            return !(*this == rhv);
+        }
+
+    private:
+        uint32_t ValueSize() const
+        {
+            uint32_t size;
+            std::memcpy(&size, m_Entry, sizeof(size));
+            return size;
+        }
+
+        const char* m_Entry {nullptr};
+        uint32_t m_Remaining {0};
+    };
+
+    // Result of FindAll: all values of a key, viewed in the mapping.
+    class ValueRange
+    {
+    public:
+        ValueRange()
+        {}
+
+        ValueRange(const char* firstValue, const uint32_t count)
+            : m_FirstValue(firstValue)
+            , m_Count(count)
+        {}
+
+        ValueIterator begin() const
+        {
+            return (m_Count != 0) ? ValueIterator(m_FirstValue, m_Count) : ValueIterator();
+        }
+
+        ValueIterator end() const
+        {
+            return ValueIterator();
+        }
+
+        size_t size() const
+        {
+            return m_Count;
+        }
+
+        bool empty() const
+        {
+            return m_Count == 0;
+        }
+
+    private:
+        const char* m_FirstValue {nullptr};
+        uint32_t m_Count {0};
+    };
+
+    explicit FrozenMap(const char* filename)
+        : m_File(filename, bipc::read_only)
+        , m_Region(m_File, bipc::read_only)
+    {
+        const char* data = static_cast<const char*>(m_Region.get_address());
+        const size_t fileSize = m_Region.get_size();
+
+        if (fileSize < sizeof(HeaderT))
+        {
+            throw bipc::interprocess_exception("Snapshot file is corrupted");
+        }
+
+        std::memcpy(&m_Header, data, sizeof(HeaderT));
+
+        if (std::memcmp(m_Header.magic, MAGIC, sizeof(MAGIC)) != 0 || m_Header.formatVersion != FORMAT_VERSION)
+        {
+            throw bipc::interprocess_exception("Unsupported snapshot file format");
+        }
+
+        if (m_Header.entriesOffset % alignof(EntryT) != 0 || m_Header.entriesOffset < sizeof(HeaderT) || m_Header.entriesOffset > fileSize ||
+            (fileSize - m_Header.entriesOffset) / sizeof(EntryT) < m_Header.keyCount)
+        {
+            throw bipc::interprocess_exception("Snapshot file is corrupted");
+        }
+
+        m_Data = data;
+        m_Entries = reinterpret_cast<const EntryT*>(data + m_Header.entriesOffset);
+        m_Region.advise(bipc::mapped_region::advice_random);
+    }
+
+    FrozenMap(const FrozenMap&) = delete;
+    FrozenMap& operator =(const FrozenMap&) = delete;
+
+    // Writes a snapshot of map, which no other process may write to meanwhile. The file
+    // is written under a temporary name, synced and renamed, so readers of an older
+    // snapshot keep it until they reopen, and a crash leaves either snapshot whole.
+    template <class MapT>
+    static void Write(const MapT& map, const std::string& filename)
+    {
+        const std::string temporaryFilename = filename + ".tmp";
+        std::ofstream output(temporaryFilename, std::ios::binary | std::ios::trunc);
+        std::vector<EntryT> entries;
+        HeaderT header {};
+        uint64_t offset = sizeof(HeaderT);
+
+        entries.reserve(map.BucketCount());
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        map.ForEach([&](const auto& key, const auto& values)
+        {
+            const auto keyBytes = KeyTraits::Encode(key);
+            const RecordHeaderT record {RecordSize(keyBytes.size()), RecordSize(values.size())};
+
+            entries.push_back(EntryT {KeyHash()(key), offset});
+            output.write(reinterpret_cast<const char*>(&record), sizeof(record));
+            output.write(keyBytes.data(), keyBytes.size());
+            offset += sizeof(record) + keyBytes.size();
+
+            for (const auto& value : values)
+            {
+                const auto valueBytes = ValueTraits::Encode(value);
+                const uint32_t valueSize = RecordSize(valueBytes.size());
+
+                output.write(reinterpret_cast<const char*>(&valueSize), sizeof(valueSize));
+                output.write(valueBytes.data(), valueBytes.size());
+                offset += sizeof(valueSize) + valueBytes.size();
+            }
+
+            header.valueCount += record.valueCount;
+        });
+
+        std::sort(entries.begin(), entries.end(), [](const EntryT& lhv, const EntryT& rhv) { return lhv.hash < rhv.hash; });
+
+        const char padding[alignof(EntryT)] {};
+        const size_t paddingSize = (alignof(EntryT) - offset % alignof(EntryT)) % alignof(EntryT);
+
+        output.write(padding, paddingSize);
+        output.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(EntryT));
+
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.formatVersion = FORMAT_VERSION;
+        header.keyCount = entries.size();
+        header.entriesOffset = offset + paddingSize;
+
+        output.seekp(0);
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        output.close();
+
+        if (!output || !SyncPath(temporaryFilename) || std::rename(temporaryFilename.c_str(), filename.c_str()) != 0)
+        {
+            std::remove(temporaryFilename.c_str());
+            throw bipc::interprocess_exception(("Can't write snapshot " + filename).c_str());
+        }
+
+        // The rename itself is only durable once the directory is.
+        if (!SyncPath(DirectoryOf(filename)))
+        {
+            throw bipc::interprocess_exception(("Can't sync the directory of snapshot " + filename).c_str());
+        }
+    }
+
+    static std::string FilenameFor(const std::string& mapFile)
+    {
+        return mapFile + ".frozen";
+    }
+
+    // Throws if the entry of a key with the hash of key points outside the records, or
+    // its key runs past them.
+    template <typename ProvidedKeyT>
+    ValueRange FindAll(const ProvidedKeyT& key) const
+    {
+        const auto& lookupKey = LookupParam<Key>(key);
+        const uint64_t hash = m_KeyHasher(lookupKey);
+        const EntryT* const last = m_Entries + m_Header.keyCount;
+
+        for (const EntryT* entry = LowerBound(hash); entry != last && entry->hash == hash; ++entry)
+        {
+            if (entry->recordOffset < sizeof(HeaderT) || entry->recordOffset > m_Header.entriesOffset - sizeof(RecordHeaderT))
+            {
+                throw bipc::interprocess_exception("Snapshot file is corrupted");
+            }
+
+            const char* record = m_Data + entry->recordOffset;
+            RecordHeaderT recordHeader;
+
+            std::memcpy(&recordHeader, record, sizeof(recordHeader));
+
+            if (recordHeader.keySize > m_Header.entriesOffset - entry->recordOffset - sizeof(RecordHeaderT))
+            {
+                throw bipc::interprocess_exception("Snapshot file is corrupted");
+            }
+
+            const char* keyData = record + sizeof(RecordHeaderT);
+
+            if (m_KeyEqual(KeyTraits::View(keyData, recordHeader.keySize), lookupKey))
+            {
+                return ValueRange(keyData + recordHeader.keySize, recordHeader.valueCount);
+            }
+        }
+        return ValueRange();
+    }
+
+    template <typename ProvidedKeyT>
+    std::optional<Value> Get(const ProvidedKeyT& key) const
+    {
+        const ValueRange values = FindAll(key);
+        return values.empty() ? std::nullopt : std::optional<Value>(*values.begin());
+    }
+
+    template <typename ProvidedKeyT>
+    std::vector<Value> GetAll(const ProvidedKeyT& key) const
+    {
+        const ValueRange values = FindAll(key);
+        return std::vector<Value>(values.begin(), values.end());
+    }
+
+    // Same as GetAll key by key: with no writer to race, there is nothing to batch but the
+    // prefetches, which the interpolated lookups hardly need.
+    template <typename Range>
+    std::vector<std::vector<Value>> GetMany(const Range& keys) const
+    {
+        std::vector<std::vector<Value>> results;
+
+        for (const auto& key : keys)
+        {
+            results.push_back(GetAll(key));
+        }
+        return results;
+    }
+
+    template <typename ProvidedKeyT>
+    size_t Count(const ProvidedKeyT& key) const
+    {
+        return FindAll(key).size();
+    }
+
+    size_t Size() const
+    {
+        return m_Header.valueCount;
+    }
+
+    size_t KeyCount() const
+    {
+        return m_Header.keyCount;
+    }
+
+private:
+    // The first entry with a hash not less than hash. Starts at the position interpolated
+    // between the first and the last hash and widens the window in doubling steps until it
+    // brackets the answer.
+    const EntryT* LowerBound(const uint64_t hash) const
+    {
+        const size_t count = m_Header.keyCount;
+
+        if (count == 0 || hash <= m_Entries[0].hash)
+        {
+            return m_Entries;
+        }
+
+        const uint64_t firstHash = m_Entries[0].hash;
+        const uint64_t hashRange = m_Entries[count - 1].hash - firstHash;
+        const size_t guess = (hash >= m_Entries[count - 1].hash) ? count - 1 :
+            static_cast<size_t>(static_cast<unsigned __int128>(hash - firstHash) * (count - 1) / hashRange);
+        size_t low = guess, high = guess;
+
+        for (size_t step = INTERPOLATION_STEP; low > 0 && m_Entries[low - 1].hash >= hash; step *= 2)
+        {
+            low = (low > step) ? low - step : 0;
+        }
+
+        for (size_t step = INTERPOLATION_STEP; high < count && m_Entries[high].hash < hash; step *= 2)
+        {
+            high = std::min(high + step, count);
+        }
+
+        return std::lower_bound(m_Entries + low, m_Entries + high, hash, [](const EntryT& entry, const uint64_t value)
+        {
+            return entry.hash < value;
+        });
+    }
+
+    static uint32_t RecordSize(const size_t bytes)
+    {
+        if (bytes >= std::numeric_limits<uint32_t>::max())
+        {
+            throw std::length_error("Key or value is too long to be stored in a snapshot");
+        }
+        return static_cast<uint32_t>(bytes);
+    }
+
+    static constexpr size_t INTERPOLATION_STEP {8};
+
+    bipc::file_mapping m_File;
+    bipc::mapped_region m_Region;
+    HeaderT m_Header;
+    const char* m_Data {nullptr};
+    const EntryT* m_Entries {nullptr};
+    KeyHash m_KeyHasher;
+    KeyEqual m_KeyEqual;
+};
+} //HardDriveContainers
@@ -1,99 +1,918 @@
 #include "container.h"
+#include "directory_index.h"
+#include "directory_scanner.h"
+#include "directory_table.h"
+#include "directory_watcher.h"
+#include "frozen_map.h"
+#include "name_index.h"
+#include "query_server.h"
+#include "sharded_map.h"
+#include <atomic>
+#include <cctype>
+#include <csignal>
+#include <exception>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 #include <boost/filesystem.hpp>
-#include <boost/interprocess/containers/string.hpp>
 #include <boost/log/trivial.hpp>
 
-int main(int argc, const char** argv)
+namespace
+{
+namespace bipc = boost::interprocess;
+namespace fs = boost::filesystem;
+
+// File names map to the ids of their directories in the DirectoryTable, over the shards
+// storage.bin.0 to storage.bin.N-1 that storage.bin.shards lists.
+using FileStorage = HardDriveContainers::ShardedMap<std::string, uint64_t>;
+using FileSnapshot = HardDriveContainers::FrozenMap<std::string, uint64_t>;
+using DirectorySnapshot = HardDriveContainers::FrozenMap<uint64_t, std::string>;
+using FileBatch = FsDump::FileBatch;
+constexpr size_t scanBatchSize = 65536;
+constexpr size_t maxThreadCount = 1024;
+// Every shard reserves its own range of address space.
+constexpr size_t maxShardCount = 256;
+
+std::atomic<bool> stopRequested {false};
+
+const char* usage = "Please, provide command line args like [scan <path> [<threads>] [--names] [--shards=<n>]|update <path>|watch <path> [<threads>] [--names] [--shards=<n>]|"
+    "find <filename>... [--glob=<pattern>] [--substring=<text>] [--prewarm=<policies>]|serve <socket>|- [<prewarm>]|compact [<MB/s>]|freeze|stats [--sample=<stride>] [--threads=<n>]|"
+    "duplicates [--min=<n>] [--threads=<n>] [--paths]]";
+
+// A malformed command line argument; main logs it followed by the usage line.
+class ArgumentError : public std::invalid_argument
 {
-    if (argc < 3)
+public:
+    using std::invalid_argument::invalid_argument;
+};
+
+// Parses a count given on the command line: digits only, from 1 to maxValue.
+size_t countArgument(const std::string& name, const std::string& text, const size_t maxValue)
+{
+    size_t parsed = 0;
+    size_t value = 0;
+
+    try
     {
-        BOOST_LOG_TRIVIAL(error) << "Please, provide 2 command line args like [scan|find] [<path>|<filename>]";
-        return 1;
+        value = std::stoul(text, &parsed);
     }
-    const char* storageFile = "storage.bin";
-    namespace bipc = boost::interprocess;
+    catch (const std::logic_error&)
+    {
+        parsed = 0;
+    }
+
+    if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0])) || parsed != text.size() || value == 0 || value > maxValue)
+    {
+        const std::string range = (maxValue == std::numeric_limits<size_t>::max()) ? "a positive number" : "a number from 1 to " + std::to_string(maxValue);
+        throw ArgumentError("Invalid " + name + " '" + text + "', expected " + range);
+    }
+    return value;
+}
+
+// Directory paths are stored the way the scanner builds them, so a trailing separator
+// would make 'update' miss every directory listed by 'scan'.
+std::string rootPath(std::string path)
+{
+    while (path.size() > 1 && path.back() == '/')
+    {
+        path.pop_back();
+    }
+    return path;
+}
 
-    using CharAllocator = bipc::allocator<char, bipc::managed_mapped_file::segment_manager>;
-    using string = bipc::basic_string<char, std::char_traits<char>, CharAllocator>;
+// 'scan' and 'watch' take an optional thread count and --names, in any order.
+size_t threadCountArgument(const int argc, const char** argv)
+{
+    for (int arg = 3; arg < argc; ++arg)
+    {
+        if (std::string(argv[arg]).compare(0, 2, "--") != 0)
+        {
+            return countArgument("thread count", argv[arg], maxThreadCount);
+        }
+    }
+    return FsDump::DirectoryScanner::DefaultThreadCount();
+}
+
+// 'scan' and 'watch' split a new file index over --shards=<n> files.
+size_t shardCountArgument(const int argc, const char** argv)
+{
+    const std::string shardsOption = "--shards=";
+
+    for (int arg = 3; arg < argc; ++arg)
+    {
+        if (std::string(argv[arg]).compare(0, shardsOption.size(), shardsOption) == 0)
+        {
+            return countArgument("shard count", argv[arg] + shardsOption.size(), maxShardCount);
+        }
+    }
+    return FileStorage::DEFAULT_SHARD_COUNT;
+}
+
+// The size of all shards of the file index.
+uintmax_t shardsSize(const std::string& storageFile)
+{
+    uintmax_t size = 0;
+
+    for (const std::string& file : FileStorage::ShardFilenames(storageFile))
+    {
+        size += fs::file_size(file);
+    }
+    return size;
+}
+
+bool hasFlag(const int argc, const char** argv, const std::string& flag)
+{
+    return std::find(argv + 2, argv + argc, flag) != argv + argc;
+}
+
+// Fills the indexes from scratch, calling onDirectory(const DirectoryListing&) for every
+// directory read. Returns the number of files found. File batches go to one inserter
+// thread per shard of the file index, which write to different shards at once; the other
+// indexes are written on the calling thread.
+template <class DirectoryCallback>
+size_t scanFolder(FileStorage& fileStorage, FsDump::DirectoryIndex& directoryIndex, FsDump::DirectoryTable& directoryTable,
+                  FsDump::NameIndex* nameIndex, const fs::path& folder, const size_t threadCount, DirectoryCallback onDirectory)
+{
+    FsDump::DirectoryScanner scanner(threadCount);
 
-    namespace fs = boost::filesystem;
+    BOOST_LOG_TRIVIAL(info) << "Started scanning folder '" << folder.string() << "' with " << threadCount << " threads and "
+        << fileStorage.ShardCount() << " shards";
+    size_t processedFiles = 0;
+
+    FsDump::BoundedQueue<FileBatch> fileBatches(fileStorage.ShardCount() * 2);
+    std::vector<std::thread> inserters;
+    std::exception_ptr insertError;
+    std::mutex insertErrorMutex;
+
+    for (size_t index = 0; index < fileStorage.ShardCount(); ++index)
+    {
+        inserters.emplace_back([&]()
+        {
+            FileBatch inserted;
+
+            while (fileBatches.Pop(inserted))
+            {
+                try
+                {
+                    fileStorage.InsertBatch(inserted);
+                }
+                catch (const bipc::bad_alloc& ex)
+                {
+                    BOOST_LOG_TRIVIAL(error) << "Error allocating memory while storing " << inserted.size() << " files: "  << ex.what();
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(insertErrorMutex);
+                    insertError = insertError ? insertError : std::current_exception();
+                    fileBatches.Close();
+                }
+            }
+        });
+    }
+
+    auto joinInserters = [&]()
+    {
+        fileBatches.Close();
+
+        for (std::thread& inserter : inserters)
+        {
+            inserter.join();
+        }
+        inserters.clear();
+    };
+
+    FileBatch batch;
+    batch.reserve(scanBatchSize);
+
+    auto flushBatch = [&]()
+    {
+        try
+        {
+            if (nameIndex)
+            {
+                std::vector<std::string_view> names;
+                names.reserve(batch.size());
+
+                for (const auto& file : batch)
+                {
+                    names.push_back(file.first);
+                }
+                nameIndex->Add(names);
+            }
+        }
+        catch (const bipc::bad_alloc& ex)
+        {
+            BOOST_LOG_TRIVIAL(error) << "Error allocating memory while indexing the names of " << batch.size() << " files: "  << ex.what();
+        }
+
+        if (!batch.empty())
+        {
+            fileBatches.Push(std::move(batch));
+            batch = FileBatch();
+            batch.reserve(scanBatchSize);
+        }
+    };
+
+    try
+    {
+        scanner.Scan(folder, [&](FsDump::ScanBatch& scanned)
+        {
+            const size_t previousFiles = processedFiles;
+
+            for (const FsDump::DirectoryListing& listing : scanned.directories)
+            {
+                onDirectory(listing);
+            }
+
+            try
+            {
+                directoryIndex.Put(scanned.directories);
+                directoryTable.Add(scanned.directories);
+            }
+            catch (const bipc::bad_alloc& ex)
+            {
+                BOOST_LOG_TRIVIAL(error) << "Error allocating memory while storing " << scanned.directories.size() << " directories: "  << ex.what();
+            }
+
+            for (FsDump::DirectoryListing& listing : scanned.directories)
+            {
+                for (std::string& name : listing.files)
+                {
+                    batch.emplace_back(std::move(name), listing.id);
+                }
+            }
+            processedFiles += scanned.fileCount;
+
+            if (batch.size() >= scanBatchSize)
+            {
+                flushBatch();
+            }
+
+            if (processedFiles / 10000 != previousFiles / 10000)
+            {
+                BOOST_LOG_TRIVIAL(info) << "Scanned " << processedFiles << " files";
+            }
+        }, directoryTable.NextId());
+
+        flushBatch();
+    }
+    catch (...)
+    {
+        joinInserters();
+        throw;
+    }
+
+    joinInserters();
+
+    if (insertError)
+    {
+        std::rethrow_exception(insertError);
+    }
+
+    directoryTable.ReserveIds(scanner.NextDirectoryId());
+
+    BOOST_LOG_TRIVIAL(info) << "Finished scanning: " << processedFiles << " files scanned";
+    return processedFiles;
+}
+// Comma separated list of populate, random, willneed and hugepages, or none.
+HardDriveContainers::PrewarmOptions parsePrewarm(const std::string& policies)
+{
+    HardDriveContainers::PrewarmOptions prewarm;
+    size_t begin = 0;
+
+    while (begin <= policies.size())
+    {
+        const size_t end = std::min(policies.find(',', begin), policies.size());
+        const std::string policy = policies.substr(begin, end - begin);
+
+        if (policy == "populate")
+        {
+            prewarm.populate = true;
+        }
+        else if (policy == "random")
+        {
+            prewarm.randomAccess = true;
+        }
+        else if (policy == "willneed")
+        {
+            prewarm.willNeedBuckets = true;
+        }
+        else if (policy == "hugepages")
+        {
+            prewarm.hugePages = true;
+        }
+        else if (policy != "none")
+        {
+            BOOST_LOG_TRIVIAL(warning) << "Unknown prewarm policy '" << policy << "' ignored";
+        }
+        begin = end + 1;
+    }
+    return prewarm;
+}
+
+// "0:12 1:30 2:5" for the non-zero entries of a histogram, labelled by label(index).
+template <class Label>
+std::string formatHistogram(const std::vector<size_t>& histogram, Label label)
+{
+    std::string text;
+
+    for (size_t index = 0; index < histogram.size(); ++index)
+    {
+        if (histogram[index] != 0)
+        {
+            text += (text.empty() ? "" : " ") + label(index) + ":" + std::to_string(histogram[index]);
+        }
+    }
+    return text;
+}
+
+// Counts of the operations this process ran on a map, logged when a command is done.
+template <class MapT>
+void logCounters(const std::string& name, const MapT& map)
+{
+    const HardDriveContainers::MapCounters counters = map.Counters();
+
+    BOOST_LOG_TRIVIAL(info) << name << ": " << counters.inserts << " inserts, " << counters.erases << " erases, "
+        << counters.lookups << " lookups, " << (counters.lookups ? double(counters.chainSteps) / counters.lookups : 0.0)
+        << " chain steps per lookup, " << counters.remaps << " remaps, " << counters.grows << " grows";
+}
+
+// What Map::Stats finds in a map file, for 'stats'.
+template <class MapT>
+void logStats(const std::string& file, const size_t sampleStride, const size_t threadCount)
+{
+    const MapT map(bipc::open_read_only, file.c_str());
+    const HardDriveContainers::MapStats stats = map.Stats(sampleStride, threadCount);
+    const size_t usedBytes = stats.segmentBytes - stats.freeBytes;
+
+    BOOST_LOG_TRIVIAL(info) << file << ": " << stats.keyCount << " keys, " << stats.valueCount << " values, "
+        << stats.bucketCount << " buckets, load factor " << stats.loadFactor;
+    BOOST_LOG_TRIVIAL(info) << "  " << stats.sampledBuckets << " buckets sampled, " << stats.emptyBuckets << " empty, longest chain "
+        << stats.maxChainLength << ", keys per bucket " << formatHistogram(stats.chainLengths, [](size_t length) { return std::to_string(length); });
+    BOOST_LOG_TRIVIAL(info) << "  " << stats.sampledKeys << " keys sampled, most values per key " << stats.maxValuesPerKey
+        << ", values per key " << formatHistogram(stats.valuesPerKey, [](size_t magnitude)
+        {
+            return (magnitude == 0) ? std::string("1") : std::to_string(size_t(1) << magnitude) + "-" + std::to_string((size_t(2) << magnitude) - 1);
+        });
+
+    if (!stats.probeLengths.empty())
+    {
+        BOOST_LOG_TRIVIAL(info) << "  groups probed per key " << formatHistogram(stats.probeLengths, [](size_t probes) { return std::to_string(probes); });
+    }
+
+    BOOST_LOG_TRIVIAL(info) << "  segment of " << stats.segmentBytes << " bytes: " << usedBytes << " in use, "
+        << stats.recordFreeBytes << " of them free in record slabs, " << stats.freeBytes << " free ("
+        << (stats.valueCount ? double(usedBytes) / stats.valueCount : 0.0) << " bytes in use per value)";
+}
+
+// Every command writing the index has the directory table open, and with it the lock
+// that keeps out a second writer; 'scan' and 'watch' check it before removing the index.
+bool indexInUse(const std::string& directoryTableFile)
+{
+    if (HardDriveContainers::GrowableMappedFile::IsOpenForWriting(directoryTableFile.c_str()))
+    {
+        BOOST_LOG_TRIVIAL(error) << "The index is in use by another 'scan', 'update', 'watch' or 'compact'";
+        return true;
+    }
+    return false;
+}
+
+int run(int argc, const char** argv)
+{
+    if (argc < 3 && !(argc == 2 && (std::string(argv[1]) == "compact" || std::string(argv[1]) == "freeze" || std::string(argv[1]) == "stats" ||
+                                  std::string(argv[1]) == "duplicates")))
+    {
+        BOOST_LOG_TRIVIAL(error) << usage;
+        return 1;
+    }
+    const char* storageFile = "storage.bin";
+    const std::string directoryIndexFile = FsDump::DirectoryIndex::FilenameFor(storageFile);
+    const std::string directoryTableFile = FsDump::DirectoryTable::FilenameFor(storageFile);
+    const std::string snapshotFile = FileSnapshot::FilenameFor(storageFile);
+    const std::string directorySnapshotFile = DirectorySnapshot::FilenameFor(directoryTableFile);
+    const std::string nameIndexFile = FsDump::NameIndex::FilenameFor(storageFile);
+    const std::string postingsFile = FsDump::NameIndex::PostingsFilenameFor(nameIndexFile);
 
     if (std::string(argv[1]) == "scan")
     {
-        std::remove(storageFile);
-        HardDriveContainers::Map<string, string> filePathStorage(storageFile);
+        // Arguments are checked before the old index is removed.
+        const size_t threadCount = threadCountArgument(argc, argv);
+        const size_t shardCount = shardCountArgument(argc, argv);
+
+        if (indexInUse(directoryTableFile))
+        {
+            return 1;
+        }
+
+        FileStorage::Remove(storageFile);
+        std::remove(directoryIndexFile.c_str());
+        std::remove(directoryTableFile.c_str());
+        std::remove(snapshotFile.c_str());
+        std::remove(directorySnapshotFile.c_str());
+        std::remove(nameIndexFile.c_str());
+        std::remove(postingsFile.c_str());
+        FileStorage fileStorage(storageFile, shardCount);
+        FsDump::DirectoryIndex directoryIndex(directoryIndexFile);
+        FsDump::DirectoryTable directoryTable(directoryTableFile);
+        std::unique_ptr<FsDump::NameIndex> nameIndex(hasFlag(argc, argv, "--names") ? new FsDump::NameIndex(nameIndexFile) : nullptr);
 
-        fs::path folder(argv[2]);
+        fs::path folder(rootPath(argv[2]));
 
         if (fs::is_directory(folder))
         {
-            fs::recursive_directory_iterator dir(folder), end;
+            scanFolder(fileStorage, directoryIndex, directoryTable, nameIndex.get(), folder, threadCount,
+                       [](const FsDump::DirectoryListing&) {});
+        }
+        else
+        {
+            BOOST_LOG_TRIVIAL(error) << "Second argument should be a directory";
+        }
+    }
+    else if (std::string(argv[1]) == "update")
+    {
+        if (!FileStorage::Exists(storageFile) || !fs::exists(directoryIndexFile) || !fs::exists(directoryTableFile))
+        {
+            BOOST_LOG_TRIVIAL(error) << "No directory index found, run 'scan' first";
+            return 1;
+        }
+
+        FileStorage fileStorage(storageFile);
+        FsDump::DirectoryIndex directoryIndex(directoryIndexFile);
+        FsDump::DirectoryTable directoryTable(directoryTableFile);
+
+        // A snapshot would no longer match the index, 'find' must not prefer it.
+        std::remove(snapshotFile.c_str());
+        std::remove(directorySnapshotFile.c_str());
+        FsDump::IncrementalUpdater<FileStorage> updater(fileStorage, directoryIndex, directoryTable);
+        std::unique_ptr<FsDump::NameIndex> nameIndex;
+
+        if (fs::exists(nameIndexFile))
+        {
+            nameIndex.reset(new FsDump::NameIndex(nameIndexFile));
+            updater.IndexNames(*nameIndex);
+        }
+
+        const std::string folder = rootPath(argv[2]);
+
+        BOOST_LOG_TRIVIAL(info) << "Started updating folder '" << folder << "'";
+
+        const FsDump::UpdateStatistics statistics = updater.Update(folder);
+
+        BOOST_LOG_TRIVIAL(info) << "Finished updating: " << statistics.checkedDirectories << " directories checked, "
+            << statistics.readDirectories << " read, " << statistics.removedDirectories << " removed, "
+            << statistics.addedFiles << " files added, " << statistics.removedFiles << " files removed";
+        logCounters(storageFile, fileStorage);
+    }
+    else if (std::string(argv[1]) == "watch")
+    {
+#ifdef __linux__
+        const size_t threadCount = threadCountArgument(argc, argv);
+        const size_t shardCount = shardCountArgument(argc, argv);
+
+        if (indexInUse(directoryTableFile))
+        {
+            return 1;
+        }
+
+        FileStorage::Remove(storageFile);
+        std::remove(directoryIndexFile.c_str());
+        std::remove(directoryTableFile.c_str());
+        std::remove(snapshotFile.c_str());
+        std::remove(directorySnapshotFile.c_str());
+        std::remove(nameIndexFile.c_str());
+        std::remove(postingsFile.c_str());
+        FileStorage fileStorage(storageFile, shardCount);
+        FsDump::DirectoryIndex directoryIndex(directoryIndexFile);
+        FsDump::DirectoryTable directoryTable(directoryTableFile);
+        FsDump::DirectoryWatcher<FileStorage> watcher(fileStorage, directoryIndex, directoryTable);
+        std::unique_ptr<FsDump::NameIndex> nameIndex(hasFlag(argc, argv, "--names") ? new FsDump::NameIndex(nameIndexFile) : nullptr);
+
+        if (nameIndex)
+        {
+            watcher.IndexNames(*nameIndex);
+        }
+
+        const std::string folder = rootPath(argv[2]);
+
+        if (!fs::is_directory(folder))
+        {
+            BOOST_LOG_TRIVIAL(error) << "Second argument should be a directory";
+            return 1;
+        }
+
+        scanFolder(fileStorage, directoryIndex, directoryTable, nameIndex.get(), folder, threadCount,
+                   [&](const FsDump::DirectoryListing& listing)
+        {
+            watcher.Watch(listing.path);
+        });
+
+        std::signal(SIGINT, [](int) { stopRequested = true; });
+        std::signal(SIGTERM, [](int) { stopRequested = true; });
 
-            BOOST_LOG_TRIVIAL(info) << "Started scanning folder '" << folder.string() << "'";
-            size_t processedFiles = 0;
+        BOOST_LOG_TRIVIAL(info) << "Watching folder '" << folder << "', interrupt to stop";
+        watcher.Run(folder, stopRequested);
+        BOOST_LOG_TRIVIAL(info) << "Stopped watching";
+        logCounters(storageFile, fileStorage);
+#else
+        BOOST_LOG_TRIVIAL(error) << "'watch' is only supported on Linux";
+        return 1;
+#endif
+    }
+    else if (std::string(argv[1]) == "serve")
+    {
+        std::unique_ptr<FileStorage> fileStorage;
+        std::unique_ptr<FsDump::DirectoryTable::Storage> directoryStorage;
 
-            for (; dir != end; )
+        try
+        {
+            const HardDriveContainers::PrewarmOptions prewarm = parsePrewarm((argc > 3) ? argv[3] : "random");
+
+            fileStorage.reset(new FileStorage(bipc::open_read_only, storageFile, prewarm));
+            directoryStorage.reset(new FsDump::DirectoryTable::Storage(bipc::open_read_only, directoryTableFile.c_str(), prewarm));
+        }
+        catch (const bipc::interprocess_exception& ex)
+        {
+            BOOST_LOG_TRIVIAL(error) << "Can't read " << storageFile << ", run 'scan' first: " << ex.what();
+            return 1;
+        }
+
+        std::signal(SIGINT, [](int) { stopRequested = true; });
+        std::signal(SIGTERM, [](int) { stopRequested = true; });
+        std::signal(SIGPIPE, SIG_IGN);
+
+        using Lookup = FsDump::FileLookup<FileStorage, FsDump::DirectoryTable::Storage>;
+        const Lookup lookup(*fileStorage, *directoryStorage);
+        FsDump::QueryServer<Lookup> server(lookup);
+
+        if (std::string(argv[2]) == "-")
+        {
+            server.ServeStream(STDIN_FILENO, STDOUT_FILENO, stopRequested);
+        }
+        else
+        {
+            BOOST_LOG_TRIVIAL(info) << "Serving queries on " << argv[2] << ", interrupt to stop";
+            server.ServeSocket(argv[2], stopRequested);
+        }
+
+        logCounters(storageFile, *fileStorage);
+        logCounters(directoryTableFile, *directoryStorage);
+    }
+    else if (std::string(argv[1]) == "compact")
+    {
+        // Refused while 'update' or 'watch' has the index open; 'find' and 'serve' pick the
+        // new files up.
+        const size_t megabyte = 1024 * 1024;
+        const size_t maxBytesPerSecond = (argc > 2) ? countArgument("MB/s limit", argv[2], std::numeric_limits<size_t>::max() / megabyte) * megabyte : 0;
+
+        if (!FileStorage::Exists(storageFile) || !fs::exists(directoryIndexFile) || !fs::exists(directoryTableFile))
+        {
+            BOOST_LOG_TRIVIAL(error) << "No index found, run 'scan' first";
+            return 1;
+        }
+
+        try
+        {
+            FileStorage fileStorage(storageFile);
+
+            for (size_t index = 0; index < fileStorage.ShardCount(); ++index)
             {
-                const std::string pathStr = dir->path().string();
+                const std::string file = FileStorage::FilenameFor(storageFile, index);
+                const uintmax_t oldSize = fs::file_size(file);
 
-                try
-                {
-                    if (fs::is_regular_file(dir->path()))
-                    {
-                        const std::string fileName = dir->path().filename().string();
+                BOOST_LOG_TRIVIAL(info) << "Compacting " << file;
+                fileStorage.CompactShard(index, maxBytesPerSecond);
+                BOOST_LOG_TRIVIAL(info) << "Compacted " << file << " from " << oldSize << " to " << fs::file_size(file) << " bytes";
+            }
+        }
+        catch (const bipc::interprocess_exception& ex)
+        {
+            BOOST_LOG_TRIVIAL(error) << "Can't compact " << storageFile << ", run 'scan' again: " << ex.what();
+            return 1;
+        }
+
+        for (const std::string& file : {directoryIndexFile, directoryTableFile})
+        {
+            const uintmax_t oldSize = fs::file_size(file);
+
+            BOOST_LOG_TRIVIAL(info) << "Compacting " << file;
+
+            if (file == directoryIndexFile)
+            {
+                FsDump::DirectoryIndex(directoryIndexFile).Compact(maxBytesPerSecond);
+            }
+            else
+            {
+                FsDump::DirectoryTable(directoryTableFile).Compact(maxBytesPerSecond);
+            }
+
+            BOOST_LOG_TRIVIAL(info) << "Compacted " << file << " from " << oldSize << " to " << fs::file_size(file) << " bytes";
+        }
+
+        if (fs::exists(nameIndexFile))
+        {
+            const uintmax_t oldSize = fs::file_size(nameIndexFile) + fs::file_size(postingsFile);
+
+            BOOST_LOG_TRIVIAL(info) << "Compacting " << nameIndexFile;
+            FsDump::NameIndex(nameIndexFile).Compact(maxBytesPerSecond);
+            BOOST_LOG_TRIVIAL(info) << "Compacted " << nameIndexFile << " from " << oldSize << " to "
+                << fs::file_size(nameIndexFile) + fs::file_size(postingsFile) << " bytes";
+        }
+    }
+    else if (std::string(argv[1]) == "freeze")
+    {
+        // The directory table is frozen first: 'find' only prefers the snapshots once both exist.
+        try
+        {
+            const FsDump::DirectoryTable::Storage directoryStorage(bipc::open_read_only, directoryTableFile.c_str());
+            const FileStorage fileStorage(bipc::open_read_only, storageFile);
+
+            BOOST_LOG_TRIVIAL(info) << "Writing snapshots " << directorySnapshotFile << " and " << snapshotFile;
+            DirectorySnapshot::Write(directoryStorage, directorySnapshotFile);
+            FileSnapshot::Write(fileStorage, snapshotFile);
+        }
+        catch (const bipc::interprocess_exception& ex)
+        {
+            BOOST_LOG_TRIVIAL(error) << "Can't write a snapshot of " << storageFile << ": " << ex.what();
+            return 1;
+        }
+
+        BOOST_LOG_TRIVIAL(info) << "Snapshot of " << shardsSize(storageFile) + fs::file_size(directoryTableFile) << " bytes of indexes written in "
+            << fs::file_size(snapshotFile) + fs::file_size(directorySnapshotFile) << " bytes";
+    }
+    else if (std::string(argv[1]) == "stats")
+    {
+        // Walks every chain of every map, or of every stride-th bucket with --sample. Must
+        // not run alongside 'update' or 'watch'.
+        size_t sampleStride = 1;
+        size_t threadCount = FsDump::DirectoryScanner::DefaultThreadCount();
 
-                        filePathStorage.Insert(fileName.c_str(), pathStr.c_str());
-                        ++processedFiles;
+        for (int arg = 2; arg < argc; ++arg)
+        {
+            const std::string option = argv[arg];
 
-                        if (processedFiles % 10000 == 0)
+            if (option.compare(0, 9, "--sample=") == 0)
+            {
+                sampleStride = countArgument("sample stride", option.substr(9), std::numeric_limits<size_t>::max());
+            }
+            else if (option.compare(0, 10, "--threads=") == 0)
+            {
+                threadCount = countArgument("thread count", option.substr(10), maxThreadCount);
+            }
+            else
+            {
+                BOOST_LOG_TRIVIAL(warning) << "Unknown option '" << option << "' ignored";
+            }
+        }
+
+        try
+        {
+            for (const std::string& file : FileStorage::ShardFilenames(storageFile))
+            {
+                logStats<FileStorage::Shard>(file, sampleStride, threadCount);
+            }
+
+            logStats<FsDump::DirectoryIndex::Storage>(directoryIndexFile, sampleStride, threadCount);
+            logStats<FsDump::DirectoryTable::Storage>(directoryTableFile, sampleStride, threadCount);
+
+            if (fs::exists(nameIndexFile))
+            {
+                logStats<FsDump::NameIndex::NameStorage>(nameIndexFile, sampleStride, threadCount);
+                logStats<FsDump::NameIndex::PostingStorage>(postingsFile, sampleStride, threadCount);
+            }
+        }
+        catch (const bipc::interprocess_exception& ex)
+        {
+            BOOST_LOG_TRIVIAL(error) << "Can't read the index, run 'scan' first: " << ex.what();
+            return 1;
+        }
+    }
+    else if (std::string(argv[1]) == "duplicates")
+    {
+        // Names given to at least --min files, 2 by default, most frequent first, with
+        // their paths if --paths is given. Threads scan disjoint bucket ranges of the file
+        // index, which, as for 'stats', nothing may write to meanwhile.
+        size_t minCount = 2;
+        size_t threadCount = FsDump::DirectoryScanner::DefaultThreadCount();
+        bool withPaths = false;
+
+        for (int arg = 2; arg < argc; ++arg)
+        {
+            const std::string option = argv[arg];
+
+            if (option.compare(0, 6, "--min=") == 0)
+            {
+                minCount = countArgument("minimum count", option.substr(6), std::numeric_limits<size_t>::max());
+            }
+            else if (option.compare(0, 10, "--threads=") == 0)
+            {
+                threadCount = countArgument("thread count", option.substr(10), maxThreadCount);
+            }
+            else if (option == "--paths")
+            {
+                withPaths = true;
+            }
+            else
+            {
+                BOOST_LOG_TRIVIAL(warning) << "Unknown option '" << option << "' ignored";
+            }
+        }
+
+        try
+        {
+            const FileStorage files(bipc::open_read_only, storageFile, parsePrewarm("willneed"));
+            const size_t bucketCount = files.BucketCount();
+            std::vector<std::vector<std::pair<size_t, std::string>>> ranges(threadCount);
+            std::vector<std::thread> threads;
+
+            for (size_t range = 0; range < threadCount; ++range)
+            {
+                threads.emplace_back([&, range]()
+                {
+                    files.ForEachInRange(bucketCount * range / threadCount, bucketCount * (range + 1) / threadCount,
+                                         [&](const std::string_view name, const auto& directoryIds)
+                    {
+                        if (directoryIds.size() >= minCount)
                         {
-                            BOOST_LOG_TRIVIAL(info) << "Scanned " << processedFiles << " files";
+                            ranges[range].emplace_back(directoryIds.size(), name);
                         }
-                    }
-                    
-                    ++dir;
-                }
-                catch (const fs::filesystem_error& ex)
+                    });
+                });
+            }
+
+            for (std::thread& thread : threads)
+            {
+                thread.join();
+            }
+
+            std::vector<std::pair<size_t, std::string>> duplicates;
+
+            for (auto& range : ranges)
+            {
+                std::move(range.begin(), range.end(), std::back_inserter(duplicates));
+            }
+
+            std::sort(duplicates.begin(), duplicates.end(), [](const auto& lhv, const auto& rhv)
+            {
+                return lhv.first > rhv.first || (lhv.first == rhv.first && lhv.second < rhv.second);
+            });
+
+            std::vector<std::vector<std::string>> paths(duplicates.size());
+
+            if (withPaths)
+            {
+                std::vector<std::string_view> names;
+
+                for (const auto& duplicate : duplicates)
                 {
-                    BOOST_LOG_TRIVIAL(error) << "Filesystem error while processing " << pathStr << ": " << ex.what();
-                    dir.no_push();
-                    ++dir;
+                    names.push_back(duplicate.second);
                 }
-                catch (const bipc::bad_alloc& ex)
+
+                const FsDump::DirectoryTable::Storage directories(bipc::open_read_only, directoryTableFile.c_str());
+                paths = FsDump::FileLookup<FileStorage, FsDump::DirectoryTable::Storage>(files, directories).GetMany(names);
+            }
+
+            for (size_t index = 0; index < duplicates.size(); ++index)
+            {
+                BOOST_LOG_TRIVIAL(info) << duplicates[index].first << " " << duplicates[index].second;
+
+                for (const auto& path : paths[index])
                 {
-                    BOOST_LOG_TRIVIAL(error) << "Error allocating memory while processing " << pathStr << ": "  << ex.what();
+                    BOOST_LOG_TRIVIAL(info) << "  " << path;
                 }
             }
-            
-            BOOST_LOG_TRIVIAL(info) << "Finished scanning: " << processedFiles << " files scanned";
+
+            BOOST_LOG_TRIVIAL(info) << duplicates.size() << " names of " << files.Size() << " files are given to at least "
+                << minCount << " files";
         }
-        else
+        catch (const bipc::interprocess_exception& ex)
         {
-            BOOST_LOG_TRIVIAL(error) << "Second argument should be a directory";
+            BOOST_LOG_TRIVIAL(error) << "Can't read the index, run 'scan' first: " << ex.what();
+            return 1;
         }
     }
     else if (std::string(argv[1]) == "find")
     {
-        HardDriveContainers::Map<string, string> filePathStorage(storageFile);
-        auto valueNodePtr = filePathStorage.FindAll(argv[2]);
+        // A snapshot written by 'freeze' is preferred; 'scan', 'update' and 'watch' remove it.
+        // Otherwise the index is opened read-only and queried with GetMany, so a 'scan' or
+        // 'watch' may be writing meanwhile. Glob and substring searches need the name index
+        // of 'scan --names' and, unlike exact lookups, must not run alongside 'update' or 'watch'.
+        const std::string prewarmOption = "--prewarm=";
+        const std::string globOption = "--glob=";
+        const std::string substringOption = "--substring=";
+        std::string prewarm = "random";
+        std::vector<std::string> names, globs, substrings;
+
+        for (int arg = 2; arg < argc; ++arg)
+        {
+            const std::string name = argv[arg];
 
-        if (valueNodePtr == nullptr)
+            if (name.compare(0, prewarmOption.size(), prewarmOption) == 0)
+            {
+                prewarm = name.substr(prewarmOption.size());
+            }
+            else if (name.compare(0, globOption.size(), globOption) == 0)
+            {
+                globs.push_back(name.substr(globOption.size()));
+            }
+            else if (name.compare(0, substringOption.size(), substringOption) == 0)
+            {
+                substrings.push_back(name.substr(substringOption.size()));
+            }
+            else
+            {
+                names.push_back(name);
+            }
+        }
+
+        const size_t exactNames = names.size();
+        std::vector<std::vector<std::string>> paths;
+
+        try
+        {
+            if (!globs.empty() || !substrings.empty())
+            {
+                const FsDump::NameIndex nameIndex(bipc::open_read_only, nameIndexFile);
+                auto addName = [&](const std::string_view name) { names.emplace_back(name); };
+
+                for (const std::string& pattern : globs)
+                {
+                    nameIndex.Glob(pattern, addName);
+                }
+
+                for (const std::string& text : substrings)
+                {
+                    nameIndex.Substring(text, addName);
+                }
+
+                BOOST_LOG_TRIVIAL(info) << names.size() - exactNames << " names match the patterns";
+            }
+
+            if (fs::exists(snapshotFile) && fs::exists(directorySnapshotFile))
+            {
+                const FileSnapshot files(snapshotFile.c_str());
+                const DirectorySnapshot directories(directorySnapshotFile.c_str());
+
+                paths = FsDump::FileLookup<FileSnapshot, DirectorySnapshot>(files, directories).GetMany(names);
+            }
+            else
+            {
+                const FileStorage files(bipc::open_read_only, storageFile, parsePrewarm(prewarm));
+                const FsDump::DirectoryTable::Storage directories(bipc::open_read_only, directoryTableFile.c_str(), parsePrewarm(prewarm));
+
+                paths = FsDump::FileLookup<FileStorage, FsDump::DirectoryTable::Storage>(files, directories).GetMany(names);
+            }
+        }
+        catch (const bipc::interprocess_exception& ex)
         {
-            BOOST_LOG_TRIVIAL(info) << "No path found";
+            BOOST_LOG_TRIVIAL(error) << "Can't read the index, run 'scan' first, with --names for patterns: " << ex.what();
+            return 1;
         }
-        else
+
+        for (size_t index = 0; index < names.size(); ++index)
         {
-            for (; valueNodePtr; valueNodePtr = valueNodePtr->nextValueNode)
+            if (paths[index].empty() && index < exactNames)
+            {
+                BOOST_LOG_TRIVIAL(info) << "No path found for '" << names[index] << "'";
+            }
+
+            for (const auto& path : paths[index])
             {
-                BOOST_LOG_TRIVIAL(info) << *valueNodePtr->storedValue;
+                BOOST_LOG_TRIVIAL(info) << path;
             }
         }
     }
     else
     {
-        BOOST_LOG_TRIVIAL(error) << "First argument should be 'scan' or 'find'";
+        BOOST_LOG_TRIVIAL(error) << "First argument should be 'scan', 'update', 'watch', 'find', 'serve', 'compact', 'freeze', 'stats' or 'duplicates'";
     }
 
     return 0;
 }
+} //namespace
+
+int main(int argc, const char** argv)
+{
+    try
+    {
+        return run(argc, argv);
+    }
+    catch (const ArgumentError& ex)
+    {
+        BOOST_LOG_TRIVIAL(error) << ex.what();
+        BOOST_LOG_TRIVIAL(error) << usage;
+        return 1;
+    }
+    // E.g. a second writer refused by the one that has the index open.
+    catch (const bipc::interprocess_exception& ex)
+    {
+        BOOST_LOG_TRIVIAL(error) << ex.what();
+        return 1;
+    }
+}
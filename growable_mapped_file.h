@@ -0,0 +1,389 @@
+#pragma once
+
+#include <boost/interprocess/managed_mapped_file.hpp>
+#include <boost/interprocess/managed_external_buffer.hpp>
+#include <boost/interprocess/indexes/iset_index.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace HardDriveContainers
+{
+
+namespace bipc = boost::interprocess;
+
+// How a read-only mapping warms the page cache up before the first lookup. All off by
+// default: a single lookup on a large index is usually fastest with no prewarming.
+struct PrewarmOptions
+{
+    // MAP_POPULATE: reads the whole file and builds the page tables while mapping it.
+    bool populate {false};
+    // MADV_RANDOM: no readahead around page faults, chains are scattered over the file.
+    bool randomAccess {false};
+    // MADV_WILLNEED on the bucket array: starts reading every lookup's entry point ahead.
+    bool willNeedBuckets {false};
+    // MADV_HUGEPAGE: fewer TLB misses, for kernels with transparent huge pages for files.
+    bool hugePages {false};
+};
+
+// Flushes a file, or a directory's entries, to the disk. A file replaced by renaming a
+// new one over it is synced before the rename, and its directory after it, so a crash
+// leaves either file whole under the name.
+inline bool SyncPath(const std::string& path)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    const bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+}
+
+inline std::string DirectoryOf(const std::string& filename)
+{
+    const size_t slash = filename.rfind('/');
+
+    if (slash == std::string::npos)
+    {
+        return ".";
+    }
+    return (slash == 0) ? "/" : filename.substr(0, slash);
+}
+
+// A managed segment in a file, laid out like bipc::managed_mapped_file, but mapped into a
+// large range of address space reserved up front. Growing extends the file and maps the
+// new tail right after the old mapping, so nothing is unmapped and every pointer into the
+// segment stays valid. Only growing past the reservation moves the mapping, to a
+// reservation twice as large.
+class GrowableMappedFile
+{
+public:
+    using segment_manager = bipc::managed_mapped_file::segment_manager;
+
+    GrowableMappedFile(bipc::open_or_create_t, const char* filename, const size_t size, const size_t reservation = DEFAULT_RESERVATION)
+        : m_Filename(filename)
+        , m_ReadOnly(false)
+    {
+        m_Fd = ::open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+        if (m_Fd < 0)
+        {
+            Fail("Can't open");
+        }
+
+        try
+        {
+            // One writer at a time: the exclusive lock is held until the mapping is closed,
+            // so a second writer fails here instead of racing the first one's seqlocks, and
+            // only the first one ever finds the file empty and lays the segment out.
+            if (::flock(m_Fd, LOCK_EX | LOCK_NB) != 0)
+            {
+                if (errno == EWOULDBLOCK)
+                {
+                    throw bipc::interprocess_exception((m_Filename + " is already open for writing by another process").c_str());
+                }
+                Fail("Can't lock");
+            }
+
+            if (FileSize() == 0)
+            {
+                const size_t fileSize = RoundToPages(std::max(size, USER_OFFSET + MIN_SEGMENT_SIZE));
+
+                Extend(0, fileSize);
+                Map(std::max(reservation, fileSize), fileSize);
+
+                m_Segment = ExternalBuffer(bipc::create_only, m_Base + USER_OFFSET, fileSize - USER_OFFSET);
+                InitializationFlag().store(INITIALIZED_SEGMENT, std::memory_order_release);
+            }
+            else
+            {
+                Open(reservation);
+            }
+        }
+        catch (...)
+        {
+            Close();
+            throw;
+        }
+    }
+
+    GrowableMappedFile(bipc::open_read_only_t, const char* filename, const bool populate = false,
+                       const size_t reservation = DEFAULT_RESERVATION)
+        : m_Filename(filename)
+        , m_ReadOnly(true)
+    {
+        m_Fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+
+        if (m_Fd < 0)
+        {
+            Fail("Can't open");
+        }
+
+        try
+        {
+            Open(reservation, (populate) ? MAP_POPULATE : 0);
+        }
+        catch (...)
+        {
+            Close();
+            throw;
+        }
+    }
+
+    GrowableMappedFile(const GrowableMappedFile&) = delete;
+    GrowableMappedFile& operator =(const GrowableMappedFile&) = delete;
+
+    ~GrowableMappedFile()
+    {
+        Close();
+    }
+
+    segment_manager* get_segment_manager() const
+    {
+        return m_Segment.get_segment_manager();
+    }
+
+    // Bytes of the segment currently mapped, from the segment manager on.
+    size_t GetMappedSegmentSize() const
+    {
+        return m_MappedSize - USER_OFFSET;
+    }
+
+    // Extends the file and the segment by at least extraBytes. Returns true if the mapping
+    // had to move, which invalidates all pointers into it.
+    bool Grow(const size_t extraBytes)
+    {
+        const size_t newSize = RoundToPages(m_MappedSize + extraBytes);
+
+        Extend(m_MappedSize, newSize);
+
+        const bool moved = MapTail(newSize);
+
+        m_Segment.grow(newSize - m_MappedSize);
+        m_MappedSize = newSize;
+        return moved;
+    }
+
+    // For readers: maps whatever the writer appended to the file since. Returns true if
+    // the mapping had to move.
+    bool Refresh()
+    {
+        const size_t fileSize = FileSize();
+
+        if (fileSize <= m_MappedSize)
+        {
+            return false;
+        }
+
+        const bool moved = MapTail(fileSize);
+        m_MappedSize = fileSize;
+        return moved;
+    }
+
+    // Passes advice for a part of the mapping to madvise. Advice is best effort, so
+    // failures are ignored.
+    void Advise(const void* address, const size_t bytes, const int advice) const
+    {
+        const size_t begin = std::max<const char*>(static_cast<const char*>(address), m_Base) - m_Base;
+        const size_t end = std::min(begin + bytes, m_MappedSize);
+        const size_t alignedBegin = begin / PageSize() * PageSize();
+
+        if (end > alignedBegin)
+        {
+            ::madvise(m_Base + alignedBegin, end - alignedBegin, advice);
+        }
+    }
+
+    void AdviseAll(const int advice) const
+    {
+        Advise(m_Base, m_MappedSize, advice);
+    }
+
+    // Whether a writer has the file open, for callers that must not remove it under one.
+    static bool IsOpenForWriting(const char* filename)
+    {
+        const int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        const bool locked = ::flock(fd, LOCK_EX | LOCK_NB) != 0 && errno == EWOULDBLOCK;
+        ::close(fd);
+        return locked;
+    }
+
+    static constexpr size_t DEFAULT_RESERVATION {64ul << 30};
+
+private:
+    using ExternalBuffer = bipc::basic_managed_external_buffer<char, segment_manager::memory_algorithm, bipc::iset_index>;
+
+    static_assert(std::is_same<ExternalBuffer::segment_manager, segment_manager>::value,
+                  "The segment must be readable as a managed_mapped_file");
+
+    // The header managed_mapped_file keeps in front of the segment: an initialization flag.
+    static constexpr size_t USER_OFFSET {bipc::ipcdetail::mfile_open_or_create<segment_manager::memory_algorithm>::type::ManagedOpenOrCreateUserOffset};
+    static constexpr uint32_t INITIALIZED_SEGMENT {2};
+    static constexpr size_t MIN_SEGMENT_SIZE {64 * 1024};
+
+    void Open(const size_t reservation, const int mapFlags = 0)
+    {
+        const size_t fileSize = FileSize();
+
+        if (fileSize <= USER_OFFSET)
+        {
+            throw bipc::interprocess_exception("Map file is corrupted or still being created");
+        }
+
+        Map(std::max(reservation, fileSize * 2), fileSize, mapFlags);
+
+        if (InitializationFlag().load(std::memory_order_acquire) != INITIALIZED_SEGMENT)
+        {
+            throw bipc::interprocess_exception("Map file is corrupted or still being created");
+        }
+
+        m_Segment = ExternalBuffer(bipc::open_only, m_Base + USER_OFFSET, fileSize - USER_OFFSET);
+    }
+
+    // Reserves the address range and maps the first size bytes of the file at its start.
+    void Map(const size_t reservation, const size_t size, const int mapFlags = 0)
+    {
+        void* base = ::mmap(nullptr, reservation, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (base == MAP_FAILED)
+        {
+            Fail("Can't reserve address space for");
+        }
+
+        if (::mmap(base, size, Protection(), MAP_SHARED | MAP_FIXED | mapFlags, m_Fd, 0) == MAP_FAILED)
+        {
+            ::munmap(base, reservation);
+            Fail("Can't map");
+        }
+
+        m_Base = static_cast<char*>(base);
+        m_Reservation = reservation;
+        m_MappedSize = size;
+    }
+
+    // Maps the file up to newSize, in place when it fits the reservation.
+    bool MapTail(const size_t newSize)
+    {
+        if (newSize > m_Reservation)
+        {
+            char* const oldBase = m_Base;
+            const size_t oldReservation = m_Reservation;
+
+            Map(newSize * 2, newSize);
+            ::munmap(oldBase, oldReservation);
+
+            m_Segment = ExternalBuffer(bipc::open_only, m_Base + USER_OFFSET, newSize - USER_OFFSET);
+            return true;
+        }
+
+        const size_t offset = (m_MappedSize % PageSize() == 0) ? m_MappedSize : 0;
+
+        if (::mmap(m_Base + offset, newSize - offset, Protection(), MAP_SHARED | MAP_FIXED, m_Fd, offset) == MAP_FAILED)
+        {
+            Fail("Can't map");
+        }
+        return false;
+    }
+
+    // Allocates the file blocks right away where the filesystem supports it, so running
+    // out of disk fails here rather than on a later write to the mapping.
+    void Extend(const size_t oldSize, const size_t newSize)
+    {
+#ifdef __linux__
+        if (::fallocate(m_Fd, 0, oldSize, newSize - oldSize) == 0)
+        {
+            return;
+        }
+
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+        {
+            Fail("Can't grow");
+        }
+#endif
+        if (::ftruncate(m_Fd, newSize) != 0)
+        {
+            Fail("Can't grow");
+        }
+    }
+
+    void Close()
+    {
+        if (m_Base)
+        {
+            ::munmap(m_Base, m_Reservation);
+            m_Base = nullptr;
+        }
+
+        // Closing the descriptor also releases a writer's lock.
+        if (m_Fd >= 0)
+        {
+            ::close(m_Fd);
+            m_Fd = -1;
+        }
+    }
+
+    std::atomic<uint32_t>& InitializationFlag() const
+    {
+        return *reinterpret_cast<std::atomic<uint32_t>*>(m_Base);
+    }
+
+    size_t FileSize() const
+    {
+        struct stat status;
+
+        if (::fstat(m_Fd, &status) != 0)
+        {
+            Fail("Can't stat");
+        }
+        return status.st_size;
+    }
+
+    int Protection() const
+    {
+        return (m_ReadOnly) ? PROT_READ : PROT_READ | PROT_WRITE;
+    }
+
+    static size_t PageSize()
+    {
+        static const size_t pageSize = ::sysconf(_SC_PAGESIZE);
+        return pageSize;
+    }
+
+    static size_t RoundToPages(const size_t size)
+    {
+        return (size + PageSize() - 1) / PageSize() * PageSize();
+    }
+
+    [[noreturn]] void Fail(const char* action) const
+    {
+        throw bipc::interprocess_exception((std::string(action) + " " + m_Filename + ": " + std::strerror(errno)).c_str());
+    }
+
+    const std::string m_Filename;
+    const bool m_ReadOnly;
+    int m_Fd {-1};
+    char* m_Base {nullptr};
+    size_t m_Reservation {0};
+    size_t m_MappedSize {0};
+    ExternalBuffer m_Segment;
+};
+} //HardDriveContainers
@@ -0,0 +1,370 @@
+#pragma once
+
+#include "container.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <fnmatch.h>
+
+namespace FsDump
+{
+
+// Trigram index over the distinct file names of a file index, for glob and substring
+// searches. Every name is stored once under its hash, and every trigram and bigram of a
+// name maps to that hash: the values of a gram are its posting list, kept in the Map's
+// value chunks. A search takes the rarest gram of the literal parts of its pattern, the
+// trigrams of runs of three characters or more and the bigrams of shorter ones, e.g. ".h"
+// of "*.h", and matches the names of that posting list against the whole pattern. Only
+// patterns without a literal run of two characters match against every name.
+//
+// Removed names only leave the name table: dropping them from posting lists of millions
+// would take a scan of each. Searches skip the hashes no longer in the table, and names
+// added back get posted again, so candidates are deduplicated. Compact rebuilds the
+// posting lists from the name table, which drops the postings of removed names.
+//
+// Indexes written before bigrams were posted have no FORMAT_KEY: they keep getting
+// trigrams only, and search short literals against every name, until Compact.
+//
+// Searches read like Map::Find and assume no other process writes meanwhile.
+class NameIndex
+{
+public:
+    using NameStorage = HardDriveContainers::Map<uint64_t, std::string>;
+    using PostingStorage = HardDriveContainers::Map<uint32_t, uint64_t>;
+
+    explicit NameIndex(const std::string& filename)
+        : m_PostingsFilename(PostingsFilenameFor(filename))
+        , m_Names(filename.c_str(), DEFAULT_FILE_SIZE, DEFAULT_BUCKET_COUNT)
+        , m_Postings(m_PostingsFilename.c_str(), DEFAULT_FILE_SIZE, DEFAULT_BUCKET_COUNT)
+    {
+        if (m_Postings.Empty())
+        {
+            m_Postings.Insert(FORMAT_KEY, FORMAT_VERSION);
+        }
+        m_Bigrams = m_Postings.Count(FORMAT_KEY) != 0;
+    }
+
+    NameIndex(boost::interprocess::open_read_only_t, const std::string& filename)
+        : m_PostingsFilename(PostingsFilenameFor(filename))
+        , m_Names(boost::interprocess::open_read_only, filename.c_str())
+        , m_Postings(boost::interprocess::open_read_only, m_PostingsFilename.c_str())
+        , m_Bigrams(m_Postings.Count(FORMAT_KEY) != 0)
+    {}
+
+    static std::string FilenameFor(const std::string& storageFile)
+    {
+        return storageFile + ".names";
+    }
+
+    static std::string PostingsFilenameFor(const std::string& filename)
+    {
+        return filename + ".trigrams";
+    }
+
+    // Indexes the names not indexed yet; repeated names cost a lookup each.
+    template <class Names>
+    void Add(const Names& names)
+    {
+        std::vector<std::pair<uint64_t, std::string_view>> added;
+        std::unordered_set<std::string_view> addedNames;
+        std::vector<std::pair<uint32_t, uint64_t>> postings;
+        std::vector<uint32_t> grams;
+
+        for (const auto& name : names)
+        {
+            const std::string_view view = HardDriveContainers::AsStringView(name);
+            const uint64_t hash = m_Hasher(view);
+
+            if (Contains(hash, view) || !addedNames.insert(view).second)
+            {
+                continue;
+            }
+
+            added.emplace_back(hash, view);
+            Grams(view, m_Bigrams, grams);
+
+            for (const uint32_t gram : grams)
+            {
+                postings.emplace_back(gram, hash);
+            }
+        }
+
+        m_Names.InsertBatch(added);
+        m_Postings.InsertBatch(postings);
+    }
+
+    template <typename NameT>
+    void Remove(const NameT& name)
+    {
+        const std::string_view view = HardDriveContainers::AsStringView(name);
+        m_Names.Erase(m_Hasher(view), view);
+    }
+
+    // Calls visit(std::string_view) for every indexed name matching a glob pattern, as
+    // fnmatch(3) matches it.
+    template <typename Visitor>
+    void Glob(const std::string& pattern, Visitor visit) const
+    {
+        std::vector<uint32_t> grams;
+        LiteralGrams(pattern, m_Bigrams, grams);
+
+        auto match = [&](const std::string_view name)
+        {
+            const std::string candidate(name);
+
+            if (::fnmatch(pattern.c_str(), candidate.c_str(), 0) == 0)
+            {
+                visit(name);
+            }
+        };
+
+        if (grams.empty())
+        {
+            m_Names.ForEach([&](uint64_t, const auto& names)
+            {
+                for (const std::string_view name : names)
+                {
+                    match(name);
+                }
+            });
+            return;
+        }
+
+        const std::vector<size_t> counts = m_Postings.CountMany(grams);
+        const size_t rarest = std::min_element(counts.begin(), counts.end()) - counts.begin();
+
+        if (counts[rarest] == 0)
+        {
+            return;
+        }
+
+        const auto postings = m_Postings.FindAll(grams[rarest]);
+        std::vector<uint64_t> candidates(postings.begin(), postings.end());
+
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+        for (const auto& names : m_Names.FindMany(candidates))
+        {
+            for (const std::string_view name : names)
+            {
+                match(name);
+            }
+        }
+    }
+
+    template <typename Visitor>
+    void Substring(const std::string_view text, Visitor visit) const
+    {
+        std::string pattern = "*";
+
+        for (const char character : text)
+        {
+            if (character == '*' || character == '?' || character == '[' || character == '\\')
+            {
+                pattern += '\\';
+            }
+            pattern += character;
+        }
+
+        Glob(pattern += '*', visit);
+    }
+
+    size_t NameCount() const
+    {
+        return m_Names.Size();
+    }
+
+    // Postings of every gram, removed names' included until Compact.
+    size_t PostingCount() const
+    {
+        return m_Postings.Size() - m_Postings.Count(FORMAT_KEY);
+    }
+
+    // Also rebuilds the posting lists from the name table, with bigrams, into a new file
+    // synced and renamed over the old one, as Map::Compact does: readers keep the lists
+    // they opened, and a crash leaves either file whole.
+    void Compact(const size_t maxBytesPerSecond = 0)
+    {
+        m_Names.Compact(maxBytesPerSecond);
+        RebuildPostings();
+        m_Postings.Compact(maxBytesPerSecond);
+    }
+
+private:
+    bool Contains(const uint64_t hash, const std::string_view name) const
+    {
+        for (const std::string_view stored : m_Names.FindAll(hash))
+        {
+            if (stored == name)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void RebuildPostings()
+    {
+        const std::string rebuiltFilename = m_PostingsFilename + ".rebuild";
+        std::vector<std::pair<uint32_t, uint64_t>> postings;
+        std::vector<uint32_t> grams;
+
+        std::remove(rebuiltFilename.c_str());
+
+        try
+        {
+            PostingStorage rebuilt(rebuiltFilename.c_str(), DEFAULT_FILE_SIZE, std::max(m_Postings.BucketCount(), DEFAULT_BUCKET_COUNT));
+
+            rebuilt.Insert(FORMAT_KEY, FORMAT_VERSION);
+
+            m_Names.ForEach([&](const uint64_t hash, const auto& names)
+            {
+                for (const std::string_view name : names)
+                {
+                    Grams(name, true, grams);
+
+                    for (const uint32_t gram : grams)
+                    {
+                        postings.emplace_back(gram, hash);
+                    }
+                }
+
+                if (postings.size() >= REBUILD_BATCH_SIZE)
+                {
+                    rebuilt.InsertBatch(postings);
+                    postings.clear();
+                }
+            });
+
+            rebuilt.InsertBatch(postings);
+        }
+        catch (...)
+        {
+            std::remove(rebuiltFilename.c_str());
+            throw;
+        }
+
+        if (!HardDriveContainers::SyncPath(rebuiltFilename) || std::rename(rebuiltFilename.c_str(), m_PostingsFilename.c_str()) != 0)
+        {
+            std::remove(rebuiltFilename.c_str());
+            throw boost::interprocess::interprocess_exception(("Can't replace " + m_PostingsFilename + " with its rebuilt copy").c_str());
+        }
+
+        m_Postings = PostingStorage(m_PostingsFilename.c_str());
+        m_Bigrams = true;
+
+        if (!HardDriveContainers::SyncPath(HardDriveContainers::DirectoryOf(m_PostingsFilename)))
+        {
+            throw boost::interprocess::interprocess_exception(("Can't sync the directory of " + m_PostingsFilename).c_str());
+        }
+    }
+
+    static uint32_t Trigram(const char* characters)
+    {
+        return uint32_t(uint8_t(characters[0])) << 16 | uint32_t(uint8_t(characters[1])) << 8 | uint8_t(characters[2]);
+    }
+
+    // Bigrams have keys of their own above those of trigrams.
+    static uint32_t Bigram(const char* characters)
+    {
+        return BIGRAM_KEY_BIT | uint32_t(uint8_t(characters[0])) << 8 | uint8_t(characters[1]);
+    }
+
+    static void AppendGram(const uint32_t gram, std::vector<uint32_t>& grams)
+    {
+        if (std::find(grams.begin(), grams.end(), gram) == grams.end())
+        {
+            grams.push_back(gram);
+        }
+    }
+
+    // The distinct trigrams of text, appended to grams.
+    static void AppendTrigrams(const std::string_view text, std::vector<uint32_t>& grams)
+    {
+        for (size_t index = 0; index + 3 <= text.size(); ++index)
+        {
+            AppendGram(Trigram(text.data() + index), grams);
+        }
+    }
+
+    static void AppendBigrams(const std::string_view text, std::vector<uint32_t>& grams)
+    {
+        for (size_t index = 0; index + 2 <= text.size(); ++index)
+        {
+            AppendGram(Bigram(text.data() + index), grams);
+        }
+    }
+
+    static void Grams(const std::string_view name, const bool bigrams, std::vector<uint32_t>& grams)
+    {
+        grams.clear();
+        AppendTrigrams(name, grams);
+
+        if (bigrams)
+        {
+            AppendBigrams(name, grams);
+        }
+    }
+
+    // Grams every name matching the pattern contains: those of its literal runs, which
+    // wildcards, bracket expressions and the ends of the pattern delimit. Runs of two
+    // characters give their bigram if the index has bigrams.
+    static void LiteralGrams(const std::string& pattern, const bool bigrams, std::vector<uint32_t>& grams)
+    {
+        std::string literal;
+
+        for (size_t index = 0; index <= pattern.size(); ++index)
+        {
+            const char character = (index < pattern.size()) ? pattern[index] : '\0';
+
+            if (character == '\\' && index + 1 < pattern.size())
+            {
+                literal += pattern[++index];
+                continue;
+            }
+
+            if (index < pattern.size() && character != '*' && character != '?' && character != '[')
+            {
+                literal += character;
+                continue;
+            }
+
+            if (literal.size() >= 3)
+            {
+                AppendTrigrams(literal, grams);
+            }
+            else if (bigrams)
+            {
+                AppendBigrams(literal, grams);
+            }
+            literal.clear();
+
+            if (character == '[')
+            {
+                const size_t close = pattern.find(']', index + 2);
+                index = (close == std::string::npos) ? pattern.size() : close;
+            }
+        }
+    }
+
+    static constexpr size_t DEFAULT_FILE_SIZE {16 * 1024 * 1024ul};
+    static constexpr size_t DEFAULT_BUCKET_COUNT {64 * 1024ul};
+    static constexpr size_t REBUILD_BATCH_SIZE {1024 * 1024ul};
+    static constexpr uint32_t BIGRAM_KEY_BIT {1u << 24};
+    // Not a gram: its value is the version of the posting format, with bigrams since 1.
+    static constexpr uint32_t FORMAT_KEY {0xFFFFFFFFu};
+    static constexpr uint64_t FORMAT_VERSION {1};
+
+    std::string m_PostingsFilename;
+    NameStorage m_Names;
+    PostingStorage m_Postings;
+    bool m_Bigrams {false};
+    HardDriveContainers::Hash m_Hasher;
+};
+} //FsDump
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <boost/log/trivial.hpp>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace FsDump
+{
+
+// Answers lookups over a kept open index. A request is a file name on its own line; the
+// answer is every path stored for it, one per line, closed by an empty line. Clients may
+// pipeline any number of requests: all complete lines read at once are answered in
+// order with a single write. A request longer than PATH_MAX closes the connection once
+// the requests before it are answered. Writing to a client that went away raises
+// SIGPIPE, which the caller is expected to ignore.
+template <class Storage>
+class QueryServer
+{
+public:
+    explicit QueryServer(const Storage& storage)
+        : m_Storage(storage)
+    {}
+
+    // Serves one client on a pair of descriptors, e.g. stdin and stdout, until the input
+    // ends or stop is set.
+    void ServeStream(const int inputFd, const int outputFd, const std::atomic<bool>& stop)
+    {
+        Connection connection {inputFd, outputFd};
+
+        while (!stop)
+        {
+            pollfd descriptor {inputFd, POLLIN, 0};
+
+            if (::poll(&descriptor, 1, POLL_TIMEOUT_MS) <= 0)
+            {
+                continue;
+            }
+
+            const bool received = Receive(connection);
+            const bool open = Answer(connection) && received;
+
+            while (!connection.output.empty() && Send(connection))
+            {}
+
+            if (!open || !connection.output.empty())
+            {
+                break;
+            }
+        }
+    }
+
+    // Serves any number of clients on a Unix domain socket until stop is set.
+    void ServeSocket(const std::string& path, const std::atomic<bool>& stop)
+    {
+        const int listenFd = Listen(path);
+        std::vector<Connection> connections;
+        std::vector<pollfd> descriptors;
+
+        while (!stop)
+        {
+            descriptors.assign(1, pollfd {listenFd, POLLIN, 0});
+
+            // Requests keep being read while answers are pending, so a client that writes
+            // all its requests before reading does not deadlock, up to a bound on the
+            // answers buffered for it.
+            for (const Connection& connection : connections)
+            {
+                const bool reading = !connection.closing && connection.output.size() - connection.sent < MAX_PENDING_OUTPUT;
+                descriptors.push_back(pollfd {connection.inputFd, short((reading ? POLLIN : 0) | (connection.output.empty() ? 0 : POLLOUT)), 0});
+            }
+
+            if (::poll(descriptors.data(), descriptors.size(), POLL_TIMEOUT_MS) <= 0)
+            {
+                continue;
+            }
+
+            for (size_t index = connections.size(); index-- > 0;)
+            {
+                Connection& connection = connections[index];
+                const short events = descriptors[index + 1].revents;
+                bool alive = true;
+
+                if ((events & (POLLIN | POLLHUP | POLLERR)) && !connection.closing)
+                {
+                    const bool received = Receive(connection);
+                    connection.closing = !Answer(connection) || !received;
+                }
+
+                if (events & (POLLIN | POLLOUT | POLLHUP | POLLERR))
+                {
+                    alive = Send(connection);
+                }
+
+                // A client that shut down its end still gets the answers still pending.
+                if (!alive || (connection.closing && connection.output.empty()))
+                {
+                    ::close(connection.inputFd);
+                    connections.erase(connections.begin() + index);
+                }
+            }
+
+            if (descriptors[0].revents & POLLIN)
+            {
+                const int clientFd = ::accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+                if (clientFd >= 0)
+                {
+                    connections.push_back(Connection {clientFd, clientFd});
+                }
+            }
+        }
+
+        for (const Connection& connection : connections)
+        {
+            ::close(connection.inputFd);
+        }
+        ::close(listenFd);
+        ::unlink(path.c_str());
+    }
+
+private:
+    struct Connection
+    {
+        int inputFd;
+        int outputFd;
+        std::string input;
+        std::string output;
+        size_t sent {0};
+        bool closing {false};
+    };
+
+    // One read per call, so a blocking input never waits for more than the client sent.
+    // Returns false once the client closed its end; an unterminated last request is then
+    // answered as well.
+    bool Receive(Connection& connection)
+    {
+        char buffer[READ_BUFFER_SIZE];
+        const ssize_t bytes = ::read(connection.inputFd, buffer, sizeof(buffer));
+
+        if (bytes > 0)
+        {
+            connection.input.append(buffer, bytes);
+            return true;
+        }
+
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return true;
+        }
+
+        if (!connection.input.empty())
+        {
+            connection.input += '\n';
+        }
+        return false;
+    }
+
+    // Looks all complete requests up in one batch, so their misses overlap. Returns false,
+    // after answering the requests before it, on a request too long to be a file name,
+    // so the input a client can make the server buffer stays bounded.
+    bool Answer(Connection& connection)
+    {
+        std::vector<std::string_view> names;
+        size_t begin = 0;
+
+        for (size_t end; (end = connection.input.find('\n', begin)) != std::string::npos; begin = end + 1)
+        {
+            if (end - begin > MAX_REQUEST_SIZE)
+            {
+                break;
+            }
+
+            std::string_view name(connection.input.data() + begin, end - begin);
+
+            if (!name.empty() && name.back() == '\r')
+            {
+                name.remove_suffix(1);
+            }
+            names.push_back(name);
+        }
+
+        for (const std::vector<std::string>& paths : m_Storage.GetMany(names))
+        {
+            for (const std::string& path : paths)
+            {
+                connection.output += path;
+                connection.output += '\n';
+            }
+            connection.output += '\n';
+        }
+
+        if (connection.input.size() - begin > MAX_REQUEST_SIZE)
+        {
+            BOOST_LOG_TRIVIAL(warning) << "Closing a connection that sent a request over " << MAX_REQUEST_SIZE << " bytes";
+            connection.input.clear();
+            return false;
+        }
+
+        connection.input.erase(0, begin);
+        return true;
+    }
+
+    // Writes as much of the pending output as the descriptor takes. Returns false if the
+    // client is gone.
+    bool Send(Connection& connection)
+    {
+        while (connection.sent < connection.output.size())
+        {
+            const ssize_t bytes = ::write(connection.outputFd, connection.output.data() + connection.sent,
+                                          connection.output.size() - connection.sent);
+
+            if (bytes < 0)
+            {
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            }
+            connection.sent += bytes;
+        }
+
+        connection.output.clear();
+        connection.sent = 0;
+        return true;
+    }
+
+    static int Listen(const std::string& path)
+    {
+        sockaddr_un address {};
+        address.sun_family = AF_UNIX;
+
+        if (path.size() >= sizeof(address.sun_path))
+        {
+            throw std::runtime_error("Socket path is too long: " + path);
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+        const int listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        ::unlink(path.c_str());
+
+        if (listenFd < 0 || ::bind(listenFd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+            ::listen(listenFd, SOMAXCONN) != 0)
+        {
+            const std::string error = std::strerror(errno);
+
+            if (listenFd >= 0)
+            {
+                ::close(listenFd);
+            }
+            throw std::runtime_error("Can't listen on " + path + ": " + error);
+        }
+        return listenFd;
+    }
+
+    static constexpr int POLL_TIMEOUT_MS {250};
+    static constexpr size_t READ_BUFFER_SIZE {64 * 1024};
+    static constexpr size_t MAX_PENDING_OUTPUT {64 * 1024 * 1024};
+
+public:
+    // Longest request line, without its line break.
+    static constexpr size_t MAX_REQUEST_SIZE {PATH_MAX};
+
+private:
+
+    const Storage& m_Storage;
+};
+} //FsDump
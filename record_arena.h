@@ -0,0 +1,203 @@
+#pragma once
+
+#include <boost/interprocess/managed_mapped_file.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace HardDriveContainers
+{
+
+namespace bipc = boost::interprocess;
+
+// Size-class allocator for the records of a Map, kept inside the mapped segment next to
+// the data it manages. Records up to MAX_SMALL_RECORD_SIZE are rounded up to a multiple
+// of SIZE_CLASS_STEP and come from the free list of their class, or else are carved off
+// the class's current slab. Slabs come from the segment manager and double in size up to
+// MAX_SLAB_SIZE; they are never given back, freed records only return to their list.
+// Callers pass a record's size back when freeing it, so records carry no header at all,
+// where the segment manager keeps one per allocation. Larger records go to the segment
+// manager directly.
+//
+// Not synchronized: a Map has a single writer, so there is nothing to gain from locks or
+// per-thread caches.
+class RecordArena
+{
+public:
+    using segment_manager = bipc::managed_mapped_file::segment_manager;
+
+    RecordArena() = default;
+    RecordArena(const RecordArena&) = delete;
+    RecordArena& operator =(const RecordArena&) = delete;
+
+    void* Allocate(segment_manager* segmentManager, const size_t bytes)
+    {
+        if (bytes > MAX_SMALL_RECORD_SIZE)
+        {
+            return segmentManager->allocate(bytes);
+        }
+
+        const size_t sizeClass = SizeClass(bytes);
+        FreeRecordPtr& freeList = m_FreeLists[sizeClass];
+
+        if (freeList)
+        {
+            FreeRecordT* record = freeList.get();
+            freeList = record->next;
+            return record;
+        }
+
+        SlabT& slab = m_Slabs[sizeClass];
+
+        if (slab.cursor == slab.end)
+        {
+            AllocateSlab(segmentManager, sizeClass);
+        }
+
+        char* record = slab.cursor.get();
+        slab.cursor += ClassSize(sizeClass);
+        return record;
+    }
+
+    void Deallocate(segment_manager* segmentManager, void* record, const size_t bytes)
+    {
+        if (bytes > MAX_SMALL_RECORD_SIZE)
+        {
+            segmentManager->deallocate(record);
+            return;
+        }
+
+        FreeRecordPtr& freeList = m_FreeLists[SizeClass(bytes)];
+        FreeRecordT* freed = new (record) FreeRecordT;
+
+        freed->next = freeList;
+        freeList = freed;
+    }
+
+    // Carves records of the given sizes, in order, out of a single block, e.g. for a batch
+    // laid out in the order it will be read. Small records join the free lists when freed,
+    // like any others; larger ones come from the segment manager one by one.
+    template <class Records>
+    void AllocateContiguous(segment_manager* segmentManager, const Records& sizes, std::vector<void*>& records)
+    {
+        size_t blockBytes = 0;
+
+        for (const size_t bytes : sizes)
+        {
+            blockBytes += (bytes > MAX_SMALL_RECORD_SIZE) ? 0 : RoundUp(bytes);
+        }
+
+        char* block = (blockBytes != 0) ? static_cast<char*>(segmentManager->allocate(blockBytes)) : nullptr;
+
+        records.clear();
+        records.reserve(sizes.size());
+
+        for (const size_t bytes : sizes)
+        {
+            if (bytes > MAX_SMALL_RECORD_SIZE)
+            {
+                records.push_back(segmentManager->allocate(bytes));
+            }
+            else
+            {
+                records.push_back(block);
+                block += RoundUp(bytes);
+            }
+        }
+    }
+
+    // Bytes of small records on the free lists or not yet carved off slabs: allocated from
+    // the segment manager, but holding no record. Walks every free list.
+    size_t FreeBytes() const
+    {
+        size_t bytes = 0;
+
+        for (size_t sizeClass = 0; sizeClass < CLASS_COUNT; ++sizeClass)
+        {
+            for (const FreeRecordT* record = m_FreeLists[sizeClass].get(); record; record = record->next.get())
+            {
+                bytes += ClassSize(sizeClass);
+            }
+            bytes += m_Slabs[sizeClass].end - m_Slabs[sizeClass].cursor;
+        }
+        return bytes;
+    }
+
+    // The bytes a record of the given size really gets, for records that can use slack.
+    static size_t RoundUp(const size_t bytes)
+    {
+        return (bytes > MAX_SMALL_RECORD_SIZE) ? bytes : ClassSize(SizeClass(bytes));
+    }
+
+    static constexpr size_t SIZE_CLASS_STEP {8};
+    static constexpr size_t MAX_SMALL_RECORD_SIZE {1024};
+    static constexpr size_t MIN_SLAB_RECORDS {16};
+    static constexpr size_t MAX_SLAB_SIZE {64 * 1024};
+
+private:
+    struct FreeRecordT;
+    using FreeRecordPtr = bipc::offset_ptr<FreeRecordT>;
+
+    struct FreeRecordT
+    {
+        FreeRecordPtr next {nullptr};
+    };
+
+    struct SlabT
+    {
+        bipc::offset_ptr<char> cursor {nullptr};
+        bipc::offset_ptr<char> end {nullptr};
+        size_t totalBytes {0};
+    };
+
+    static constexpr size_t CLASS_COUNT {MAX_SMALL_RECORD_SIZE / SIZE_CLASS_STEP};
+
+    static_assert(sizeof(FreeRecordT) <= SIZE_CLASS_STEP * 2, "The smallest records must hold a free list link");
+
+    // Sizes below two steps share the smallest class, so a freed record fits a link.
+    static size_t SizeClass(const size_t bytes)
+    {
+        return std::max<size_t>((bytes + SIZE_CLASS_STEP - 1) / SIZE_CLASS_STEP, 2) - 1;
+    }
+
+    static size_t ClassSize(const size_t sizeClass)
+    {
+        return (sizeClass + 1) * SIZE_CLASS_STEP;
+    }
+
+    // Each slab is as large as all earlier slabs of the class together, within bounds.
+    // Short of memory for that, smaller slabs are tried, down to a single record.
+    void AllocateSlab(segment_manager* segmentManager, const size_t sizeClass)
+    {
+        SlabT& slab = m_Slabs[sizeClass];
+        const size_t classSize = ClassSize(sizeClass);
+        size_t records = std::min(std::max(slab.totalBytes, classSize * MIN_SLAB_RECORDS), MAX_SLAB_SIZE) / classSize;
+        void* memory = nullptr;
+
+        for (; records > 1; records /= 2)
+        {
+            memory = segmentManager->allocate(records * classSize, std::nothrow);
+
+            if (memory)
+            {
+                break;
+            }
+        }
+
+        if (!memory)
+        {
+            records = 1;
+            memory = segmentManager->allocate(classSize);
+        }
+
+        slab.cursor = static_cast<char*>(memory);
+        slab.end = slab.cursor + records * classSize;
+        slab.totalBytes += records * classSize;
+    }
+
+    FreeRecordPtr m_FreeLists[CLASS_COUNT];
+    SlabT m_Slabs[CLASS_COUNT];
+};
+} //HardDriveContainers
@@ -0,0 +1,476 @@
+#pragma once
+
+#include "container.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace HardDriveContainers
+{
+
+// A Map split by key hash over shards, each a Map of its own file: filename.0 to
+// filename.N-1, their count recorded in the manifest filename.shards. A shard grows,
+// remaps and compacts on its own. Every key lives in exactly one shard, so a lookup
+// touches one file; a missing shard keeps the map from opening, rather than routing keys
+// by a wrong count, and Remove then clears the rest.
+//
+// Modifications lock the shard they write to, so threads of one process may write at
+// once and only wait on each other for the same shard; InsertBatch splits its pairs by
+// shard and takes the free shards first. Lookups take no lock: like Map's, they are safe
+// against writers in other processes, not against one writing through this object.
+template <class Key,
+         class Value,
+         class KeyHash = Hash,
+         class KeyEqual = EqualTo>
+class ShardedMap
+{
+public:
+    using Shard = Map<Key, Value, KeyHash, KeyEqual>;
+    using key_type = Key;
+    using value_type = Value;
+    using ValuePtr = typename Shard::ValuePtr;
+    using ValueRange = typename Shard::ValueRange;
+
+    // Opens the shards of filename, creating shardCount of them if there is no manifest.
+    // Existing maps keep the shard count of their manifest, whatever shardCount is passed,
+    // and throw if one of their shards is missing. fileSize and bucketCount are for the
+    // whole map and split evenly over newly created shards.
+    explicit ShardedMap(const char* filename, const size_t shardCount = DEFAULT_SHARD_COUNT,
+                        const size_t fileSize = Shard::DEFAULT_FILE_SIZE, const size_t bucketCount = Shard::DEFAULT_BUCKET_COUNT)
+    {
+        size_t count = ReadManifest(filename);
+
+        if (count == 0)
+        {
+            count = std::max(shardCount, 1ul);
+            CreateManifest(filename, count);
+        }
+        else
+        {
+            CheckShards(filename, count);
+        }
+
+        m_Shards.reserve(count);
+        m_Locks.reset(new std::mutex[count]);
+
+        for (size_t index = 0; index < count; ++index)
+        {
+            m_Shards.emplace_back(FilenameFor(filename, index).c_str(), fileSize / count, std::max(bucketCount / count, 1ul));
+        }
+    }
+
+    // Opens existing shards without write access, as Map does.
+    ShardedMap(bipc::open_read_only_t, const char* filename, const PrewarmOptions& prewarm = PrewarmOptions())
+    {
+        const size_t count = ReadManifest(filename);
+
+        if (count == 0)
+        {
+            throw bipc::interprocess_exception((std::string("No shard manifest ") + ManifestFilenameFor(filename) + " found").c_str());
+        }
+
+        CheckShards(filename, count);
+        m_Shards.reserve(count);
+        m_Locks.reset(new std::mutex[count]);
+
+        for (size_t index = 0; index < count; ++index)
+        {
+            m_Shards.emplace_back(bipc::open_read_only, FilenameFor(filename, index).c_str(), prewarm);
+        }
+    }
+
+    ShardedMap(const ShardedMap&) = delete;
+    ShardedMap& operator =(const ShardedMap&) = delete;
+
+    static std::string FilenameFor(const std::string& filename, const size_t index)
+    {
+        return filename + "." + std::to_string(index);
+    }
+
+    // The manifest records the shard count, shards are routed by it.
+    static std::string ManifestFilenameFor(const std::string& filename)
+    {
+        return filename + ".shards";
+    }
+
+    // The files of the shards of filename, as many as its manifest records, whether they
+    // exist or not. Empty without a manifest.
+    static std::vector<std::string> ShardFilenames(const std::string& filename)
+    {
+        std::vector<std::string> filenames;
+
+        for (size_t index = 0, count = ReadManifest(filename); index < count; ++index)
+        {
+            filenames.push_back(FilenameFor(filename, index));
+        }
+        return filenames;
+    }
+
+    static bool Exists(const std::string& filename)
+    {
+        return ReadManifest(filename) != 0;
+    }
+
+    // Removes the manifest and every shard it records.
+    static void Remove(const std::string& filename)
+    {
+        for (const std::string& shardFilename : ShardFilenames(filename))
+        {
+            std::remove(shardFilename.c_str());
+        }
+        std::remove(ManifestFilenameFor(filename).c_str());
+    }
+
+    template <typename ProvidedKeyT, typename ProvidedValueT>
+    void Insert(const ProvidedKeyT& key, const ProvidedValueT& value)
+    {
+        const size_t index = ShardOf(key);
+        std::lock_guard<std::mutex> lock(m_Locks[index]);
+
+        m_Shards[index].Insert(key, value);
+    }
+
+    // Map::InsertBatch of the pairs of every shard, with that shard locked. Shards another
+    // thread holds are tried again after the others.
+    template <typename Iterator>
+    void InsertBatch(Iterator first, Iterator last)
+    {
+        using PairT = typename std::iterator_traits<Iterator>::value_type;
+        using EntryT = std::pair<const decltype(PairT::first)&, const decltype(PairT::second)&>;
+
+        std::vector<std::vector<EntryT>> shardPairs(m_Shards.size());
+        std::vector<size_t> pending;
+
+        for (; first != last; ++first)
+        {
+            shardPairs[ShardOf(first->first)].emplace_back(first->first, first->second);
+        }
+
+        for (size_t index = 0; index < m_Shards.size(); ++index)
+        {
+            if (!shardPairs[index].empty())
+            {
+                pending.push_back(index);
+            }
+        }
+
+        while (!pending.empty())
+        {
+            const size_t pendingBefore = pending.size();
+
+            for (auto index = pending.begin(); index != pending.end();)
+            {
+                std::unique_lock<std::mutex> lock(m_Locks[*index], std::try_to_lock);
+
+                if (!lock.owns_lock())
+                {
+                    ++index;
+                    continue;
+                }
+
+                m_Shards[*index].InsertBatch(shardPairs[*index]);
+                index = pending.erase(index);
+            }
+
+            if (!pending.empty() && pending.size() == pendingBefore)
+            {
+                std::lock_guard<std::mutex> lock(m_Locks[pending.front()]);
+
+                m_Shards[pending.front()].InsertBatch(shardPairs[pending.front()]);
+                pending.erase(pending.begin());
+            }
+        }
+    }
+
+    template <typename Range>
+    void InsertBatch(const Range& pairs)
+    {
+        InsertBatch(std::begin(pairs), std::end(pairs));
+    }
+
+    template <typename ProvidedKeyT>
+    ValuePtr Find(const ProvidedKeyT& key) const
+    {
+        return m_Shards[ShardOf(key)].Find(key);
+    }
+
+    template <typename ProvidedKeyT>
+    ValueRange FindAll(const ProvidedKeyT& key) const
+    {
+        return m_Shards[ShardOf(key)].FindAll(key);
+    }
+
+    template <typename ProvidedKeyT>
+    std::optional<Value> Get(const ProvidedKeyT& key) const
+    {
+        return m_Shards[ShardOf(key)].Get(key);
+    }
+
+    template <typename ProvidedKeyT>
+    std::vector<Value> GetAll(const ProvidedKeyT& key) const
+    {
+        return m_Shards[ShardOf(key)].GetAll(key);
+    }
+
+    // Map::GetMany of the keys of every shard, results in the order of keys.
+    template <typename Range>
+    std::vector<std::vector<Value>> GetMany(const Range& keys) const
+    {
+        std::vector<std::vector<LookupKeyT>> shardKeys(m_Shards.size());
+        std::vector<size_t> keyShards;
+
+        for (const auto& key : keys)
+        {
+            keyShards.push_back(ShardOf(key));
+            shardKeys[keyShards.back()].push_back(LookupKey(key));
+        }
+
+        std::vector<std::vector<std::vector<Value>>> shardResults(m_Shards.size());
+        std::vector<size_t> consumed(m_Shards.size(), 0);
+        std::vector<std::vector<Value>> results;
+
+        for (size_t index = 0; index < m_Shards.size(); ++index)
+        {
+            if (!shardKeys[index].empty())
+            {
+                shardResults[index] = m_Shards[index].GetMany(shardKeys[index]);
+            }
+        }
+
+        results.reserve(keyShards.size());
+
+        for (const size_t index : keyShards)
+        {
+            results.push_back(std::move(shardResults[index][consumed[index]++]));
+        }
+        return results;
+    }
+
+    // Calls visit(key_view, ValueRange) for every key, shard by shard. Like Map::ForEach,
+    // assumes no other process writes meanwhile.
+    template <typename Visitor>
+    void ForEach(Visitor visit) const
+    {
+        for (const Shard& shard : m_Shards)
+        {
+            shard.ForEach(visit);
+        }
+    }
+
+    // Map::ForEachInRange over the buckets of all shards, numbered shard after shard, so
+    // threads may split BucketCount() into disjoint ranges as they would for a Map.
+    template <typename Visitor>
+    void ForEachInRange(const size_t bucketBegin, const size_t bucketEnd, Visitor visit) const
+    {
+        size_t shardBegin = 0;
+
+        for (const Shard& shard : m_Shards)
+        {
+            const size_t shardEnd = shardBegin + shard.BucketCount();
+
+            if (bucketBegin < shardEnd && shardBegin < bucketEnd)
+            {
+                shard.ForEachInRange(std::max(bucketBegin, shardBegin) - shardBegin, std::min(bucketEnd, shardEnd) - shardBegin, visit);
+            }
+            shardBegin = shardEnd;
+        }
+    }
+
+    template <typename ProvidedKeyT>
+    size_t Erase(const ProvidedKeyT& key)
+    {
+        const size_t index = ShardOf(key);
+        std::lock_guard<std::mutex> lock(m_Locks[index]);
+
+        return m_Shards[index].Erase(key);
+    }
+
+    template <typename ProvidedKeyT, typename ProvidedValueT>
+    size_t Erase(const ProvidedKeyT& key, const ProvidedValueT& value)
+    {
+        const size_t index = ShardOf(key);
+        std::lock_guard<std::mutex> lock(m_Locks[index]);
+
+        return m_Shards[index].Erase(key, value);
+    }
+
+    template <typename ProvidedKeyT>
+    size_t Count(const ProvidedKeyT& key) const
+    {
+        return m_Shards[ShardOf(key)].Count(key);
+    }
+
+    // Compacts the shards one at a time, each locked meanwhile, so maxBytesPerSecond
+    // holds for the whole map.
+    void Compact(const size_t maxBytesPerSecond = 0)
+    {
+        for (size_t index = 0; index < m_Shards.size(); ++index)
+        {
+            CompactShard(index, maxBytesPerSecond);
+        }
+    }
+
+    void CompactShard(const size_t index, const size_t maxBytesPerSecond = 0)
+    {
+        std::lock_guard<std::mutex> lock(m_Locks[index]);
+
+        m_Shards[index].Compact(maxBytesPerSecond);
+    }
+
+    size_t Size() const
+    {
+        size_t size = 0;
+
+        for (const Shard& shard : m_Shards)
+        {
+            size += shard.Size();
+        }
+        return size;
+    }
+
+    bool Empty() const
+    {
+        return Size() == 0;
+    }
+
+    size_t BucketCount() const
+    {
+        size_t bucketCount = 0;
+
+        for (const Shard& shard : m_Shards)
+        {
+            bucketCount += shard.BucketCount();
+        }
+        return bucketCount;
+    }
+
+    size_t ShardCount() const
+    {
+        return m_Shards.size();
+    }
+
+    const Shard& GetShard(const size_t index) const
+    {
+        return m_Shards[index];
+    }
+
+    // The counters of all shards added up.
+    MapCounters Counters() const
+    {
+        MapCounters counters;
+
+        for (const Shard& shard : m_Shards)
+        {
+            const MapCounters shardCounters = shard.Counters();
+
+            counters.inserts += shardCounters.inserts;
+            counters.erases += shardCounters.erases;
+            counters.lookups += shardCounters.lookups;
+            counters.chainSteps += shardCounters.chainSteps;
+            counters.remaps += shardCounters.remaps;
+            counters.grows += shardCounters.grows;
+        }
+        return counters;
+    }
+
+    static constexpr size_t DEFAULT_SHARD_COUNT {8};
+
+private:
+    // The shard count of the manifest of filename, 0 if there is none.
+    static size_t ReadManifest(const std::string& filename)
+    {
+        std::ifstream manifest(ManifestFilenameFor(filename));
+        std::string magic;
+        uint32_t formatVersion = 0;
+        size_t count = 0;
+
+        if (!manifest.is_open())
+        {
+            return 0;
+        }
+
+        if (!(manifest >> magic >> formatVersion >> count) || magic != MANIFEST_MAGIC || formatVersion != MANIFEST_FORMAT_VERSION || count == 0)
+        {
+            throw bipc::interprocess_exception(("Shard manifest " + ManifestFilenameFor(filename) + " is corrupted").c_str());
+        }
+        return count;
+    }
+
+    // Written before the shards, so that Remove finds all of them even after a creation cut
+    // short. Shard files left without a manifest belong to no map and are started over.
+    static void CreateManifest(const std::string& filename, const size_t count)
+    {
+        const std::string manifestFilename = ManifestFilenameFor(filename);
+        const std::string temporaryFilename = manifestFilename + ".tmp";
+        std::ofstream manifest(temporaryFilename, std::ios::trunc);
+
+        manifest << MANIFEST_MAGIC << ' ' << MANIFEST_FORMAT_VERSION << ' ' << count << '\n';
+        manifest.close();
+
+        if (!manifest || std::rename(temporaryFilename.c_str(), manifestFilename.c_str()) != 0)
+        {
+            std::remove(temporaryFilename.c_str());
+            throw bipc::interprocess_exception(("Can't write shard manifest " + manifestFilename).c_str());
+        }
+
+        for (size_t index = 0; index < count; ++index)
+        {
+            std::remove(FilenameFor(filename, index).c_str());
+        }
+    }
+
+    // A missing shard would route the keys of every other one to it: the map must not open.
+    static void CheckShards(const std::string& filename, const size_t count)
+    {
+        for (size_t index = 0; index < count; ++index)
+        {
+            if (!std::ifstream(FilenameFor(filename, index)).is_open())
+            {
+                throw bipc::interprocess_exception(("Shard " + FilenameFor(filename, index) + " of " + std::to_string(count) + " is missing").c_str());
+            }
+        }
+    }
+
+    using LookupKeyT = std::conditional_t<IsStringLike<Key>::value, std::string_view, Key>;
+
+    template <typename T>
+    static LookupKeyT LookupKey(const T& key)
+    {
+        if constexpr (IsStringLike<Key>::value)
+        {
+            return AsStringView(key);
+        }
+        else
+        {
+            return Key(key);
+        }
+    }
+
+    // Shards take the high half of a multiplicative hash of the key hash: Map buckets take
+    // the key hash modulo their count, so the shard must not be its low bits too.
+    template <typename T>
+    size_t ShardOf(const T& key) const
+    {
+        const uint64_t hash = m_KeyHasher(LookupKey(key));
+        return ((hash * SHARD_HASH_MULTIPLIER) >> 32) % m_Shards.size();
+    }
+
+    static constexpr uint64_t SHARD_HASH_MULTIPLIER {0x9E3779B97F4A7C15ull};
+    static constexpr char MANIFEST_MAGIC[] {"HDMSHARDS"};
+    static constexpr uint32_t MANIFEST_FORMAT_VERSION {1};
+
+    std::vector<Shard> m_Shards;
+    std::unique_ptr<std::mutex[]> m_Locks;
+    KeyHash m_KeyHasher;
+};
+} //HardDriveContainers